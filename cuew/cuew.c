@@ -131,6 +131,18 @@ tcuMemHostAlloc *cuMemHostAlloc;
 tcuMemHostGetDevicePointer_v2 *cuMemHostGetDevicePointer_v2;
 tcuMemHostGetFlags *cuMemHostGetFlags;
 tcuMemAllocManaged *cuMemAllocManaged;
+tcuMemAddressReserve *cuMemAddressReserve;
+tcuMemAddressFree *cuMemAddressFree;
+tcuMemCreate *cuMemCreate;
+tcuMemRelease *cuMemRelease;
+tcuMemMap *cuMemMap;
+tcuMemUnmap *cuMemUnmap;
+tcuMemSetAccess *cuMemSetAccess;
+tcuMemGetAllocationGranularity *cuMemGetAllocationGranularity;
+tcuMemAllocAsync *cuMemAllocAsync;
+tcuMemFreeAsync *cuMemFreeAsync;
+tcuDeviceGetDefaultMemPool *cuDeviceGetDefaultMemPool;
+tcuMemPoolSetAttribute *cuMemPoolSetAttribute;
 tcuDeviceGetByPCIBusId *cuDeviceGetByPCIBusId;
 tcuDeviceGetPCIBusId *cuDeviceGetPCIBusId;
 tcuIpcGetEventHandle *cuIpcGetEventHandle;
@@ -440,6 +452,18 @@ static int cuewCudaInit(void) {
   CUDA_LIBRARY_FIND(cuMemHostGetDevicePointer_v2);
   CUDA_LIBRARY_FIND(cuMemHostGetFlags);
   CUDA_LIBRARY_FIND(cuMemAllocManaged);
+  CUDA_LIBRARY_FIND(cuMemAddressReserve);
+  CUDA_LIBRARY_FIND(cuMemAddressFree);
+  CUDA_LIBRARY_FIND(cuMemCreate);
+  CUDA_LIBRARY_FIND(cuMemRelease);
+  CUDA_LIBRARY_FIND(cuMemMap);
+  CUDA_LIBRARY_FIND(cuMemUnmap);
+  CUDA_LIBRARY_FIND(cuMemSetAccess);
+  CUDA_LIBRARY_FIND(cuMemGetAllocationGranularity);
+  CUDA_LIBRARY_FIND(cuMemAllocAsync);
+  CUDA_LIBRARY_FIND(cuMemFreeAsync);
+  CUDA_LIBRARY_FIND(cuDeviceGetDefaultMemPool);
+  CUDA_LIBRARY_FIND(cuMemPoolSetAttribute);
   CUDA_LIBRARY_FIND(cuDeviceGetByPCIBusId);
   CUDA_LIBRARY_FIND(cuDeviceGetPCIBusId);
   CUDA_LIBRARY_FIND(cuIpcGetEventHandle);
@@ -0,0 +1,14 @@
+﻿#include "cuda.h"
+#include "utils.h"
+
+// Combine src into dst element by element. op is a ReduceOp: 0 sum, 1 min, 2 max
+extern "C"
+KERNEL void reduce(float *dst, const float *src, int n, int op)
+{
+    const int i = getGlobalID(0);
+    if (i < n) {
+        const float a = dst[i];
+        const float b = src[i];
+        dst[i] = (op == 0) ? a + b : (op == 1) ? fminf(a, b) : fmaxf(a, b);
+    }
+}
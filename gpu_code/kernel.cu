@@ -1,5 +1,6 @@
 ﻿#include "cuda.h"
 #include "utils.h"
+#include "filter.h"
 
 const int N = 1 << 20;
 
@@ -12,6 +13,37 @@ KERNEL void kernel(float *x, int n)
     }
 }
 
+extern "C"
+KERNEL void fill(float *x, int offset, int n)
+{
+    const int i = getGlobalID(0);
+    if (i < n) {
+        x[i] = sqrtf(float(offset + i));
+    }
+}
+
+// Written from the host with a ConstantBuffer
+__constant__ FilterParams filterParams;
+
+extern "C"
+KERNEL void filter(float *y, const float *x, int n)
+{
+	const int i = getGlobalID(0);
+	if (i < n) {
+		y[i] = applyFilter(filterParams, x, n, i);
+	}
+}
+
+// The same filter with its parameters passed by value, see Kernel::addParamValue
+extern "C"
+KERNEL void filterByValue(float *y, const float *x, int n, FilterParams params)
+{
+	const int i = getGlobalID(0);
+	if (i < n) {
+		y[i] = applyFilter(params, x, n, i);
+	}
+}
+
 extern "C"
 KERNEL void dummyGlobal(float *C, float *A, float *B) {
     
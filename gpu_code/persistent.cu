@@ -0,0 +1,55 @@
+﻿#include "cuda.h"
+#include "utils.h"
+#include "taskqueue.h"
+
+// Number of blocks done with the task in every slot. The last one resets it
+__device__ unsigned int finishedBlocks[PERSISTENT_QUEUE_SIZE];
+
+// Runs until it receives PERSISTENT_TASK_EXIT. Every block takes part in every task
+extern "C"
+KERNEL void persistent(PersistentQueue *queue)
+{
+    __shared__ PersistentTask task;
+
+    for (unsigned int ticket = 1; ; ticket++) {
+        const unsigned int slotIndex = (ticket - 1) % PERSISTENT_QUEUE_SIZE;
+        volatile PersistentSlot &slot = queue->slots[slotIndex];
+
+        if (threadIdx.x == 0) {
+            while (slot.ticket != ticket) {
+                // Poll until the host publishes the task
+            }
+            __threadfence_system();
+            task.type = slot.task.type;
+            task.count = slot.task.count;
+            task.ptr[0] = slot.task.ptr[0];
+            task.ptr[1] = slot.task.ptr[1];
+            task.ints[0] = slot.task.ints[0];
+            task.ints[1] = slot.task.ints[1];
+            task.floats[0] = slot.task.floats[0];
+            task.floats[1] = slot.task.floats[1];
+        }
+        __syncthreads();
+
+        const int type = task.type;
+        if (type != PERSISTENT_TASK_EXIT) {
+            for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < task.count; i += gridDim.x * blockDim.x) {
+                runPersistentItem(task, i);
+            }
+        }
+        __syncthreads();
+
+        if (threadIdx.x == 0) {
+            // Results must be visible before anyone learns the task is done
+            __threadfence();
+            if (atomicAdd(&finishedBlocks[slotIndex], 1) == gridDim.x - 1) {
+                finishedBlocks[slotIndex] = 0;
+                __threadfence_system();
+                queue->completed = ticket;
+            }
+        }
+        if (type == PERSISTENT_TASK_EXIT) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "progress.h"
+
+#include <string>
+
+namespace a7az0th {
+
+// Run one of the built in benchmarks. Started with "devman --bench <name>"
+// @param name The benchmark to run. An unknown name lists the available ones
+// @returns 0 on success
+int runBenchmark(const std::string &name, ProgressCallback &progress);
+
+} //namespace a7az0th
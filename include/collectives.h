@@ -0,0 +1,108 @@
+#pragma once
+
+#include "devman.h"
+#include "peer.h"
+#include "progress.h"
+#include "topology.h"
+
+#include <string>
+#include <vector>
+
+namespace a7az0th {
+
+// How values from different devices are combined
+enum class ReduceOp {
+	Sum = 0,
+	Min = 1,
+	Max = 2,
+};
+
+// Broadcast, reduce and all-reduce of float buffers across a group of devices.
+// Devices are arranged in a ring that follows the topology, so neighbours are connected by the fastest links available
+// and the ring walks an NVLink clique before leaving it. Buffers are moved in chunks, and every device forwards a chunk
+// as soon as it has it, so all links along the ring are busy at the same time.
+// Reductions run on the device owning the data: the reduce kernel of gpu_code/collectives.cu on GPUs, and its host
+// version on emulators.
+// Every call is blocking and returns once the result is in place. Work writing the buffers must be complete before the call.
+// Not safe to use from several threads at once.
+struct Collectives {
+	// Size of a single chunk of a pipelined transfer
+	static const size_t DEFAULT_CHUNK_SIZE = 1024 * 1024;
+
+	// @param devices The devices taking part
+	// @param numDevices Number of devices in the array
+	// @param topology Link information of the devices. Must be built from the same device array
+	// @param router Used for all transfers between devices. Must be built from the same device array
+	// @param chunkSize Size in bytes of a single pipelined transfer
+	// @param threadman Optional. Spreads reductions on emulators over the CPU cores
+	Collectives(Device* devices, int numDevices, const Topology &topology, PeerRouter &router, ProgressCallback &progress, size_t chunkSize = DEFAULT_CHUNK_SIZE, ThreadManager *threadman = nullptr);
+	~Collectives();
+
+	// Allocate the per-device resources and load the reduce kernel on every GPU
+	// @param ptxFile The compiled gpu_code/collectives.cu. Not used by emulators
+	CUresult init(const std::string &ptxFile);
+
+	// Copy the first count floats of the root's buffer into the buffers of all other devices
+	// @param buffers One buffer per device, in device order. Every buffer must hold at least count floats
+	CUresult broadcast(const std::vector<DeviceBuffer*> &buffers, int count, int root);
+
+	// Combine the first count floats of all buffers element by element and leave the result in the root's buffer.
+	// The contents of the other buffers are undefined afterwards
+	CUresult reduce(const std::vector<DeviceBuffer*> &buffers, int count, int root, ReduceOp op);
+
+	// Combine the first count floats of all buffers element by element and leave the result in every buffer.
+	// Ring algorithm: a reduce-scatter followed by an all-gather, each moving (numDevices-1)/numDevices of the data per link
+	CUresult allReduce(const std::vector<DeviceBuffer*> &buffers, int count, ReduceOp op);
+
+	// Return the order in which data travels around the devices
+	const std::vector<int>& getRing() const { return ring; }
+
+	int getDeviceCount() const { return numDevices; }
+private:
+	// Resources owned per device
+	struct DeviceSlot {
+		ThreadData *launcher;  //< Stream all transfers into the device and its reductions are enqueued on
+		Kernel *kernel;        //< The reduce kernel
+		CUmodule module;       //< Module the reduce kernel was loaded from. Null for emulators
+		DeviceBuffer *scratch; //< Receives one chunk before it is reduced into the device's buffer
+		CUevent done[2];       //< Recorded when the device completes a step. Alternates between consecutive steps
+	};
+
+	// Order the devices so that neighbours are connected by the fastest links
+	void buildRing(const Topology &topology);
+
+	// Return the ring rotated so that it starts at the given device
+	std::vector<int> getRingFrom(int root) const;
+
+	// Check the arguments of a collective call
+	CUresult validate(const std::vector<DeviceBuffer*> &buffers, int count, int root) const;
+
+	// Enqueue a copy of count floats from device src to device dst
+	// @param srcStep The step of src the data was produced in. Negative if the data was there from the start
+	CUresult transfer(DeviceBuffer &dstBuffer, int dst, size_t dstOffset, const DeviceBuffer &srcBuffer, int src, size_t srcOffset, int count, int srcStep);
+
+	// Enqueue the reduction of count floats of the device's scratch buffer into its buffer at the given offset
+	CUresult reduceScratch(DeviceBuffer &buffer, int device, size_t offset, int count, ReduceOp op);
+
+	// Mark the end of the device's work for the given step
+	CUresult record(int device, int step);
+
+	// Wait for all devices to finish
+	CUresult finish();
+
+	void freeMem();
+
+	Device *devices;
+	int numDevices;
+	PeerRouter &router;
+	ProgressCallback &progress;
+	ThreadManager *threadman;      //< Passed on to the launchers of emulators. May be null
+	int chunkCount;                //< Number of floats in a single chunk
+	std::vector<int> ring;         //< Device order along the ring
+	std::vector<DeviceSlot> slots; //< One per device
+
+	Collectives(const Collectives&) = delete;
+	Collectives& operator=(const Collectives&) = delete;
+};
+
+} //namespace a7az0th
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "devman.h"
+
+#include <string>
+#include <vector>
+
+namespace a7az0th {
+
+// A __constant__ variable of a module, such as the filterParams of gpu_code/kernel.cu, written from the host.
+// Suits small uniform parameters that every work item reads: they are cached on the device and need neither
+// a DeviceBuffer nor a kernel argument. Writes go into a host copy first and reach the device with flush(),
+// which enqueues a single copy of everything written since the previous flush on the stream. Launches enqueued on the
+// same stream afterwards see the new values, launches enqueued before still see the old ones.
+// Launches on other streams of the device share the variable and are not ordered with the copy.
+// Not safe to use from several threads at once.
+struct ConstantBuffer {
+	// Find the variable in a module loaded on the current context
+	// @param name The name of the variable in the GPU code
+	ConstantBuffer(const std::string &name, CUmodule module);
+
+	// Use a host variable in place of the __constant__ one, for emulated kernels
+	// @param hostSymbol The variable emulated kernels read. Must outlive the buffer
+	ConstantBuffer(const std::string &name, void* hostSymbol, size_t size);
+
+	// Write size bytes at offset into the host copy. Nothing reaches the device before flush()
+	int write(const void* data, size_t offset, size_t size);
+
+	// Write a value at offset into the host copy
+	template <typename T>
+	int write(const T &value, size_t offset = 0) {
+		return write(&value, offset, sizeof(T));
+	}
+
+	// Enqueue the copy of everything written since the last flush on the stream. Does nothing if nothing was written.
+	// Emulated variables are updated right away
+	int flush(CUstream stream);
+
+	// Returns the size of the variable in bytes
+	size_t getSize() const { return shadow.size(); }
+
+	// Returns the number of copies enqueued so far
+	size_t getFlushCount() const { return flushCount; }
+
+	// Returns the number of bytes copied to the device so far
+	size_t getBytesFlushed() const { return bytesFlushed; }
+private:
+	std::string name;         //< Name of the variable
+	CUdeviceptr devicePtr;    //< Address of the variable on the device. 0 for emulated variables
+	void* hostSymbol;         //< The host variable of emulated kernels. Null on GPUs
+	std::vector<char> shadow; //< Host copy of the variable, including writes not yet flushed
+	size_t dirtyBegin;        //< Start of the range written since the last flush
+	size_t dirtyEnd;          //< End of the range written since the last flush. Equal to dirtyBegin when there is nothing to flush
+	size_t flushCount;        //< See getFlushCount
+	size_t bytesFlushed;      //< See getBytesFlushed
+};
+
+} //namespace a7az0th
@@ -0,0 +1,12 @@
+#pragma once
+
+// Called when a cuda error is encountered to print the error code, in what file, what line
+// and which function was executed at the time of the error. Defined in devman.cpp
+void printMessage(int error, const char* file, int line, const char* func);
+
+// Print the error and return it from the calling function, unless it is CUDA_SUCCESS
+#define checkError(err)                                       \
+if ((err) != CUDA_SUCCESS) {                                   \
+	printMessage(int(err), __FILE__, __LINE__, __FUNCTION__); \
+	return (err);                                             \
+}
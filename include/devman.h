@@ -12,6 +12,19 @@ namespace a7az0th {
 
 struct Device;
 struct ThreadData;
+struct ThreadManager;
+struct PeerRouter;
+
+// Execution context passed to kernels running on the CPU emulator.
+// Plays the role of threadIdx/blockIdx. See getGlobalID() in utils.h
+struct EmulatorContext {
+	int globalId; //< Index of the work item being processed
+};
+
+// Host implementation of a kernel. Called once for every work item with the same
+// argument array that would have been passed to cuLaunchKernel
+typedef void (*EmulatedKernel)(const EmulatorContext &ctx, void** params);
+
 // A structure managing host-to-device buffer transfers
 // Buffers are just a means to transfer data back and forth device and host
 // The buffer is in no way responsible for managing what goes where.
@@ -23,11 +36,26 @@ public:
 	friend struct Device;
 	friend struct ThreadData;
 
+	// Where the memory of a buffer comes from
+	enum class Mode {
+		Device, //< Device memory. Data moves with upload and download
+		Mapped, //< Page-locked host memory mapped into the device's address space. Kernels access it over the bus directly
+		Alias,  //< Host memory owned by the caller, used in place. Emulation only
+		Growable, //< Grows in place with reserve and resize, see allocGrowable
+		Pooled, //< Stream ordered, see allocAsync
+	};
+
 	DeviceBuffer(std::string name=std::string("unnamed"), int emulate=0): 
 		name(name), 
 		emulate(emulate), 
 		buffer(NULL), 
-		size(0) 
+		hostBuffer(NULL),
+		size(0),
+		capacity(0),
+		reserved(0),
+		copyBytes(0),
+		copyBytesAvoided(0),
+		mode(Mode::Device)
 	{
 		//blank
 	}
@@ -35,6 +63,33 @@ public:
 
 	// Allocate a device buffer of given size
 	int alloc(size_t size);
+	// Allocate a buffer of given size in mapped, page-locked host memory (zero-copy).
+	// Suits buffers a kernel reads or writes once: there is no separate transfer, kernels reach the memory over the bus.
+	// Uploads and downloads are skipped when given the buffer's own host pointer. Otherwise upload and download are
+	// plain host copies, while uploadAsync and downloadAsync still copy in order on their stream
+	int allocMapped(size_t size);
+	// Use size bytes of caller owned host memory as the buffer, without copying. Only valid in emulation mode.
+	// The memory must outlive the buffer
+	int alias(void* host, size_t size);
+	// Allocate a buffer of given size that can later grow without copying its contents.
+	// On GPUs a large virtual address range is reserved and physical memory is mapped into it as the buffer grows.
+	// Drivers without virtual memory management fall back to reallocating and copying on the device.
+	// Emulated buffers grow with mremap, which moves pages rather than bytes
+	// @param capacity Memory to set aside right away. Raised to size if smaller
+	int allocGrowable(size_t size, size_t capacity = 0);
+	// Allocate a buffer of given size for work enqueued on stream, without synchronizing with the device.
+	// Memory comes from the driver's stream ordered allocator when it has one, and from the StreamPool of the current context,
+	// or of the emulator, otherwise. Suits temporary buffers of a single request. Free it with freeAsync
+	int allocAsync(size_t size, CUstream stream);
+	// Free the buffer once the work enqueued on stream so far completes, without synchronizing with the device.
+	// Buffers not allocated with allocAsync are freed right away
+	int freeAsync(CUstream stream);
+	// Make room for at least capacity bytes, keeping the contents.
+	// Buffers not allocated with allocGrowable are reallocated and copied. Not supported for mapped and aliased buffers
+	int reserve(size_t capacity);
+	// Change the size of the buffer, keeping the contents up to the smaller of the old and new size.
+	// Grows the capacity geometrically when needed
+	int resize(size_t size);
 	// Free any resources owned
 	int free();
 	// Synchronously upload a given host buffer to the device
@@ -48,16 +103,55 @@ public:
 
 	// Download buffer from the device ASYNCHRONOUSLY
 	int downloadAsync(void* host, CUstream stream);
+
+	// Copy size bytes from a buffer living on another device into this one. The router picks the route
+	// @param src The buffer to copy from
+	// @param router Knows the devices and their topology
+	// @param dstDevice Index in the router of the device owning this buffer
+	// @param srcDevice Index in the router of the device owning src
+	int copyPeer(const DeviceBuffer &src, size_t size, PeerRouter &router, int dstDevice, int srcDevice);
+
+	// Copy size bytes from a buffer living on another device into this one ASYNCHRONOUSLY
+	// @param stream Stream of this buffer's device, or of src's device if this buffer is emulated
+	int copyPeerAsync(const DeviceBuffer &src, size_t size, PeerRouter &router, int dstDevice, int srcDevice, CUstream stream);
 	
 	// Returns the device pointer associated with this DeviceBuffer
 	const void* get() const { return buffer; }
+
+	// Returns a pointer through which the host can access the buffer in place.
+	// Null for device memory of a real GPU, which is only reachable through upload and download
+	void* getHostPtr() const { return (emulate || mode == Mode::Mapped) ? hostBuffer : NULL; }
 	
 	// Returns the size of the buffer allocated on the device
 	size_t getSize() const { return size; }
+
+	// Returns the number of bytes the buffer can hold before it has to grow
+	size_t getCapacity() const { return capacity; }
+
+	// Returns the bytes copied on the device so far because the buffer had to move when growing
+	size_t getCopyBytes() const { return copyBytes; }
+
+	// Returns the bytes that growing in place did not copy so far, counted as a buffer reallocating at powers of two would copy them
+	size_t getCopyBytesAvoided() const { return copyBytesAvoided; }
+
+	Mode getMode() const { return mode; }
 private:
+	// Grow a growable buffer in place
+	int grow(size_t capacity);
+	// Move the contents into a new, larger allocation
+	int reallocate(size_t capacity);
+
 	std::string name; // Name of this buffer.
 	void* buffer; // Pointer to the buffer on the device
+	void* hostBuffer; // Host address of the same memory. Set for mapped, aliased and emulated buffers
 	size_t size; // Size of the buffer in bytes
+	size_t capacity; // Bytes the buffer can hold without growing
+	size_t reserved; // Size of the virtual address range of a growable GPU buffer. 0 if it does not use one
+	size_t copyBytes; // Bytes copied because the buffer moved while growing
+	size_t copyBytesAvoided; // Bytes a reallocating buffer would have copied, but growing in place did not
+	std::vector<CUmemGenericAllocationHandle> chunks; // Physical memory mapped into the reserved range, in address order
+	std::vector<size_t> chunkSizes; // Size of every chunk
+	Mode mode; // Where the memory comes from
 	const int emulate; // True if the buffer is in emulation mode. aka it is allocated on the CPU
 };
 
@@ -80,18 +174,7 @@ struct Device {
 	{
 	}
 
-	void freeMem() {
-		CUresult res = CUDA_SUCCESS;
-		if (program) {
-			res = cuModuleUnload(program);
-			assert(res == CUDA_SUCCESS);
-			program = nullptr;
-		}
-		if (context) {
-			res = cuCtxDestroy(context);
-			context = nullptr;
-		}
-	}
+	void freeMem();
 
 	~Device() {
 		freeMem();
@@ -154,20 +237,10 @@ struct Device {
 		return handle;
 	}
 
-	void makeCurrent() const {
-		CUresult err = CUDA_SUCCESS;
-		CUcontext currentCtx = nullptr;
-		err = cuCtxGetCurrent(&currentCtx);
-		assert(err == CUDA_SUCCESS);
-
-		if (currentCtx == context) {
-			//The context is already current. Nothing to do
-			return;
-		}
-
-		err = cuCtxSetCurrent(context);
-		assert(err == CUDA_SUCCESS);
-	}
+	// Make the device's context current on the calling thread.
+	// Every thread remembers the context it made current last, so repeated calls for the same device cost no driver call.
+	// Contexts must therefore only be switched through this method
+	void makeCurrent() const;
 
 	int getMaxThreads() const { return maxThreads; }
 private:
@@ -212,6 +285,10 @@ struct DeviceManager {
 	Device& getDevice(int index);
 	int getDeviceCount() const { return numDevices; }
 
+	// Return the CPU emulation device. It is always available, regardless of how many GPUs are present
+	// and is not counted by getDeviceCount()
+	Device& getEmulator() { return emulator; }
+
 private:
 	// Ask for information about a particular device
 	// @param deviceIndex The index of the device that we are querying
@@ -230,6 +307,7 @@ private:
 	int initialized;                 //< A flag to tell us whether the class methods are safe to be called.
 	int numDevices;                  //< The number of devices in the system. Populated by init()
 	std::vector<Device> devices;     //< An array containing per-device information
+	Device emulator;                 //< The CPU emulation device
 
 	DeviceManager();                               //< Private constructor. We don't want anyone to create objects of this type.
 	DeviceManager(DeviceManager const&) = delete;  //< Remove copy constructor. We don't want anyone to copy objects of this type.
@@ -242,23 +320,43 @@ struct Kernel {
 	// @param name The name of the program entry point
 	// @param program The device module handle that was obtained from compiling the GPU code
 	Kernel(const std::string &name, CUmodule program);
+	// @param name The name of the program entry point
+	// @param hostFunction The host implementation of the kernel. Used when launching on an emulator device
+	Kernel(const std::string &name, EmulatedKernel hostFunction);
 	~Kernel();
 
 	// Add a pointer parameter to the kernel execution
 	void addParamPtr(const void* ptr);
 	// Add an integer parameter to the kernel execution
 	void addParamInt(int i);
+	// Add a float parameter to the kernel execution
+	void addParamFloat(float f);
+	// Add a parameter passed by value, such as a small struct of uniform parameters.
+	// Saves the allocation and upload of a DeviceBuffer per launch. All parameters together may take up to 4KB
+	// @param alignment Alignment of the parameter's type. The kernel expects it at an offset that is a multiple of it
+	void addParam(const void* data, int size, int alignment);
+	// Add a parameter of type T passed by value. See addParam
+	template <typename T>
+	void addParamValue(const T &value) { addParam(&value, sizeof(T), alignof(T)); }
 
 	// 
 	void reset();
 
 	// Get a handle to the kernel function. Passed to cuLaunchKernel
 	CUfunction handle() { return function; }
+
+	// Get the host implementation of the kernel. May be null
+	EmulatedKernel hostHandle() const { return hostFunction; }
+
+	// Get the name of the program entry point
+	const std::string& getName() const { return name; }
 private:
+	std::string name; // Name of the program entry point
 	CUfunction function;  // Handle to the kernel function.
+	EmulatedKernel hostFunction; // Host implementation of the kernel. Used by emulator devices
 
 	int offset; // Current location in the pool array
-	char pool[4096]; // Memory pool for storing the kernel arguments
+	alignas(16) char pool[4096]; // Memory pool for storing the kernel arguments
 
 	int numParams; // Number of kernel params
 	void* params[1024]; //The actual pointer array of arguments passed on to the kernel
@@ -268,10 +366,13 @@ private:
 // used to launch kernels on the device asynchronously
 struct ThreadData {
 
-	ThreadData(Device& device);
+	// @param device The device on which kernels are launched
+	// @param threadman Optional. Used to spread emulated launches over the CPU cores. When null emulated launches run serially
+	ThreadData(Device& device, ThreadManager *threadman = nullptr);
 	~ThreadData();
 
 	// Launched a kernel on the device with the given work size
+	// On emulator devices the kernel's host function is executed synchronously
 	// @param kernel The kernel to launch
 	// @param workSize The size of the job (how many threads to launch)
 	CUresult launch(const Kernel& kernel, const int workSize);
@@ -282,9 +383,13 @@ struct ThreadData {
 	void freeMem();
 
 	CUstream getStream() const;
+
+	// Return the device on which this thread launches
+	Device& getDevice() const { return device; }
 private:
 	Device &device;  // Reference to the device on which we launch
 	CUstream stream; // The cuda stream used for async lauches
+	ThreadManager *threadman; // Thread pool used by emulated launches. May be null
 };
 
 
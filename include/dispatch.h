@@ -0,0 +1,149 @@
+#pragma once
+
+#include "devman.h"
+#include "progress.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace a7az0th {
+
+// A job that can be executed on any device, GPU or CPU emulator.
+// The job owns its host data and is responsible for the whole upload, launch and download round-trip.
+struct DeviceJob {
+	virtual ~DeviceJob() {}
+
+	// Name of the job. Timing history is kept separately for every job name
+	virtual std::string getName() const = 0;
+
+	// Number of bytes uploaded to the device before processing count work items
+	virtual size_t getUploadSize(int count) const { return 0; }
+
+	// Number of bytes downloaded from the device after processing count work items
+	virtual size_t getDownloadSize(int count) const { return 0; }
+
+	// Process work items [offset, offset + count) and bring the results back to the host.
+	// Must not return before the results are available on the host.
+	// @param launcher Launch thread bound to the device to execute on. The device context is already current
+	virtual CUresult execute(ThreadData &launcher, int offset, int count) = 0;
+};
+
+// Linear cost model of a job on a single device: seconds = overhead + perItem * workSize
+// Starts from a prior estimate and is refit from measured launches using exponentially decayed least squares
+struct CostModel {
+	CostModel();
+
+	// Set the estimate used until enough measurements are available
+	void setPrior(double overhead, double perItem);
+
+	// Record a measured launch
+	void addSample(int workSize, double seconds);
+
+	// Predict the time in seconds to process workSize items
+	double predict(int workSize) const { return overhead + perItem * workSize; }
+
+	double getOverhead() const { return overhead; }
+	double getPerItem() const { return perItem; }
+	int getSampleCount() const { return samples; }
+	bool hasPrior() const { return priorSet; }
+private:
+	void refit();
+
+	double priorPerItem; //< Per item cost from the prior. Used while all samples have the same size
+	double weight;       //< Sum of sample weights
+	double sumX;         //< Weighted sum of work sizes
+	double sumY;         //< Weighted sum of measured times
+	double sumXX;        //< Weighted sum of squared work sizes
+	double sumXY;        //< Weighted sum of work size * measured time
+	double overhead;     //< Current fit: fixed cost of a launch in seconds
+	double perItem;      //< Current fit: cost of a single work item in seconds
+	int samples;         //< Number of measurements recorded
+	bool priorSet;       //< True once setPrior has been called
+};
+
+// One dispatch decision, kept so that the crossover point can be verified after the fact
+struct DispatchRecord {
+	std::string job;  //< Name of the job
+	int workSize;     //< Number of work items
+	int device;       //< Index of the chosen candidate. See Dispatcher::getCandidate()
+	double predicted; //< Predicted time in seconds on the chosen device
+	double measured;  //< Measured time in seconds
+};
+
+// Routes every job to the device expected to finish it first.
+// Candidates are the CPU emulator and every GPU in the DeviceManager.
+// Small jobs usually end up on the emulator, as the upload, launch and download round-trip
+// of a GPU costs more than the work itself.
+struct Dispatcher {
+	struct Config {
+		double hostBandwidth;     //< Assumed host<->device transfer rate in bytes per second
+		double launchLatency;     //< Assumed fixed cost of a GPU round-trip in seconds
+		double emulatorLatency;   //< Assumed fixed cost of an emulated launch in seconds
+		double cyclesPerItem;     //< Assumed clock cycles spent by one lane on a single work item
+		double cpuClockRate;      //< Assumed CPU clock in Hz. Device::Params do not carry one for the emulator
+		int coresPerSM;           //< Assumed number of lanes per GPU multiprocessor
+		int warmupSamples;        //< Devices with fewer measurements than this are explored ...
+		double explorationFactor; //< ... as long as their prediction is within this factor of the best one
+
+		Config() :
+			hostBandwidth(12e9),
+			launchLatency(20e-6),
+			emulatorLatency(2e-6),
+			cyclesPerItem(100.0),
+			cpuClockRate(3e9),
+			coresPerSM(64),
+			warmupSamples(2),
+			explorationFactor(4.0)
+		{}
+	};
+
+	// @param devman Provides the candidate devices
+	// @param progress Decisions and timings are logged at debug level
+	// @param threadman Optional. Used to spread emulated launches over the CPU cores
+	Dispatcher(DeviceManager &devman, ProgressCallback &progress, ThreadManager *threadman = nullptr, const Config &config = Config());
+	// Route between the given devices only. The first one takes the place of the CPU emulator, the rest are costed as GPUs
+	// from their Device::Params, whether they are real GPUs or emulators standing in for them
+	Dispatcher(const std::vector<Device*> &devices, ProgressCallback &progress, ThreadManager *threadman = nullptr, const Config &config = Config());
+	~Dispatcher();
+
+	// Pick the cheapest device for the job, run the job there and record how long it took
+	// @param job The job to run
+	// @param workSize Number of work items to process
+	CUresult run(DeviceJob &job, int workSize);
+
+	// Return the index of the candidate that run() would pick for the job
+	int choose(DeviceJob &job, int workSize);
+
+	// Estimated work size above which the best GPU becomes cheaper than the emulator. -1 if there is no such point
+	int getCrossover(const std::string &job) const;
+
+	// Candidate 0 is always the CPU emulator. The rest are the GPUs
+	int getCandidateCount() const { return int(candidates.size()); }
+	Device& getCandidate(int index) { return *candidates[index]; }
+
+	// Return the launch thread for the given candidate. Created on first use
+	ThreadData& getLauncher(int index);
+
+	// Return the cost model of the job on the given candidate. Null if the job has never been seen
+	const CostModel* getModel(const std::string &job, int index) const;
+
+	// All decisions made so far, in order
+	const std::vector<DispatchRecord>& getHistory() const { return history; }
+private:
+	// Return the per-candidate models of the job, estimating the priors from Device::Params if needed
+	std::vector<CostModel>& getModels(DeviceJob &job);
+
+	Config config;
+	ProgressCallback &progress;
+	ThreadManager *threadman;                              //< Used by emulated launches. May be null
+	std::vector<Device*> candidates;                       //< Emulator first, then every GPU
+	std::vector<ThreadData*> launchers;                    //< One launch thread per candidate. Created lazily
+	std::map<std::string, std::vector<CostModel>> models;  //< Per job, per candidate cost models
+	std::vector<DispatchRecord> history;                   //< Log of all decisions
+
+	Dispatcher(const Dispatcher&) = delete;
+	Dispatcher& operator=(const Dispatcher&) = delete;
+};
+
+} //namespace a7az0th
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "dispatch.h"
+#include "worker.h"
+
+#include <atomic>
+#include <vector>
+
+namespace a7az0th {
+
+// Work done by a single device during WorkDistributor::run
+struct DeviceStats {
+	int chunks;       //< Number of chunks processed
+	long long items;  //< Number of work items processed
+	double busy;      //< Seconds spent executing chunks
+
+	DeviceStats() : chunks(0), items(0), busy(0.0) {}
+
+	// Items processed per second of busy time. 0 if the device did nothing
+	double getThroughput() const { return (busy > 0.0) ? double(items) / busy : 0.0; }
+};
+
+// Spreads a job over several devices.
+// The work is cut in chunks which are handed out from a shared queue to one host worker per device.
+// Every worker is a DeviceWorker: it owns its device's context and launch thread for the lifetime of the distributor
+// and keeps taking chunks until the queue is empty, so faster devices naturally end up processing more of the job.
+struct WorkDistributor {
+	// @param devices The devices to distribute over. Emulator devices process their chunks on their worker thread
+	// @param progress Used to report per-device throughput
+	WorkDistributor(const std::vector<Device*> &devices, ProgressCallback &progress);
+	~WorkDistributor();
+
+	// Process work items [0, workSize) in chunks of chunkSize items and wait for all of them.
+	// Stops handing out chunks after the first error.
+	// @returns The first error encountered or CUDA_SUCCESS
+	CUresult run(DeviceJob &job, int workSize, int chunkSize);
+
+	int getDeviceCount() const { return int(devices.size()); }
+	Device& getDevice(int index) { return *devices[index]; }
+
+	// Return what the device did during the last run
+	const DeviceStats& getStats(int index) const { return stats[index]; }
+
+	// Log the per-device throughput of the last run
+	void report(const DeviceJob &job) const;
+private:
+	// Take chunks off the shared queue and execute them on the given device until it runs dry. Runs on the device's worker
+	void drain(int index, DeviceJob &job, int workSize, int chunkSize);
+
+	ProgressCallback &progress;
+	std::vector<DeviceWorker*> workers; //< One host worker per device. All CUDA calls for the device come from it
+	std::vector<Device*> devices;       //< The devices sharing the work
+	std::vector<ThreadData*> launchers; //< One launch thread per device
+	std::vector<DeviceStats> stats;     //< Per-device statistics of the last run
+	std::vector<CUresult> results;      //< Per-device result of the last run
+	std::atomic<int> nextChunk;         //< The shared queue. Index of the next chunk to hand out
+	std::atomic<bool> failed;           //< Set by the first worker that fails. Stops the others
+	double wallTime;                    //< Seconds taken by the last run
+
+	WorkDistributor(const WorkDistributor&) = delete;
+	WorkDistributor& operator=(const WorkDistributor&) = delete;
+};
+
+} //namespace a7az0th
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "utils.h"
+
+// Parameters of the filter kernel in gpu_code/kernel.cu, shared by the host and the device.
+// Small and the same for every work item, so they travel in constant memory or by value rather than in a DeviceBuffer
+
+// Largest number of taps a filter can have
+#define FILTER_MAX_TAPS 32
+
+struct FilterParams {
+	int taps;                      //< Number of coefficients in use
+	float gain;                    //< Applied to the sum of the taps
+	float coeffs[FILTER_MAX_TAPS]; //< Coefficients, centered on the item being filtered
+};
+
+// Filter item i of x, of n items. Items past either end count as 0
+inline _float applyFilter(const FilterParams &p, const float* x, int n, int i) {
+	float sum = 0.0f;
+	const int first = i - p.taps / 2;
+	for (int k = 0; k < p.taps; k++) {
+		const int j = first + k;
+		if (j >= 0 && j < n) {
+			sum += p.coeffs[k] * x[j];
+		}
+	}
+	return sum * p.gain;
+}
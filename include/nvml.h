@@ -5,8 +5,41 @@
 namespace a7az0th {
 	struct Device;
 	struct ProgressCallback;
+	struct Topology;
+	struct TelemetrySample;
 }
 
+// Keeps NVML loaded and initialized for as long as it is alive.
+// Sessions are reference counted: the library is loaded and the device index is built when the first session opens
+// and everything is released when the last one closes. Every query below opens its own session, which is
+// almost free while another session is alive, so hold one for as long as NVML is queried periodically.
+struct NVMLSession {
+	NVMLSession();
+	~NVMLSession();
+
+	// True if NVML was loaded and initialized successfully
+	bool isOpen() const { return !error.error(); }
+
+	// The error encountered while opening NVML, if any
+	ErrorCode getError() const { return error; }
+
+	// Number of devices known to NVML. 0 if the session is not open
+	int getDeviceCount() const;
+private:
+	ErrorCode error;
+
+	NVMLSession(const NVMLSession&) = delete;
+	NVMLSession& operator=(const NVMLSession&) = delete;
+};
+
 ErrorCode getDriverVersionWithNVML(std::string &driverVersion);
 
-ErrorCode queryNVLinkConnectedComponents(a7az0th::Device* devices, int numDevices);
\ No newline at end of file
+ErrorCode queryNVLinkConnectedComponents(a7az0th::Device* devices, int numDevices);
+
+// Reset the topology to numDevices devices and fill in the NVLink link count between every pair of them.
+// Devices are matched to NVML by their PCI bus ID. Devices without one, such as emulators, are left unconnected
+ErrorCode queryTopologyWithNVML(a7az0th::Device* devices, int numDevices, a7az0th::Topology &topology);
+
+// Read the current counters of the device at the given PCI bus ID. Counters the device or the library do not support are left at -1.
+// Must be called while an NVMLSession is open
+ErrorCode sampleDeviceWithNVML(const std::string &pciBusId, a7az0th::TelemetrySample &sample);
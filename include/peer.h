@@ -0,0 +1,80 @@
+#pragma once
+
+#include "devman.h"
+#include "topology.h"
+
+#include <vector>
+
+namespace a7az0th {
+
+// The way data travels between two devices
+enum class PeerRoute {
+	Memcpy, //< Both devices are emulators. A plain memcpy
+	Host,   //< One of the devices is an emulator. A single upload or download
+	Direct, //< Peer access over NVLink or PCIe P2P
+	Staged, //< In chunks through pinned host memory
+};
+
+// Copies DeviceBuffers between devices along the best route the topology allows.
+// Devices are referred to by their index in the array given on construction, the same way Topology does.
+// Peer access is enabled the first time a pair of devices is used. Pairs without peer access
+// are copied in chunks through two pinned host buffers, so the download of one chunk overlaps the upload of the previous one.
+// Not safe to use from several threads at once.
+struct PeerRouter {
+	// Size of a single chunk of a staged copy
+	static const size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+	// @param devices The devices copies happen between
+	// @param numDevices Number of devices in the array
+	// @param topology Link and peer access information of the devices. Must be built from the same device array
+	PeerRouter(Device* devices, int numDevices, const Topology &topology, size_t chunkSize = DEFAULT_CHUNK_SIZE);
+	~PeerRouter();
+
+	// Return the route used for copies from device src to device dst
+	PeerRoute getRoute(int dst, int src) const;
+
+	// Copy size bytes from src on device srcDevice into dst on device dstDevice and wait for the copy to finish
+	CUresult copy(DeviceBuffer &dst, int dstDevice, const DeviceBuffer &src, int srcDevice, size_t size);
+
+	// Enqueue a copy of size bytes from src on device srcDevice into dst on device dstDevice
+	// @param stream Stream of the destination device, or of the source device when the destination is an emulator.
+	// Ignored when both are emulators, in which case the copy is done on return
+	CUresult copyAsync(DeviceBuffer &dst, int dstDevice, const DeviceBuffer &src, int srcDevice, size_t size, CUstream stream);
+
+	// Enqueue a copy of size bytes starting at srcOffset in src into dst starting at dstOffset. See copyAsync above
+	CUresult copyAsync(DeviceBuffer &dst, int dstDevice, size_t dstOffset, const DeviceBuffer &src, int srcDevice, size_t srcOffset, size_t size, CUstream stream);
+
+	// Return the device whose stream has to be passed to copyAsync for a copy from src to dst
+	int getStreamOwner(int dst, int src) const;
+
+	int getDeviceCount() const { return numDevices; }
+private:
+	// Pinned host memory and synchronization objects of one ordered pair of devices
+	struct Staging {
+		void* buffers[2];      //< Pinned host buffers chunks alternate between
+		CUevent downloaded[2]; //< Recorded on the source stream when a chunk reaches host memory
+		CUevent uploaded[2];   //< Recorded on the upload stream when a chunk has left host memory
+		CUevent ready;         //< Recorded on the upload stream before the first download, so the copy is ordered after earlier work on it
+		CUstream download;     //< Source device stream the chunks are downloaded on
+		CUstream upload;       //< Destination device stream used by synchronous copies
+		bool used[2];          //< True once the buffer has been uploaded from at least once
+	};
+
+	// Try to enable peer access between both devices. Falls back to staging on failure
+	void enablePeerAccess(int dst, int src);
+	Staging* getStaging(int dst, int src);
+	void freeStaging(int dst, int src);
+	CUresult copyStaged(CUdeviceptr dst, int dstDevice, CUdeviceptr src, int srcDevice, size_t size, CUstream stream);
+
+	Device* devices;
+	int numDevices;
+	size_t chunkSize;
+	std::vector<PeerRoute> routes;       //< numDevices x numDevices, indexed dst * numDevices + src
+	std::vector<char> peerEnabled;       //< numDevices x numDevices, true once peer access has been set up
+	std::vector<Staging*> staging;       //< numDevices x numDevices. Created on first use
+
+	PeerRouter(const PeerRouter&) = delete;
+	PeerRouter& operator=(const PeerRouter&) = delete;
+};
+
+} //namespace a7az0th
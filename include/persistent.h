@@ -0,0 +1,78 @@
+#pragma once
+
+#include "devman.h"
+#include "progress.h"
+#include "taskqueue.h"
+#include "threadman.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace a7az0th {
+
+// Runs small tasks on a device without launching a kernel for each of them.
+// start() launches a single kernel that stays resident and polls a queue in mapped host memory (see taskqueue.h).
+// push() only writes a task descriptor into the queue, and completion comes back through a mapped flag,
+// so the cost per task is a few PCIe transactions instead of a kernel launch.
+// On emulators the same queue protocol is served by CPU worker threads that take the place of the kernel's blocks.
+// They poll for a while and then block until the next push(), so an idle emulated kernel does not keep the CPUs busy.
+// While running, the kernel occupies the whole device. Other launches on it will not make progress until stop().
+// Tasks run in the order they were pushed, but consecutive tasks may overlap. Wait for a task before pushing one that depends on it.
+// push() must only be called from one thread at a time.
+struct PersistentKernel {
+	// Threads per block of the persistent kernel
+	static const int BLOCK_SIZE = 256;
+
+	PersistentKernel(Device &device, ProgressCallback &progress);
+	~PersistentKernel();
+
+	// Start polling the queue
+	// @param ptxFile The compiled gpu_code/persistent.cu. Not used by emulators
+	// @param numWorkers Number of blocks, or of CPU threads on emulators. 0 picks one per SM or CPU core
+	CUresult start(const std::string &ptxFile, int numWorkers = 0);
+
+	// Finish all pushed tasks and stop the kernel
+	CUresult stop();
+
+	bool isRunning() const { return running; }
+
+	// Queue a task. Waits while the queue is full
+	// @returns The ticket of the task. Used with isDone() and wait()
+	unsigned int push(const PersistentTask &task);
+
+	// Return true once every worker has finished the task with the given ticket
+	bool isDone(unsigned int ticket) const;
+
+	// Wait for the task with the given ticket to finish. Spins for a while, then yields
+	void wait(unsigned int ticket) const;
+
+	// Wait for every task pushed so far
+	void sync() const { wait(lastTicket); }
+private:
+	// Free the stream, module and queue of a device, as far as they were created. Not used by emulators
+	void release();
+
+	// Body of an emulated worker. Mirrors the persistent kernel in gpu_code/persistent.cu
+	void emulate(int index, int numWorkers);
+
+	Device &device;
+	ProgressCallback &progress;
+	PersistentQueue *queue;     //< The queue, in host memory
+	CUdeviceptr queueDevice;    //< The queue as seen from the device
+	CUmodule module;            //< Holds the persistent kernel. Null for emulators
+	CUstream stream;            //< The persistent kernel runs on it
+	unsigned int lastTicket;    //< Ticket of the most recently pushed task
+	bool running;
+
+	std::vector<std::thread> workers;                         //< Emulated blocks
+	std::atomic<unsigned int> finished[PERSISTENT_QUEUE_SIZE]; //< Emulated workers done with the task in every slot
+	Futex published;                                          //< Ticket of the last pushed task. Idle emulated workers block on it
+	std::atomic<int> sleepers;                                //< Emulated workers blocked, or about to block, on published
+
+	PersistentKernel(const PersistentKernel&) = delete;
+	PersistentKernel& operator=(const PersistentKernel&) = delete;
+};
+
+} //namespace a7az0th
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "devman.h"
+#include "peer.h"
+#include "topology.h"
+#include "threadman.h"
+
+#include <string>
+#include <vector>
+
+namespace a7az0th {
+
+// A read-only buffer, such as a lookup table, that kernels on several devices use.
+// The host keeps the master copy. A device gets its replica only the first time it asks for it with get(),
+// so devices that never use the buffer cost neither a transfer nor memory. A new replica is copied
+// from the fastest peer that already has a valid one when that beats an upload from the host.
+// Writing from the host invalidates all replicas. Each is re-synced the next time its device asks for it.
+// Safe to use from several threads at once. The router must not be used by anyone else meanwhile.
+struct ReplicatedBuffer {
+	// @param devices The devices that may use the buffer
+	// @param numDevices Number of devices in the array
+	// @param topology Link information of the devices. Must be built from the same device array
+	// @param router Used for copies between replicas. Must be built from the same device array
+	ReplicatedBuffer(const std::string &name, Device* devices, int numDevices, const Topology &topology, PeerRouter &router);
+	~ReplicatedBuffer();
+
+	// Replace the contents with size bytes from host memory and invalidate all replicas.
+	// A new size frees the memory of every replica right away, so no device may have work in flight that reads one.
+	// Synchronize the streams of all devices using the buffer before resizing it
+	int write(const void* host, size_t size);
+
+	// Overwrite size bytes at offset with data from host memory and invalidate all replicas
+	int write(const void* host, size_t offset, size_t size);
+
+	// Return the replica on the given device, creating or re-syncing it first if needed.
+	// Call when adding the buffer to the parameters of a kernel for that device.
+	// The device must not have work in flight that reads the replica while it is being re-synced
+	// @returns The device pointer of the replica, or null on failure
+	const void* get(int device);
+
+	// Same as above, for a device given by reference. The device must be one of the array the buffer was created with
+	const void* get(const Device &device);
+
+	// Return true if the device holds an up to date replica
+	bool isValid(int device) const;
+
+	// Size of the buffer in bytes
+	size_t getSize() const { return host.size(); }
+
+	// Number of devices holding memory for a replica
+	int getReplicaCount() const;
+
+	// Bytes uploaded from the host and copied between devices so far
+	size_t getHostBytes() const { return hostBytes; }
+	size_t getPeerBytes() const { return peerBytes; }
+private:
+	// Pick the device to copy a new replica for dst from. -1 means the host
+	int findSource(int dst) const;
+
+	// Release the memory of every replica
+	void freeReplicas();
+
+	std::string name;
+	Device* devices;
+	int numDevices;
+	const Topology &topology;
+	PeerRouter &router;
+	std::vector<char> host;               //< The master copy
+	std::vector<DeviceBuffer*> replicas;  //< One per device. Null until the device first asks for it
+	std::vector<char> valid;              //< True if the replica matches the master copy
+	size_t hostBytes;                     //< Bytes uploaded from the host
+	size_t peerBytes;                     //< Bytes copied between devices
+	mutable Mutex lock;                   //< Guards everything above
+
+	ReplicatedBuffer(const ReplicatedBuffer&) = delete;
+	ReplicatedBuffer& operator=(const ReplicatedBuffer&) = delete;
+};
+
+} //namespace a7az0th
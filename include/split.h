@@ -0,0 +1,75 @@
+#pragma once
+
+#include "dispatch.h"
+#include "threadman.h"
+
+#include <vector>
+
+namespace a7az0th {
+
+// A 1D or 2D grid of work items. Items are numbered row by row.
+// 2D grids are only ever split in bands of whole rows
+struct Grid {
+	int width;  //< Number of items in a row
+	int height; //< Number of rows. 1 for 1D grids
+
+	Grid(int width, int height = 1) : width(width), height(height) {}
+
+	int count() const { return width * height; }
+};
+
+// The range of a grid assigned to a single device
+struct Partition {
+	int offset; //< Index of the first item
+	int count;  //< Number of items. May be zero
+};
+
+// Runs a single job on every GPU and the CPU emulator at once.
+// The grid is split between the devices in proportion to the throughput measured on previous runs,
+// so calling run() repeatedly rebalances the split from iteration to iteration.
+// Every device processes its partition from its own host thread.
+// Each partition must be downloaded by DeviceJob::execute at its offset within one host buffer owned by the job,
+// which gathers the outputs of all devices in place.
+struct SplitLauncher {
+	// Split between the emulator and every GPU in the DeviceManager. Works with zero GPUs
+	// @param threadman Optional. Used to spread emulated launches over the CPU cores
+	SplitLauncher(DeviceManager &devman, ProgressCallback &progress, ThreadManager *threadman = nullptr);
+	// Split between the given devices only. Several of them may be emulators, but only the first emulator
+	// launches through threadman, as a ThreadManager can not run the partitions of two devices at once
+	SplitLauncher(const std::vector<Device*> &devices, ProgressCallback &progress, ThreadManager *threadman = nullptr);
+	~SplitLauncher();
+
+	// Partition the grid, process every partition on its device and wait for all of them
+	// @returns The first error encountered or CUDA_SUCCESS
+	CUresult run(DeviceJob &job, const Grid &grid);
+
+	int getDeviceCount() const { return int(devices.size()); }
+	Device& getDevice(int index) { return *devices[index]; }
+
+	// Measured throughput of the device in items per second. 0 until the device has processed a partition
+	double getThroughput(int index) const { return throughput[index]; }
+
+	// Return the split used by the last run, one partition per device
+	const std::vector<Partition>& getPartitions() const { return partitions; }
+private:
+	void init(ThreadManager *threadman);
+	// Split the grid in proportion to the measured throughput
+	void partition(const Grid &grid);
+
+	struct PartitionLaunch;
+	friend struct PartitionLaunch;
+
+	ProgressCallback &progress;
+	ThreadManager hostThreads;           //< One host thread per device while a run is in progress
+	std::vector<Device*> devices;        //< The devices sharing the job
+	std::vector<ThreadData*> launchers;  //< One launch thread per device
+	std::vector<Partition> partitions;   //< Split used by the last run
+	std::vector<double> throughput;      //< Smoothed items per second per device
+	std::vector<double> elapsed;         //< Seconds spent by every device on the last run
+	std::vector<CUresult> results;       //< Result of every device on the last run
+
+	SplitLauncher(const SplitLauncher&) = delete;
+	SplitLauncher& operator=(const SplitLauncher&) = delete;
+};
+
+} //namespace a7az0th
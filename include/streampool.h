@@ -0,0 +1,75 @@
+#pragma once
+
+#include "devman.h"
+#include "threadman.h"
+
+#include <vector>
+
+namespace a7az0th {
+
+// Stream ordered memory behind DeviceBuffer::allocAsync and freeAsync. There is one pool per context and one for all emulated buffers.
+// Drivers that have cuMemAllocAsync do the work themselves: the pool forwards to it and keeps the device's default
+// memory pool from handing its memory back at every synchronization.
+// Older drivers and the emulator get a cache of freed blocks instead. A block freed on a stream is handed out again
+// right away for work on the same stream, as the stream runs the old and new work in order. Other streams take it
+// once the work enqueued before the free has completed, or make the device wait for that work when nothing else fits.
+// The host never waits either way, and the driver is only asked for memory when no cached block fits.
+// Emulated launches are done when they return, so the emulator's blocks are reusable as soon as they are freed.
+// Safe to use from several threads at once.
+struct StreamPool {
+	// Return the pool of the context current on the calling thread, or the emulator's pool
+	static StreamPool& get(int emulate);
+
+	// Destroy the pool of the given context and free all memory it cached. Called before the context is destroyed
+	static void release(CUcontext context);
+
+	// Allocate at least size bytes usable by work enqueued on stream from now on
+	// @param capacity Receives the size of the memory handed out, which has to be passed to free
+	CUresult alloc(void** ptr, size_t size, size_t* capacity, CUstream stream);
+
+	// Free memory once the work enqueued on stream so far completes
+	// @param capacity The capacity returned by alloc
+	CUresult free(void* ptr, size_t capacity, CUstream stream);
+
+	// Give the cached blocks whose work has completed back to the driver
+	void trim();
+
+	// Return the number of allocations that had to ask the driver or the system for memory.
+	// Allocations done by the driver's own pool count here too
+	size_t getAllocCount() const { return allocCount; }
+
+	// Return the number of allocations served from cached blocks
+	size_t getReuseCount() const { return reuseCount; }
+private:
+	// A freed block waiting to be handed out again
+	struct Block {
+		void* ptr;       //< Start of the memory
+		size_t size;     //< Size of the memory in bytes
+		CUstream stream; //< Stream the block was freed on
+		CUevent freed;   //< Recorded on stream by the free. Null for emulated blocks
+	};
+
+	StreamPool(CUcontext context, int emulate);
+	~StreamPool();
+
+	// Return the index of the block best suited for a request, or -1 if none fits
+	// @param ready Set to true if the work enqueued before the block's free is known to be complete
+	int findBlock(size_t size, CUstream stream, bool &ready);
+
+	// Return the memory of a block to the driver or the system
+	void freeBlock(const Block &block);
+
+	CUcontext context;           //< Context the memory belongs to. Null for the emulator
+	const int emulate;           //< True for the pool of emulated buffers
+	int driverPool;              //< True when the driver provides stream ordered allocation
+	std::vector<Block> blocks;   //< Freed blocks, available for reuse
+	std::vector<CUevent> events; //< Events of reused blocks, recycled by later frees
+	size_t allocCount;           //< See getAllocCount
+	size_t reuseCount;           //< See getReuseCount
+	Mutex lock;                  //< Guards everything above
+
+	StreamPool(const StreamPool&) = delete;
+	StreamPool& operator=(const StreamPool&) = delete;
+};
+
+} //namespace a7az0th
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "utils.h"
+
+#ifndef __CUDACC__
+#include <math.h>
+#endif
+
+// Layout of the work queue a persistent kernel polls, shared by the host and gpu_code/persistent.cu.
+// The queue lives in host memory mapped into the device's address space. The host fills a slot and publishes it
+// by writing its ticket last. Workers run the task once the slot carries the ticket they expect, and the last worker
+// to finish a task writes its ticket into completed, which the host polls.
+// The fields both sides write are volatile for the device. Host threads, including emulated workers, access them
+// with __atomic_load_n and __atomic_store_n only, acquiring tickets and releasing them.
+
+// Number of tasks that can be in flight at once
+#define PERSISTENT_QUEUE_SIZE 256
+
+// What a task does. Add new task types here and to runPersistentItem()
+enum PersistentTaskType {
+	PERSISTENT_TASK_EXIT = 0, //< Stop the persistent kernel
+	PERSISTENT_TASK_NOP,      //< Do nothing. Measures the cost of the queue itself
+	PERSISTENT_TASK_FILL,     //< ptr[0][i] = sqrt(ints[0] + i)
+	PERSISTENT_TASK_SCALE,    //< ptr[0][i] *= floats[0]
+};
+
+// A single unit of work. Its items are spread over all workers
+struct PersistentTask {
+	int type;         //< One of PersistentTaskType
+	int count;        //< Number of work items
+	void* ptr[2];     //< Device pointers
+	int ints[2];      //< Integer arguments
+	float floats[2];  //< Float arguments
+};
+
+struct PersistentSlot {
+	PersistentTask task;
+	volatile unsigned int ticket; //< Written by the host after the task. Tickets start at 1
+	unsigned int pad;
+};
+
+struct PersistentQueue {
+	PersistentSlot slots[PERSISTENT_QUEUE_SIZE]; //< Task with ticket t lives in slot (t - 1) % PERSISTENT_QUEUE_SIZE
+	volatile unsigned int completed;             //< Ticket of the last task every worker has finished
+	unsigned int pad;
+};
+
+// Process work item i of a task. Shared by the persistent kernel and its emulation
+inline _void runPersistentItem(const PersistentTask &task, int i) {
+	switch (task.type) {
+		case PERSISTENT_TASK_FILL: {
+			float* x = (float*)task.ptr[0];
+			x[i] = sqrtf(float(task.ints[0] + i));
+			break;
+		}
+		case PERSISTENT_TASK_SCALE: {
+			float* x = (float*)task.ptr[0];
+			x[i] *= task.floats[0];
+			break;
+		}
+		default:
+			break;
+	}
+}
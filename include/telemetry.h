@@ -0,0 +1,189 @@
+#pragma once
+
+#include "devman.h"
+#include "nvml.h"
+#include "progress.h"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <string.h>
+
+namespace a7az0th {
+
+// A single reading of a device's counters. Counters that are not supported are -1
+struct TelemetrySample {
+	long long timestamp;       //< Microseconds since the sampler was started
+	long long memoryUsed;      //< Allocated device memory in bytes
+	long long memoryTotal;     //< Installed device memory in bytes
+	long long throttleReasons; //< Bitmask of nvmlClocksThrottleReasons
+	int gpuUtilization;        //< Percent of the sample period during which a kernel was executing
+	int memoryUtilization;     //< Percent of the sample period during which device memory was read or written
+	int smClock;               //< SM clock in MHz
+	int memoryClock;           //< Memory clock in MHz
+	int power;                 //< Power draw in milliwatts
+	int temperature;           //< GPU die temperature in degrees Celsius
+
+	TelemetrySample() :
+		timestamp(-1),
+		memoryUsed(-1),
+		memoryTotal(-1),
+		throttleReasons(-1),
+		gpuUtilization(-1),
+		memoryUtilization(-1),
+		smClock(-1),
+		memoryClock(-1),
+		power(-1),
+		temperature(-1)
+	{}
+};
+
+// A fixed size ring of the most recent samples with a single writer and any number of readers.
+// Neither side ever takes a lock. Every slot is guarded by a sequence number (a seqlock):
+// the writer marks the slot busy, stores the sample and marks it done,
+// while readers retry, or skip the slot, if its sequence changed during the copy.
+// When full, the oldest sample is overwritten.
+template<class T, int Capacity>
+struct SampleRing {
+	SampleRing() : written(0) {
+		for (int i = 0; i < Capacity; i++) {
+			slots[i].seq.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	// Store a sample. Must only ever be called from one thread
+	void push(const T &sample) {
+		const unsigned long long index = written.load(std::memory_order_relaxed);
+		Slot &slot = slots[index % Capacity];
+
+		unsigned long long words[NUM_WORDS];
+		memcpy(words, &sample, sizeof(T));
+
+		slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (int i = 0; i < NUM_WORDS; i++) {
+			slot.words[i].store(words[i], std::memory_order_relaxed);
+		}
+		slot.seq.store(2 * index + 2, std::memory_order_release);
+		written.store(index + 1, std::memory_order_release);
+	}
+
+	// Total number of samples ever pushed
+	unsigned long long count() const { return written.load(std::memory_order_acquire); }
+
+	// Copy the most recent sample
+	// @returns false if there is none
+	bool latest(T &sample) const {
+		for (;;) {
+			const unsigned long long total = count();
+			if (total == 0) {
+				return false;
+			}
+			if (read(total - 1, sample)) {
+				return true;
+			}
+		}
+	}
+
+	// Copy up to maxCount of the most recent samples, oldest first
+	// @returns The number of samples copied
+	int history(T *samples, int maxCount) const {
+		const unsigned long long total = count();
+		const unsigned long long available = (total < Capacity) ? total : Capacity;
+		const int wanted = (maxCount < int(available)) ? maxCount : int(available);
+		int copied = 0;
+		for (unsigned long long index = total - wanted; index < total; index++) {
+			// Slots overwritten in the meantime are skipped
+			if (read(index, samples[copied])) {
+				copied++;
+			}
+		}
+		return copied;
+	}
+private:
+	static const int NUM_WORDS = int((sizeof(T) + sizeof(unsigned long long) - 1) / sizeof(unsigned long long));
+
+	// Copy the sample with the given index. Fails if it was overwritten or is being written
+	bool read(unsigned long long index, T &sample) const {
+		const Slot &slot = slots[index % Capacity];
+		const unsigned long long before = slot.seq.load(std::memory_order_acquire);
+		if (before != 2 * index + 2) {
+			return false;
+		}
+		unsigned long long words[NUM_WORDS];
+		for (int i = 0; i < NUM_WORDS; i++) {
+			words[i] = slot.words[i].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) != before) {
+			return false;
+		}
+		memcpy(&sample, words, sizeof(T));
+		return true;
+	}
+
+	struct Slot {
+		std::atomic<unsigned long long> seq;               //< 2*index+1 while sample index is written, 2*index+2 once it is complete
+		std::atomic<unsigned long long> words[NUM_WORDS];  //< The sample
+	};
+
+	std::atomic<unsigned long long> written; //< Number of samples pushed so far
+	Slot slots[Capacity];
+};
+
+// Polls utilization, memory, clocks, power, temperature and throttle reasons of every device from a background thread.
+// Samples of every device go into their own SampleRing, so schedulers and loggers can read them at any time without locking.
+// Devices are found in NVML by their PCI bus ID. Devices without one, such as emulators, never get samples.
+struct TelemetrySampler {
+	// Number of samples kept per device
+	static const int HISTORY_SIZE = 256;
+	typedef SampleRing<TelemetrySample, HISTORY_SIZE> Ring;
+
+	// @param devices The devices to sample
+	// @param numDevices Number of devices in the array
+	TelemetrySampler(const Device* devices, int numDevices, ProgressCallback &progress);
+	~TelemetrySampler();
+
+	// Start sampling every intervalMs milliseconds. Does nothing if already running
+	// @returns An error if NVML could not be opened
+	ErrorCode start(int intervalMs);
+
+	// Stop sampling and wait for the background thread to exit. Samples taken so far remain readable
+	void stop();
+
+	bool isRunning() const { return running; }
+
+	int getDeviceCount() const { return int(rings.size()); }
+
+	// Copy the most recent sample of the device. Lock free
+	// @returns false if the device has no samples yet
+	bool getLatest(int device, TelemetrySample &sample) const { return rings[device]->latest(sample); }
+
+	// Copy up to maxCount of the most recent samples of the device, oldest first. Lock free
+	// @returns The number of samples copied
+	int getHistory(int device, TelemetrySample *samples, int maxCount) const { return rings[device]->history(samples, maxCount); }
+
+	// Produce a human readable description of the latest sample of every device
+	std::string getInfo() const;
+private:
+	void threadProc();
+
+	ProgressCallback &progress;
+	std::vector<std::string> pciBusIds;   //< PCI bus ID of every sampled device
+	std::vector<Ring*> rings;             //< One ring per device
+	NVMLSession *session;                 //< Keeps NVML loaded while sampling
+	std::thread thread;                   //< The background sampling thread
+	std::atomic<bool> running;            //< True while the background thread runs
+	int intervalMs;                       //< Time between two samples of the same device
+	std::mutex stopMutex;                 //< Guards stopRequested
+	std::condition_variable stopSignal;   //< Wakes the sampler early when stopping
+	bool stopRequested;                   //< Set by stop()
+
+	TelemetrySampler(const TelemetrySampler&) = delete;
+	TelemetrySampler& operator=(const TelemetrySampler&) = delete;
+};
+
+} //namespace a7az0th
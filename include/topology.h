@@ -0,0 +1,78 @@
+#pragma once
+
+#include "devman.h"
+
+#include <string>
+#include <vector>
+
+namespace a7az0th {
+
+// Connectivity between the GPUs of the system.
+// Devices are referred to by their position in the device array the topology was built from.
+// Link counts come from NVML (see queryTopologyWithNVML), peer access from CUDA
+// and the bandwidth matrix from measurePeerBandwidth().
+struct Topology {
+	// Rough transfer rates in bytes per second used to rank device pairs that have not been measured
+	struct Rates {
+		double nvLink;  //< Per NVLink link
+		double pcieP2P; //< Direct peer access over PCIe
+		double host;    //< Staging through host memory
+
+		Rates() : nvLink(25e9), pcieP2P(10e9), host(5e9) {}
+	};
+
+	Topology() : numDevices(0) {}
+
+	// Reset the topology to numDevices unconnected devices
+	void init(int numDevices);
+
+	int getDeviceCount() const { return numDevices; }
+
+	// Record one more NVLink link from device a to device b
+	void addLink(int a, int b);
+	// Number of NVLink links between device a and device b
+	int getLinkCount(int a, int b) const;
+
+	// Record whether device a can directly access the memory of device b
+	void setPeerAccess(int a, int b, bool canAccess);
+	bool canAccessPeer(int a, int b) const;
+
+	// Record the measured copy rate from device a to device b in bytes per second
+	void setBandwidth(int a, int b, double bytesPerSecond);
+	// Measured copy rate from device a to device b. 0 if never measured
+	double getBandwidth(int a, int b) const;
+
+	// Best known transfer rate from a to b. Uses the measured bandwidth and falls back to estimates from rates
+	double getRate(int a, int b) const;
+	void setRates(const Rates &r) { rates = r; }
+	const Rates& getRates() const { return rates; }
+
+	// Return all maximal groups of devices in which every pair is connected over NVLink. Groups have at least two devices
+	std::vector<std::vector<int>> getCliques() const;
+
+	// Return the k devices with the best connectivity between them.
+	// Groups are ranked by their slowest pair first and their total rate second
+	// @returns Fewer than k devices only if the topology has fewer devices
+	std::vector<int> getBestGroup(int k) const;
+
+	// Query CUDA for peer access between every pair of the given devices. Emulator devices never have peer access
+	CUresult queryPeerAccess(Device* devices, int numDevices);
+
+	// Measure the copy rate between every pair of the given devices and fill the bandwidth matrix
+	// @param bytes Size of the buffer copied between every pair
+	CUresult measurePeerBandwidth(Device* devices, int numDevices, size_t bytes);
+
+	// Produce a human readable description of the topology
+	std::string getInfo() const;
+private:
+	void cliques(std::vector<int> &current, std::vector<int> candidates, std::vector<int> excluded, std::vector<std::vector<int>> &result) const;
+	bool connected(int a, int b) const { return getLinkCount(a, b) > 0 && getLinkCount(b, a) > 0; }
+
+	int numDevices;
+	Rates rates;
+	std::vector<int> links;         //< numDevices x numDevices NVLink link counts
+	std::vector<char> peerAccess;   //< numDevices x numDevices peer access flags
+	std::vector<double> bandwidth;  //< numDevices x numDevices measured copy rates
+};
+
+} //namespace a7az0th
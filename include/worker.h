@@ -0,0 +1,74 @@
+#pragma once
+
+#include "devman.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace a7az0th {
+
+// A host thread dedicated to a single device.
+// The thread makes the device's context current once and then runs every task submitted to it in order,
+// so all CUDA calls for the device come from the same thread and no context is ever switched on the hot path.
+// Any thread may submit. Submission goes through a lock-free queue and only touches a lock to wake the worker
+// after it went to sleep on an empty queue.
+struct DeviceWorker {
+	typedef std::function<void()> Task;
+
+	// Number of times an idle worker polls the queue before it goes to sleep
+	static const int SPIN_COUNT = 2000;
+
+	// Start the worker thread of the device
+	DeviceWorker(Device &device);
+
+	// Run all tasks already submitted and stop the worker thread
+	~DeviceWorker();
+
+	// Queue a task. Returns immediately
+	void submit(Task task);
+
+	// Wait until every task submitted before the call has finished
+	void sync();
+
+	// Run a task on the worker thread and wait for it
+	void run(Task task);
+
+	// Return true if called from the worker thread
+	bool isWorkerThread() const { return std::this_thread::get_id() == thread.get_id(); }
+
+	Device& getDevice() const { return device; }
+private:
+	// Element of the queue. The queue always holds one already consumed node, the tail
+	struct Node {
+		std::atomic<Node*> next;
+		Task task;
+		Node() : next(nullptr) {}
+	};
+
+	void threadProc();
+
+	// Take the oldest task off the queue. Called only by the worker thread
+	// @returns false if the queue is empty
+	bool pop(Task &task);
+
+	Device &device;
+	std::atomic<Node*> head;           //< Most recently submitted node. Submitters exchange it
+	Node *tail;                        //< Oldest node, already consumed. Only the worker touches it
+	std::atomic<long long> submitted;  //< Number of tasks submitted so far
+	std::atomic<long long> completed;  //< Number of tasks finished so far
+	std::atomic<bool> sleeping;        //< Set by the worker before it waits for work
+	std::atomic<int> waiters;          //< Number of threads inside sync()
+	std::atomic<bool> stopRequested;   //< Set by the destructor
+	std::mutex lock;                   //< Guards the two conditions below
+	std::condition_variable wake;      //< Signalled when work arrives for a sleeping worker
+	std::condition_variable done;      //< Signalled when a task finishes while someone waits in sync()
+	std::thread thread;
+
+	DeviceWorker(const DeviceWorker&) = delete;
+	DeviceWorker& operator=(const DeviceWorker&) = delete;
+};
+
+} //namespace a7az0th
@@ -0,0 +1,324 @@
+// A stand-in for libnvidia-ml, so the NVML code of devman can run on hosts without GPUs.
+// Load it by pointing DEVMAN_NVML_LIBRARY at it. See --bench topology.
+//
+// It knows six devices, on PCI buses 0x10 to 0x15, connected over NVLink as follows:
+//
+//   0 =2= 1
+//   |\   /|
+//   | \ / |
+//   |  X  |
+//   | / \ |
+//   |/   \|
+//   2 --- 3 --- 4 =3= 5
+//
+// Devices 0 to 3 are fully connected by single links, except 0 and 1 which share two. 3 has a single link to 4,
+// and 4 and 5 share three. Every device also has a link to an NVSwitch, which is not a device, and a link that is disabled.
+//
+// Telemetry counters are all derived from a per device reading number n, which every call of
+// nvmlDeviceGetUtilizationRates advances. A sample mixing two readings is easy to tell apart, see --bench telemetry:
+//   utilization gpu n % 101, memory n * 7 % 101, memory used n << 12 of 16GB, SM clock 1000 + n % 1000,
+//   memory clock 5000 + n % 1000, power 100000 + n % 100000, temperature 40 + n % 50, throttle reasons n & 0xff
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#  define MOCK_EXPORT extern "C" __declspec(dllexport)
+#else
+#  define MOCK_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+// Layouts and values match nvml.h
+typedef int nvmlReturn_t;
+static const nvmlReturn_t NVML_SUCCESS = 0;
+static const nvmlReturn_t NVML_ERROR_UNINITIALIZED = 1;
+static const nvmlReturn_t NVML_ERROR_INVALID_ARGUMENT = 2;
+static const nvmlReturn_t NVML_ERROR_NOT_FOUND = 6;
+static const nvmlReturn_t NVML_ERROR_INSUFFICIENT_SIZE = 7;
+
+typedef struct nvmlPciInfo_st {
+	char busIdLegacy[16];
+	unsigned int domain;
+	unsigned int bus;
+	unsigned int device;
+	unsigned int pciDeviceId;
+	unsigned int pciSubSystemId;
+	char busId[32];
+} nvmlPciInfo_t;
+
+typedef struct nvmlUtilization_st {
+	unsigned int gpu;
+	unsigned int memory;
+} nvmlUtilization_t;
+
+typedef struct nvmlMemory_st {
+	unsigned long long total;
+	unsigned long long free;
+	unsigned long long used;
+} nvmlMemory_t;
+
+static const int NVML_CLOCK_SM = 1;
+static const int NVML_CLOCK_MEM = 2;
+static const int NVML_TEMPERATURE_GPU = 0;
+
+typedef int nvmlEnableState_t;
+typedef int nvmlNvLinkCapability_t;
+static const int NVML_FEATURE_DISABLED = 0;
+static const int NVML_FEATURE_ENABLED = 1;
+static const int NVML_NVLINK_CAP_P2P_SUPPORTED = 0;
+
+static const int NUM_DEVICES = 6;
+static const unsigned int FIRST_BUS = 0x10;
+static const unsigned int SWITCH_BUS = 0x80;
+
+struct MockLink {
+	unsigned int remoteBus; // Bus of the device at the other end
+	bool active;
+};
+
+struct MockDevice {
+	unsigned int bus;
+	std::vector<MockLink> links;
+	std::atomic<unsigned long long> reading; // Number of the current telemetry reading
+};
+
+static struct MockState {
+	MockDevice devices[NUM_DEVICES];
+	int initCount; // nvmlInit calls not matched by nvmlShutdown yet
+
+	MockState() : initCount(0) {
+		static const int pairs[][3] = {
+			// device, device, number of links
+			{ 0, 1, 2 }, { 0, 2, 1 }, { 0, 3, 1 }, { 1, 2, 1 }, { 1, 3, 1 }, { 2, 3, 1 },
+			{ 3, 4, 1 },
+			{ 4, 5, 3 },
+		};
+		for (int d = 0; d < NUM_DEVICES; d++) {
+			devices[d].bus = FIRST_BUS + d;
+			devices[d].reading = 0;
+		}
+		for (int p = 0; p < int(sizeof(pairs) / sizeof(pairs[0])); p++) {
+			for (int l = 0; l < pairs[p][2]; l++) {
+				MockLink a = { FIRST_BUS + pairs[p][1], true };
+				MockLink b = { FIRST_BUS + pairs[p][0], true };
+				devices[pairs[p][0]].links.push_back(a);
+				devices[pairs[p][1]].links.push_back(b);
+			}
+		}
+		for (int d = 0; d < NUM_DEVICES; d++) {
+			MockLink nvSwitch = { SWITCH_BUS, true };
+			MockLink disabled = { FIRST_BUS + (d + 1) % NUM_DEVICES, false };
+			devices[d].links.push_back(nvSwitch);
+			devices[d].links.push_back(disabled);
+		}
+	}
+} mock;
+
+static void fillPciInfo(unsigned int bus, nvmlPciInfo_t *pci) {
+	memset(pci, 0, sizeof(*pci));
+	pci->domain = 0;
+	pci->bus = bus;
+	pci->device = 0;
+	pci->pciDeviceId = 0x1db510de;
+	snprintf(pci->busIdLegacy, sizeof(pci->busIdLegacy), "0000:%02X:00.0", bus);
+	snprintf(pci->busId, sizeof(pci->busId), "00000000:%02X:00.0", bus);
+}
+
+// Number of NVML calls made so far, see mockNvmlGetCallCount
+static std::atomic<long long> callCount(0);
+
+static MockDevice* getDevice(void* handle) {
+	for (int d = 0; d < NUM_DEVICES; d++) {
+		if (handle == &mock.devices[d]) {
+			return &mock.devices[d];
+		}
+	}
+	return nullptr;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlInit(void) {
+	callCount++;
+	mock.initCount++;
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlShutdown(void) {
+	callCount++;
+	if (mock.initCount == 0) {
+		return NVML_ERROR_UNINITIALIZED;
+	}
+	mock.initCount--;
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlSystemGetDriverVersion(char *version, unsigned int length) {
+	callCount++;
+	const char* mockVersion = "000.00.mock";
+	if (!version || length <= strlen(mockVersion)) {
+		return NVML_ERROR_INSUFFICIENT_SIZE;
+	}
+	strcpy(version, mockVersion);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetCount(unsigned int *deviceCount) {
+	callCount++;
+	if (!mock.initCount) {
+		return NVML_ERROR_UNINITIALIZED;
+	}
+	*deviceCount = NUM_DEVICES;
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetHandleByIndex(unsigned int index, void **device) {
+	callCount++;
+	if (!mock.initCount) {
+		return NVML_ERROR_UNINITIALIZED;
+	}
+	if (index >= unsigned(NUM_DEVICES)) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	*device = &mock.devices[index];
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetPciInfo(void *device, nvmlPciInfo_t *pci) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	fillPciInfo(d->bus, pci);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetHandleByUUID(const char *uuid, void **device) {
+	callCount++;
+	int index = -1;
+	if (!uuid || sscanf(uuid, "GPU-mock-%d", &index) != 1 || index < 0 || index >= NUM_DEVICES) {
+		return NVML_ERROR_NOT_FOUND;
+	}
+	*device = &mock.devices[index];
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetHandleByPciBusId(const char *pciBusId, void **device) {
+	callCount++;
+	unsigned int domain = 0, bus = 0, dev = 0;
+	if (!pciBusId || sscanf(pciBusId, "%x:%x:%x", &domain, &bus, &dev) != 3) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	for (int d = 0; d < NUM_DEVICES; d++) {
+		if (domain == 0 && dev == 0 && mock.devices[d].bus == bus) {
+			*device = &mock.devices[d];
+			return NVML_SUCCESS;
+		}
+	}
+	return NVML_ERROR_NOT_FOUND;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetNvLinkCapability(void *device, unsigned int link, nvmlNvLinkCapability_t capability, unsigned int *capResult) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d || link >= d->links.size()) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	// Every link carries P2P traffic, none of the other capabilities are modelled
+	*capResult = (capability == NVML_NVLINK_CAP_P2P_SUPPORTED) ? 1 : 0;
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetNvLinkRemotePciInfo(void *device, unsigned int link, nvmlPciInfo_t *pci) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d || link >= d->links.size()) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	fillPciInfo(d->links[link].remoteBus, pci);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetNvLinkState(void *device, unsigned int link, nvmlEnableState_t *isActive) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d || link >= d->links.size()) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	*isActive = d->links[link].active ? NVML_FEATURE_ENABLED : NVML_FEATURE_DISABLED;
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetUtilizationRates(void *device, nvmlUtilization_t *utilization) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	const unsigned long long n = ++d->reading;
+	utilization->gpu = unsigned(n % 101);
+	utilization->memory = unsigned(n * 7 % 101);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetMemoryInfo(void *device, nvmlMemory_t *memory) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	memory->total = 16ull << 30;
+	memory->used = d->reading.load() << 12;
+	memory->free = memory->total - memory->used;
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetClockInfo(void *device, int type, unsigned int *clock) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d || (type != NVML_CLOCK_SM && type != NVML_CLOCK_MEM)) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	*clock = unsigned((type == NVML_CLOCK_SM ? 1000 : 5000) + d->reading.load() % 1000);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetPowerUsage(void *device, unsigned int *power) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	*power = unsigned(100000 + d->reading.load() % 100000);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetTemperature(void *device, int sensorType, unsigned int *temp) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d || sensorType != NVML_TEMPERATURE_GPU) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	*temp = unsigned(40 + d->reading.load() % 50);
+	return NVML_SUCCESS;
+}
+
+MOCK_EXPORT nvmlReturn_t nvmlDeviceGetCurrentClocksThrottleReasons(void *device, unsigned long long *clocksThrottleReasons) {
+	callCount++;
+	MockDevice* d = getDevice(device);
+	if (!d) {
+		return NVML_ERROR_INVALID_ARGUMENT;
+	}
+	*clocksThrottleReasons = d->reading.load() & 0xff;
+	return NVML_SUCCESS;
+}
+
+// Not part of NVML. Return the number of NVML calls made since the library was loaded or the count was reset
+MOCK_EXPORT long long mockNvmlGetCallCount(void) {
+	return callCount.load();
+}
+
+MOCK_EXPORT void mockNvmlResetCallCount(void) {
+	callCount = 0;
+}
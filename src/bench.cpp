@@ -0,0 +1,1993 @@
+#include "bench.h"
+#include "collectives.h"
+#include "constants.h"
+#include "dispatch.h"
+#include "filter.h"
+#include "nvml.h"
+#include "parallel.h"
+#include "persistent.h"
+#include "replicated.h"
+#include "scheduler.h"
+#include "split.h"
+#include "streampool.h"
+#include "telemetry.h"
+#include "topology.h"
+#include "worker.h"
+#include "threadman.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <deque>
+#include <math.h>
+#include <numeric>
+#include <stdlib.h>
+#include <time.h>
+#include <thread>
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace a7az0th;
+
+// Bandwidth of broadcast, reduce and all-reduce on emulated devices, reported the way NCCL does:
+// algbw is the buffer size over the time taken, busbw scales it by the share of the data every link has to carry,
+// so it is comparable to the link bandwidth regardless of the device count
+static int benchCollectives(ProgressCallback &progress) {
+	const int numDevices = 4;
+	const int repetitions = 5;
+
+	std::vector<Device> devices(numDevices, Device(1));
+	Topology topology;
+	topology.init(numDevices);
+	PeerRouter router(&devices[0], numDevices, topology);
+	Collectives collectives(&devices[0], numDevices, topology, router, progress);
+	CUresult err = collectives.init("collectives.ptx");
+	if (err != CUDA_SUCCESS) {
+		progress.error("Collectives failed to initialize with error %d", int(err));
+		return 1;
+	}
+
+	const int maxCount = 16 << 20;
+	std::vector<DeviceBuffer*> buffers(numDevices);
+	std::vector<float> host(maxCount);
+	for (int i = 0; i < numDevices; i++) {
+		buffers[i] = new DeviceBuffer("collective", 1);
+		buffers[i]->alloc(maxCount * sizeof(float));
+	}
+
+	int failures = 0;
+	progress.info("%d emulated devices", numDevices);
+	progress.info("%-10s %10s %10s %12s %12s", "collective", "size", "time", "algbw", "busbw");
+	for (int count = 256 << 10; count <= maxCount; count *= 4) {
+		const double bytes = double(count) * sizeof(float);
+		for (int kind = 0; kind < 3; kind++) {
+			static const char* names[] = { "broadcast", "reduce", "allreduce" };
+			const double busFactor = (kind == 2) ? 2.0 * (numDevices - 1) / numDevices : 1.0;
+
+			double best = 1e300;
+			for (int r = 0; r < repetitions && err == CUDA_SUCCESS; r++) {
+				// Device d holds d+1 everywhere, so every result is known
+				for (int d = 0; d < numDevices; d++) {
+					std::fill(host.begin(), host.begin() + count, float(d + 1));
+					buffers[d]->upload(&host[0], count * sizeof(float));
+				}
+				Timer timer;
+				switch (kind) {
+					case 0: err = collectives.broadcast(buffers, count, 0); break;
+					case 1: err = collectives.reduce(buffers, count, 0, ReduceOp::Sum); break;
+					case 2: err = collectives.allReduce(buffers, count, ReduceOp::Sum); break;
+				}
+				best = std::min(best, double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6);
+			}
+			if (err != CUDA_SUCCESS) {
+				progress.error("%s failed with error %d", names[kind], int(err));
+				return 1;
+			}
+
+			const float expected = (kind == 0) ? 1.0f : float(numDevices * (numDevices + 1) / 2);
+			const int checked = (kind == 1) ? 1 : numDevices;
+			for (int d = 0; d < checked; d++) {
+				const float* result = static_cast<const float*>(buffers[d]->get());
+				for (int i = 0; i < count; i++) {
+					if (fabsf(result[i] - expected) > 1e-3f) {
+						failures++;
+						break;
+					}
+				}
+			}
+
+			const double algbw = bytes / std::max(best, 1e-9);
+			progress.info("%-10s %8.1fMB %8.2fms %7.2f GB/s %7.2f GB/s", names[kind], bytes / (1 << 20), best * 1e3, algbw * 1e-9, algbw * busFactor * 1e-9);
+		}
+	}
+
+	for (int i = 0; i < numDevices; i++) {
+		delete buffers[i];
+	}
+	if (failures) {
+		progress.error("%d collective results are wrong", failures);
+		return 1;
+	}
+	return 0;
+}
+
+// Transfers and memory of a lookup table used by only some of the devices: uploaded to every device up front,
+// against replicated lazily. Then the host rewrites the table and a single device uses it again
+static int benchReplicated(ProgressCallback &progress) {
+	const int numDevices = 4;
+	const size_t size = 32 << 20;
+
+	std::vector<Device> devices(numDevices, Device(1));
+	Topology topology;
+	topology.init(numDevices);
+	PeerRouter router(&devices[0], numDevices, topology);
+	std::vector<char> table(size);
+	for (size_t i = 0; i < size; i++) {
+		table[i] = char(i * 31);
+	}
+
+	Timer timer;
+	std::vector<DeviceBuffer*> eager(numDevices);
+	for (int i = 0; i < numDevices; i++) {
+		eager[i] = new DeviceBuffer("eagerTable", 1);
+		eager[i]->alloc(size);
+		eager[i]->upload(&table[0], size);
+	}
+	const double eagerTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+	for (int i = 0; i < numDevices; i++) {
+		delete eager[i];
+	}
+
+	// Only every other device runs kernels that reference the table
+	timer.restart();
+	ReplicatedBuffer replicated("table", &devices[0], numDevices, topology, router);
+	replicated.write(&table[0], size);
+	int failures = 0;
+	for (int i = 0; i < numDevices; i += 2) {
+		const void* replica = replicated.get(i);
+		failures += (!replica || memcmp(replica, &table[0], size) != 0);
+	}
+	const double lazyTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+
+	progress.info("%d emulated devices, %.0fMB table used by %d of them", numDevices, double(size) / (1 << 20), (numDevices + 1) / 2);
+	progress.info("eager      : %6.0fMB transferred, %d replicas, %7.2fms", double(size * numDevices) / (1 << 20), numDevices, eagerTime);
+	progress.info("replicated : %6.0fMB transferred, %d replicas, %7.2fms",
+		double(replicated.getHostBytes() + replicated.getPeerBytes()) / (1 << 20), replicated.getReplicaCount(), lazyTime);
+
+	const size_t before = replicated.getHostBytes() + replicated.getPeerBytes();
+	table[0]++;
+	replicated.write(&table[0], 0, 1);
+	const void* replica = replicated.get(0);
+	failures += (!replica || memcmp(replica, &table[0], size) != 0);
+	failures += replicated.isValid(2);
+	progress.info("after write: %6.0fMB transferred to re-sync the one device using it",
+		double(replicated.getHostBytes() + replicated.getPeerBytes() - before) / (1 << 20));
+
+	if (failures) {
+		progress.error("%d replicas are wrong", failures);
+		return 1;
+	}
+	return 0;
+}
+
+// Cost of handing work to a DeviceWorker: the round trip of a single task, and the rate at which
+// several threads can submit tiny tasks at once
+static int benchWorkers(ProgressCallback &progress) {
+	const int roundTrips = 20000;
+	const int numSubmitters = 4;
+	const int tasksPerSubmitter = 250000;
+
+	Device device(1);
+	DeviceWorker worker(device);
+
+	long long executed = 0;
+	Timer timer;
+	for (int i = 0; i < roundTrips; i++) {
+		worker.run([&executed] { executed++; });
+	}
+	const double roundTrip = double(timer.elapsed(Timer::Precision::Nanoseconds)) / roundTrips;
+
+	timer.restart();
+	std::vector<std::thread> submitters;
+	for (int t = 0; t < numSubmitters; t++) {
+		submitters.push_back(std::thread([&worker, &executed, tasksPerSubmitter] {
+			for (int i = 0; i < tasksPerSubmitter; i++) {
+				worker.submit([&executed] { executed++; });
+			}
+		}));
+	}
+	for (int t = 0; t < numSubmitters; t++) {
+		submitters[t].join();
+	}
+	worker.sync();
+	const double seconds = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6;
+
+	const long long expected = roundTrips + (long long)numSubmitters * tasksPerSubmitter;
+	progress.info("run() round trip          : %.0fns", roundTrip);
+	progress.info("%d submitters, %d tasks : %.2f Mtasks/s", numSubmitters, numSubmitters * tasksPerSubmitter, double(expected - roundTrips) / seconds * 1e-6);
+	if (executed != expected) {
+		progress.error("%lld tasks executed, expected %lld", executed, expected);
+		return 1;
+	}
+	return 0;
+}
+
+// Emulated counterpart of PERSISTENT_TASK_FILL, launched the regular way
+static void fillLaunched(const EmulatorContext &ctx, void** params) {
+	float* x = *(float**)params[0];
+	const int offset = *(int*)params[1];
+	const int i = getGlobalID(ctx);
+	x[i] = sqrtf(float(offset + i));
+}
+
+// Small tasks through the persistent kernel against one launch each through ThreadData, both on the emulator
+static int benchPersistent(ProgressCallback &progress) {
+	const int roundTrips = 20000;
+	const int numTasks = 5000;
+	const int taskSize = 4096;
+
+	Device device(1);
+	device.params.name = "Emulator";
+	std::vector<float> data(taskSize);
+
+	PersistentKernel persistent(device, progress);
+	CUresult err = persistent.start("persistent.ptx");
+	if (err != CUDA_SUCCESS) {
+		progress.error("Persistent kernel failed to start with error %d", int(err));
+		return 1;
+	}
+
+	PersistentTask nop;
+	memset(&nop, 0, sizeof(nop));
+	nop.type = PERSISTENT_TASK_NOP;
+	Timer timer;
+	for (int i = 0; i < roundTrips; i++) {
+		persistent.wait(persistent.push(nop));
+	}
+	const double roundTrip = double(timer.elapsed(Timer::Precision::Nanoseconds)) / roundTrips;
+
+	PersistentTask fill = nop;
+	fill.type = PERSISTENT_TASK_FILL;
+	fill.count = taskSize;
+	fill.ptr[0] = &data[0];
+	timer.restart();
+	for (int i = 0; i < numTasks; i++) {
+		fill.ints[0] = i;
+		persistent.wait(persistent.push(fill));
+	}
+	const double persistentTime = double(timer.elapsed(Timer::Precision::Microseconds)) / numTasks;
+
+	// An idle kernel should leave the CPUs alone once its workers stop polling
+	const int idleMs = 200;
+	const clock_t idleStart = clock();
+	std::this_thread::sleep_for(std::chrono::milliseconds(idleMs));
+	const double idleCpu = double(clock() - idleStart) * 1000.0 / CLOCKS_PER_SEC / idleMs;
+	persistent.stop();
+	int failures = (fabsf(data[1] - sqrtf(float(numTasks))) > 1e-3f);
+	failures += (idleCpu > 0.25 * getProcessorCount());
+
+	ThreadManager threadman;
+	ThreadData launcher(device, &threadman);
+	Kernel kernel("fill", fillLaunched);
+	timer.restart();
+	for (int i = 0; i < numTasks; i++) {
+		kernel.reset();
+		kernel.addParamPtr(&data[0]);
+		kernel.addParamInt(i);
+		launcher.launch(kernel, taskSize);
+		launcher.wait();
+	}
+	const double launchTime = double(timer.elapsed(Timer::Precision::Microseconds)) / numTasks;
+	failures += (fabsf(data[1] - sqrtf(float(numTasks))) > 1e-3f);
+
+	progress.info("%d CPU worker(s)", getProcessorCount());
+	progress.info("persistent NOP round trip      : %.0fns", roundTrip);
+	progress.info("persistent %d item task        : %.1fus", taskSize, persistentTime);
+	progress.info("launched %d item task          : %.1fus", taskSize, launchTime);
+	progress.info("CPUs busy while idle           : %.2f", idleCpu);
+	if (failures) {
+		progress.error("Results are wrong");
+		return 1;
+	}
+	return 0;
+}
+
+// Emulated kernel reading every item once
+static void sumEmulated(const EmulatorContext &ctx, void** params) {
+	const float* x = *(const float**)params[0];
+	float* sum = *(float**)params[1];
+	*sum += x[getGlobalID(ctx)];
+}
+
+// A kernel reading its input once, with the input uploaded first against the buffer aliasing it in place
+static int benchMapped(ProgressCallback &progress) {
+	const int count = 16 << 20;
+	const int repetitions = 5;
+
+	Device device(1);
+	ThreadData launcher(device);
+	std::vector<float> input(count, 1.0f);
+	float sum = 0.0f;
+	Kernel kernel("sum", sumEmulated);
+
+	double best[2] = { 1e300, 1e300 };
+	for (int r = 0; r < repetitions; r++) {
+		for (int aliased = 0; aliased < 2; aliased++) {
+			Timer timer;
+			DeviceBuffer buffer("input", 1);
+			if (aliased) {
+				buffer.alias(&input[0], count * sizeof(float));
+			} else {
+				buffer.alloc(count * sizeof(float));
+			}
+			buffer.upload(&input[0], count * sizeof(float));
+
+			sum = 0.0f;
+			kernel.reset();
+			kernel.addParamPtr(buffer.get());
+			kernel.addParamPtr(&sum);
+			launcher.launch(kernel, count);
+			launcher.wait();
+			best[aliased] = std::min(best[aliased], double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3);
+		}
+	}
+
+	progress.info("%.0fMB read once by an emulated kernel", double(count) * sizeof(float) / (1 << 20));
+	progress.info("alloc + upload : %7.2fms", best[0]);
+	progress.info("alias          : %7.2fms", best[1]);
+	if (sum != float(count)) {
+		progress.error("Sum is %f, expected %d", sum, count);
+		return 1;
+	}
+	return 0;
+}
+
+// A buffer appended to in small steps until it reaches its final size, growing in place against reallocating
+static int benchGrowable(ProgressCallback &progress) {
+	const size_t finalSize = size_t(256) << 20;
+	const size_t step = 64 << 10;
+
+	int failures = 0;
+	progress.info("%.0fMB appended in %.0fKB steps to an emulated buffer", double(finalSize) / (1 << 20), double(step) / 1024);
+	progress.info("%-10s %10s %14s %14s", "mode", "time", "copied", "copy avoided");
+	for (int growable = 0; growable < 2; growable++) {
+		DeviceBuffer buffer("appended", 1);
+		if (growable) {
+			buffer.allocGrowable(0);
+		} else {
+			buffer.alloc(0);
+		}
+
+		Timer timer;
+		for (size_t size = step; size <= finalSize; size += step) {
+			if (buffer.resize(size)) {
+				progress.error("Resizing to %llu bytes failed", (unsigned long long)size);
+				return 1;
+			}
+			// Stamp the new part, the earlier stamps have to survive every move
+			static_cast<size_t*>(buffer.getHostPtr())[(size - step) / sizeof(size_t)] = size;
+		}
+		const double time = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+
+		const size_t* data = static_cast<const size_t*>(buffer.getHostPtr());
+		for (size_t size = step; size <= finalSize; size += step) {
+			failures += (data[(size - step) / sizeof(size_t)] != size);
+		}
+		progress.info("%-10s %8.2fms %12.0fMB %12.0fMB", growable ? "growable" : "device", time,
+			double(buffer.getCopyBytes()) / (1 << 20), double(buffer.getCopyBytesAvoided()) / (1 << 20));
+	}
+	if (failures) {
+		progress.error("Contents were lost while growing");
+		return 1;
+	}
+	return 0;
+}
+
+// Emulated kernel writing the first float of every page
+static void touchEmulated(const EmulatorContext &ctx, void** params) {
+	float* x = *(float**)params[0];
+	x[getGlobalID(ctx) * 1024] = 1.0f;
+}
+
+// Requests each using a temporary buffer for one kernel, allocated and freed synchronously against in stream order
+static int benchAsync(ProgressCallback &progress) {
+	const size_t bufferSize = size_t(64) << 20;
+	const int numRequests = 200;
+
+	Device device(1);
+	ThreadData launcher(device);
+	CUstream stream = launcher.getStream();
+	Kernel kernel("touch", touchEmulated);
+	const int pages = int(bufferSize / (1024 * sizeof(float)));
+
+	double time[2];
+	for (int async = 0; async < 2; async++) {
+		Timer timer;
+		for (int r = 0; r < numRequests; r++) {
+			DeviceBuffer temp("temp", 1);
+			// Sizes vary a little between requests, as they would in practice
+			const size_t size = bufferSize - (r % 7) * 4096;
+			if (async) {
+				temp.allocAsync(size, stream);
+			} else {
+				temp.alloc(size);
+			}
+			kernel.reset();
+			kernel.addParamPtr(temp.get());
+			launcher.launch(kernel, int(size / (1024 * sizeof(float))));
+			if (async) {
+				temp.freeAsync(stream);
+			} else {
+				launcher.wait();
+				temp.free();
+			}
+		}
+		launcher.wait();
+		time[async] = double(timer.elapsed(Timer::Precision::Microseconds)) / numRequests;
+	}
+
+	const StreamPool &pool = StreamPool::get(1);
+	progress.info("%d requests with a %.0fMB temporary buffer touched by an emulated kernel (%d pages)", numRequests, double(bufferSize) / (1 << 20), pages);
+	progress.info("alloc + free           : %8.1fus per request", time[0]);
+	progress.info("allocAsync + freeAsync : %8.1fus per request", time[1]);
+	progress.info("pool allocations %llu, reuses %llu", (unsigned long long)pool.getAllocCount(), (unsigned long long)pool.getReuseCount());
+	return 0;
+}
+
+// What filterParams of gpu_code/kernel.cu is to the GPU, this is to the emulated filter
+static FilterParams filterParamsHost;
+
+// Host versions of the filter kernels of gpu_code/kernel.cu
+static void filterEmulated(const EmulatorContext &ctx, void** params) {
+	float* y = *(float**)params[0];
+	const float* x = *(const float**)params[1];
+	const int n = *(int*)params[2];
+	const int i = getGlobalID(ctx);
+	y[i] = applyFilter(filterParamsHost, x, n, i);
+}
+
+static void filterByValueEmulated(const EmulatorContext &ctx, void** params) {
+	float* y = *(float**)params[0];
+	const float* x = *(const float**)params[1];
+	const int n = *(int*)params[2];
+	const FilterParams &p = *(const FilterParams*)params[3];
+	const int i = getGlobalID(ctx);
+	y[i] = applyFilter(p, x, n, i);
+}
+
+// The parameters in a DeviceBuffer of their own, the way it had to be done before
+static void filterBufferEmulated(const EmulatorContext &ctx, void** params) {
+	float* y = *(float**)params[0];
+	const float* x = *(const float**)params[1];
+	const int n = *(int*)params[2];
+	const FilterParams* p = *(const FilterParams**)params[3];
+	const int i = getGlobalID(ctx);
+	y[i] = applyFilter(*p, x, n, i);
+}
+
+// Many small filter launches whose gain changes every time, with the parameters passed in three different ways
+static int benchConstants(ProgressCallback &progress) {
+	const int count = 64;
+	const int numLaunches = 20000;
+
+	Device device(1);
+	ThreadData launcher(device);
+	CUstream stream = launcher.getStream();
+	DeviceBuffer x("x", 1), y("y", 1);
+	x.alloc(count * sizeof(float));
+	y.alloc(count * sizeof(float));
+	std::vector<float> host(count, 1.0f);
+	x.upload(&host[0], count * sizeof(float));
+
+	FilterParams params;
+	memset(&params, 0, sizeof(params));
+	params.taps = 5;
+	for (int k = 0; k < params.taps; k++) {
+		params.coeffs[k] = 0.2f;
+	}
+	ConstantBuffer constants("filterParams", &filterParamsHost, sizeof(FilterParams));
+	constants.write(params);
+
+	static const char* names[] = { "DeviceBuffer", "by value", "constant" };
+	EmulatedKernel functions[] = { filterBufferEmulated, filterByValueEmulated, filterEmulated };
+	int failures = 0;
+	progress.info("%d launches of a %d item, %d tap filter, new gain every launch", numLaunches, count, params.taps);
+	for (int way = 0; way < 3; way++) {
+		Kernel kernel("filter", functions[way]);
+		Timer timer;
+		for (int l = 0; l < numLaunches; l++) {
+			params.gain = float(l % 16);
+			kernel.reset();
+			kernel.addParamPtr(y.get());
+			kernel.addParamPtr(x.get());
+			kernel.addParamInt(count);
+
+			DeviceBuffer buffer("filterParams", 1);
+			if (way == 0) {
+				buffer.alloc(sizeof(FilterParams));
+				buffer.upload(&params, sizeof(FilterParams));
+				kernel.addParamPtr(buffer.get());
+			} else if (way == 1) {
+				kernel.addParamValue(params);
+			} else {
+				// Only the gain changes, so only the gain is copied
+				constants.write(params.gain, offsetof(FilterParams, gain));
+				constants.flush(stream);
+			}
+			launcher.launch(kernel, count);
+			if (way == 0) {
+				launcher.wait();
+			}
+		}
+		launcher.wait();
+		const double time = double(timer.elapsed(Timer::Precision::Microseconds)) / numLaunches;
+
+		y.download(&host[0]);
+		failures += (fabsf(host[count / 2] - params.gain) > 1e-4f);
+		progress.info("%-12s : %6.2fus per launch", names[way], time);
+	}
+	progress.info("constant flushes %llu, %llu bytes", (unsigned long long)constants.getFlushCount(), (unsigned long long)constants.getBytesFlushed());
+	if (failures) {
+		progress.error("Results are wrong");
+		return 1;
+	}
+	return 0;
+}
+
+// Does nothing but count the threads that ran it
+struct EmptyJob : MultiThreaded {
+	std::atomic<int> calls;
+	EmptyJob() : calls(0) {}
+	void threadProc(int index, int numThreads) override {
+		calls++;
+	}
+};
+
+// Counts the cache misses of the calling thread and of the threads it creates from then on.
+// The counts of other threads are only added once they exit, so join them before calling read().
+// Hardware counters are often missing in virtual machines and containers, valid() is false then
+struct CacheMissCounter {
+	CacheMissCounter() : fd(-1) {
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+	}
+	~CacheMissCounter() {
+#ifdef __linux__
+		if (fd >= 0) {
+			close(fd);
+		}
+#endif
+	}
+	bool valid() const { return fd >= 0; }
+	long long read() const {
+		long long count = 0;
+#ifdef __linux__
+		if (fd < 0 || ::read(fd, &count, sizeof(count)) != sizeof(count)) {
+			count = 0;
+		}
+#endif
+		return count;
+	}
+private:
+	int fd;
+};
+
+// Per thread counters, side by side or each on a cache line of its own
+struct PackedCounters : MultiThreaded {
+	std::atomic<int> counts[64];
+	void threadProc(int index, int numThreads) override {
+		for (int i = 0; i < 1 << 20; i++) {
+			counts[index & 63]++;
+		}
+	}
+};
+
+struct PaddedCounters : MultiThreaded {
+	struct alignas(CACHE_LINE_SIZE) Counter { std::atomic<int> count; };
+	Counter counts[64];
+	void threadProc(int index, int numThreads) override {
+		for (int i = 0; i < 1 << 20; i++) {
+			counts[index & 63].count++;
+		}
+	}
+};
+
+// Cost of handing an empty job to the ThreadManager and waiting for it, for several thread counts,
+// with the cache misses it takes when the hardware counters are available.
+// Then the cost of false sharing itself: threads incrementing counters that share a cache line, or do not
+static int benchThreadman(ProgressCallback &progress) {
+	const int numJobs = 2000;
+
+	EmptyJob job;
+	int failures = 0;
+	progress.info("%d CPU(s), cache miss counter %s", getProcessorCount(), CacheMissCounter().valid() ? "available" : "not available");
+	progress.info("%8s %12s %12s %14s %16s", "threads", "us per job", "jobs per s", "misses per job", "starting the pool");
+	for (int numThreads = 2; numThreads <= std::max(256, getProcessorCount()); numThreads *= 2) {
+		// Wide jobs on few cores take a context switch per thread, keep the total time down
+		const int jobs = std::max(numJobs * 8 / numThreads, 20);
+		double time = 0.0, startup = 0.0;
+		CacheMissCounter misses;
+		{
+			// Created after the counter, so that it counts the workers too
+			ThreadManager threadman;
+			// The first job spawns the threads
+			Timer timer;
+			threadman.run(&job, numThreads);
+			startup = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+			job.calls = 0;
+
+			timer.restart();
+			for (int i = 0; i < jobs; i++) {
+				threadman.run(&job, numThreads);
+			}
+			time = double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-3 / jobs;
+			failures += (job.calls != jobs * numThreads);
+		}
+		char missesPerJob[32] = "n/a";
+		if (misses.valid()) {
+			snprintf(missesPerJob, sizeof(missesPerJob), "%.1f", double(misses.read()) / (jobs + 1));
+		}
+		progress.info("%8d %12.2f %12.0f %14s %14.2fms", numThreads, time, 1e6 / time, missesPerJob, startup);
+	}
+
+	ThreadManager threadman;
+	const int numThreads = std::max(getProcessorCount(), 2);
+	PackedCounters packed;
+	PaddedCounters padded;
+	for (int i = 0; i < 64; i++) {
+		packed.counts[i] = 0;
+		padded.counts[i].count = 0;
+	}
+	threadman.run(&packed, numThreads);
+	Timer timer;
+	threadman.run(&packed, numThreads);
+	const double packedTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+	timer.restart();
+	threadman.run(&padded, numThreads);
+	const double paddedTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+	progress.info("counters on %d threads, one cache line : %7.2fms, a line each : %7.2fms", numThreads, packedTime, paddedTime);
+
+	if (failures) {
+		progress.error("Not every thread ran every job");
+		return 1;
+	}
+	return 0;
+}
+
+// Sum of x[begin..end), split in halves down to grain items, every half a task of its own
+static double parallelSum(TaskScheduler &scheduler, const float* x, int begin, int end, int grain) {
+	if (end - begin <= grain) {
+		double sum = 0.0;
+		for (int i = begin; i < end; i++) {
+			sum += x[i];
+		}
+		return sum;
+	}
+	const int mid = begin + (end - begin) / 2;
+	double left = 0.0;
+	TaskGroup group(scheduler);
+	group.spawn([&] { left = parallelSum(scheduler, x, begin, mid, grain); });
+	const double right = parallelSum(scheduler, x, mid, end, grain);
+	group.sync();
+	return left + right;
+}
+
+// A loop whose iterations are very uneven. The heavy ones split their work into tasks that idle workers steal
+struct UnevenLoop : MultiThreadedFor {
+	UnevenLoop(TaskScheduler &scheduler, const std::vector<float> &x) : scheduler(scheduler), x(x), total(0) {}
+	void body(int index, int threadIdx, int numThreads) override {
+		// Iteration 0 does half the work
+		const int n = int(x.size());
+		const int begin = index ? n / 2 + (index - 1) * (n / 2) / 15 : 0;
+		const int end = n / 2 + index * (n / 2) / 15;
+		const double sum = parallelSum(scheduler, &x[0], begin, end, 1 << 14);
+		MutexRAII guard(lock);
+		total += sum;
+	}
+	TaskScheduler &scheduler;
+	const std::vector<float> &x;
+	Mutex lock;
+	double total;
+};
+
+// Overhead of spawn and sync, and nested parallelism through the work-stealing scheduler
+static int benchScheduler(ProgressCallback &progress) {
+	const int numTasks = 100000;
+	const int count = 16 << 20;
+
+	TaskScheduler scheduler;
+	std::vector<float> x(count, 1.0f);
+	int failures = 0;
+	progress.info("%d worker(s) and the calling thread", scheduler.getWorkerCount());
+
+	std::atomic<int> calls(0);
+	Timer timer;
+	{
+		TaskGroup group(scheduler);
+		for (int i = 0; i < numTasks; i++) {
+			group.spawn([&calls] { calls++; });
+		}
+		group.sync();
+	}
+	progress.info("spawn + sync of an empty task : %.0fns", double(timer.elapsed(Timer::Precision::Nanoseconds)) / numTasks);
+	failures += (calls != numTasks);
+
+	timer.restart();
+	double sum = 0.0;
+	for (int i = 0; i < count; i++) {
+		sum += x[i];
+	}
+	const double serialTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+	failures += (sum != count);
+
+	const int grains[] = { 1 << 10, 1 << 14, 1 << 18 };
+	progress.info("serial sum of %dM floats     : %7.2fms", count >> 20, serialTime);
+	for (int g = 0; g < 3; g++) {
+		timer.restart();
+		sum = parallelSum(scheduler, &x[0], 0, count, grains[g]);
+		const double time = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+		failures += (sum != count);
+		progress.info("nested sum, %6d item grain : %7.2fms, %d tasks", grains[g], time, count / grains[g]);
+	}
+
+	UnevenLoop loop(scheduler, x);
+	timer.restart();
+	loop.run(scheduler, 16, std::max(scheduler.getWorkerCount() + 1, 2));
+	progress.info("uneven MultiThreadedFor      : %7.2fms", double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3);
+	failures += (loop.total != count);
+
+	if (failures) {
+		progress.error("Results are wrong");
+		return 1;
+	}
+	return 0;
+}
+
+// A loop body costing a given number of multiply-adds per iteration
+struct CostLoop : MultiThreadedFor {
+	CostLoop(std::vector<float> &x, int cost) : x(x), cost(cost) {}
+	void body(int index, int threadIdx, int numThreads) override {
+		float v = x[index];
+		for (int k = 0; k < cost; k++) {
+			v = v * 0.999f + 0.001f;
+		}
+		x[index] = v;
+	}
+	std::vector<float> &x;
+	int cost;
+};
+
+// Time per iteration of MultiThreadedFor under every schedule, for cheap to expensive bodies
+static int benchLoops(ProgressCallback &progress) {
+	const int costs[] = { 0, 16, 256 };
+	const int work = 1 << 24;
+
+	ThreadManager threadman;
+	static const char* names[] = { "dynamic", "static", "grain 256", "guided" };
+	const MultiThreadedFor::Schedule schedules[] = {
+		MultiThreadedFor::Schedule::Dynamic,
+		MultiThreadedFor::Schedule::Static,
+		MultiThreadedFor::Schedule::Grain,
+		MultiThreadedFor::Schedule::Guided,
+	};
+
+	int failures = 0;
+	// Powers of two up to, and always including, every core
+	for (int numThreads = 1; ; numThreads = std::min(numThreads * 2, getProcessorCount())) {
+		progress.info("%d thread(s), ns per iteration", numThreads);
+		progress.info("%-10s %10s %10s %10s", "schedule", "cost 0", "cost 16", "cost 256");
+		for (int s = 0; s < 4; s++) {
+			double times[3];
+			for (int c = 0; c < 3; c++) {
+				// Keep the total work roughly the same
+				const int count = work / (costs[c] + 1);
+				std::vector<float> x(count, 1.0f);
+				CostLoop loop(x, costs[c]);
+				loop.setSchedule(schedules[s], 256);
+				Timer timer;
+				loop.run(threadman, count, numThreads);
+				times[c] = double(timer.elapsed(Timer::Precision::Nanoseconds)) / count;
+				failures += int(std::count(x.begin(), x.end(), x[0]) != count);
+			}
+			progress.info("%-10s %10.2f %10.2f %10.2f", names[s], times[0], times[1], times[2]);
+		}
+		if (numThreads == getProcessorCount()) {
+			break;
+		}
+	}
+	if (failures) {
+		progress.error("Not every iteration ran");
+		return 1;
+	}
+	return 0;
+}
+
+// Blocks of an array, written or summed one block per iteration
+struct BandwidthLoop : MultiThreadedFor {
+	static const int BLOCK = 16 << 10; // Floats per iteration
+	BandwidthLoop(float* x, int numThreads) : x(x), write(true), partial(numThreads * 16, 0.0) {}
+	void body(int index, int threadIdx, int numThreads) override {
+		float* block = x + size_t(index) * BLOCK;
+		if (write) {
+			for (int i = 0; i < BLOCK; i++) {
+				block[i] = 1.0f;
+			}
+			return;
+		}
+		float sum = 0.0f;
+		for (int i = 0; i < BLOCK; i++) {
+			sum += block[i];
+		}
+		// Every thread's sum on a cache line of its own
+		partial[threadIdx * 16] += sum;
+	}
+	double total() const {
+		double sum = 0.0;
+		for (int i = 0; i < int(partial.size()); i += 16) {
+			sum += partial[i];
+		}
+		return sum;
+	}
+	float* x;
+	bool write;
+	std::vector<double> partial;
+};
+
+// Read bandwidth of an array depending on where its pages were first touched and where the threads reading it run.
+// Pages land on the node of the thread that first writes them. A serial initialization puts all of them on one node,
+// while the same NumaLocal loop for writing and reading keeps every block on the node of the threads reading it
+static int benchNuma(ProgressCallback &progress) {
+	const int numBlocks = 2048; // 128MB
+	const int repetitions = 5;
+
+	const CpuTopology &topology = CpuTopology::get();
+	const int numThreads = topology.getCpuCount();
+	progress.info("%d CPU(s) on %d NUMA node(s)", numThreads, topology.getNodeCount());
+	for (int n = 0; n < topology.getNodeCount(); n++) {
+		progress.info("node %d : %d CPU(s)", n, topology.getNodeCpuCount(n));
+	}
+
+	struct Setup {
+		const char* name;
+		AffinityPolicy::Kind policy;
+		bool serialTouch;
+		MultiThreadedFor::Schedule schedule;
+	};
+	const Setup setups[] = {
+		{ "unpinned, serial first touch, static read", AffinityPolicy::Kind::None, true, MultiThreadedFor::Schedule::Static },
+		{ "unpinned, parallel first touch, static", AffinityPolicy::Kind::None, false, MultiThreadedFor::Schedule::Static },
+		{ "scatter, serial first touch, NUMA local", AffinityPolicy::Kind::Scatter, true, MultiThreadedFor::Schedule::NumaLocal },
+		{ "scatter, NUMA local first touch and read", AffinityPolicy::Kind::Scatter, false, MultiThreadedFor::Schedule::NumaLocal },
+		{ "compact, NUMA local first touch and read", AffinityPolicy::Kind::Compact, false, MultiThreadedFor::Schedule::NumaLocal },
+	};
+
+	int failures = 0;
+	const size_t bytes = size_t(numBlocks) * BandwidthLoop::BLOCK * sizeof(float);
+	for (int s = 0; s < int(sizeof(setups) / sizeof(setups[0])); s++) {
+		const Setup &setup = setups[s];
+		ThreadManager threadman;
+		threadman.setAffinity(AffinityPolicy(setup.policy));
+		if (threadman.getThreadCpu(0) >= 0) {
+			setCurrentThreadAffinity(threadman.getThreadCpu(0));
+		}
+
+		// Pages of a fresh allocation are not backed by memory before they are written
+		float* x = new float[size_t(numBlocks) * BandwidthLoop::BLOCK];
+		BandwidthLoop loop(x, numThreads);
+		loop.setSchedule(setup.schedule);
+		if (setup.serialTouch) {
+			loop.run(threadman, numBlocks, 1);
+		} else {
+			loop.run(threadman, numBlocks, numThreads);
+		}
+
+		loop.write = false;
+		double best = 0.0;
+		for (int r = 0; r < repetitions; r++) {
+			Timer timer;
+			loop.run(threadman, numBlocks, numThreads);
+			const double seconds = double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-9;
+			best = std::max(best, double(bytes) / seconds * 1e-9);
+		}
+		failures += (loop.total() != double(repetitions) * numBlocks * BandwidthLoop::BLOCK);
+		progress.info("%-42s : %7.2fGB/s", setup.name, best);
+
+		delete [] x;
+		clearCurrentThreadAffinity();
+	}
+
+	if (failures) {
+		progress.error("Sums are wrong");
+		return 1;
+	}
+	return 0;
+}
+
+struct SqrtItem {
+	float operator()(float x) const { return sqrtf(x) * 0.5f + 1.0f; }
+};
+
+struct SqrtRange {
+	SqrtRange(float* x) : x(x) {}
+	void operator()(int begin, int end) const {
+		for (int i = begin; i < end; i++) {
+			x[i] = sqrtf(x[i]) * 0.5f + 1.0f;
+		}
+	}
+	float* x;
+};
+
+// The parallel algorithms against their sequential STL counterparts
+static int benchParallel(ProgressCallback &progress) {
+	const int count = 16 << 20;
+
+	ThreadManager threadman;
+	progress.info("%d thread(s), %dM items", getProcessorCount(), count >> 20);
+	progress.info("%-24s %10s %10s %8s", "algorithm", "STL", "parallel", "speedup");
+	int failures = 0;
+	double stlTime = 0.0, parallelTime = 0.0;
+	Timer timer;
+	const auto report = [&](const char* name) {
+		progress.info("%-24s %8.2fms %8.2fms %7.2fx", name, stlTime, parallelTime, stlTime / parallelTime);
+	};
+	const auto elapsed = [&timer]() {
+		const double time = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+		timer.restart();
+		return time;
+	};
+
+	Table<float> x(count), y(count), z(count);
+	for (int i = 0; i < count; i++) {
+		x[i] = float(i & 1023);
+	}
+
+	y.copy(x);
+	z.copy(x);
+	timer.restart();
+	SqrtRange(y.begin())(0, count);
+	stlTime = elapsed();
+	parallelFor(threadman, 0, count, SqrtRange(z.begin()));
+	parallelTime = elapsed();
+	failures += !std::equal(y.begin(), y.end(), z.begin());
+	report("for");
+
+	timer.restart();
+	std::transform(x.begin(), x.end(), y.begin(), SqrtItem());
+	stlTime = elapsed();
+	parallelTransform(threadman, x, z, SqrtItem());
+	parallelTime = elapsed();
+	failures += !std::equal(y.begin(), y.end(), z.begin());
+	report("transform");
+
+	// Integers keep the sums exact whatever the order
+	Table<int> a(count), b(count), c(count);
+	for (int i = 0; i < count; i++) {
+		a[i] = i & 255;
+	}
+	timer.restart();
+	const long long serialSum = std::accumulate(a.begin(), a.end(), 0LL);
+	stlTime = elapsed();
+	struct SumRange {
+		SumRange(const int* a) : a(a) {}
+		long long operator()(int begin, int end, long long sum) const {
+			for (int i = begin; i < end; i++) {
+				sum += a[i];
+			}
+			return sum;
+		}
+		const int* a;
+	};
+	const long long sum = parallelReduce(threadman, 0, count, 0LL, SumRange(a.begin()), std::plus<long long>());
+	parallelTime = elapsed();
+	failures += (sum != serialSum);
+	report("reduce");
+
+	timer.restart();
+	std::partial_sum(a.begin(), a.end(), b.begin());
+	stlTime = elapsed();
+	parallelInclusiveScan(threadman, a, c, 0, std::plus<int>());
+	parallelTime = elapsed();
+	failures += !std::equal(b.begin(), b.end(), c.begin());
+	report("inclusive scan");
+
+	// No std::exclusive_scan before C++17
+	b[0] = 0;
+	for (int i = 1; i < count; i++) {
+		b[i] = b[i - 1] + a[i - 1];
+	}
+	stlTime = elapsed();
+	parallelExclusiveScan(threadman, a, c, 0, std::plus<int>());
+	parallelTime = elapsed();
+	failures += !std::equal(b.begin(), b.end(), c.begin());
+	report("exclusive scan");
+
+	// Keys spread over the whole range, negative ones included
+	unsigned state = 12345;
+	for (int i = 0; i < count; i++) {
+		state = state * 1664525u + 1013904223u;
+		a[i] = int(state);
+	}
+	b.copy(a);
+	c.copy(a);
+	timer.restart();
+	std::sort(b.begin(), b.end());
+	stlTime = elapsed();
+	parallelSort(threadman, c);
+	parallelTime = elapsed();
+	failures += !std::equal(b.begin(), b.end(), c.begin());
+	report("sort, radix");
+
+	for (int i = 0; i < count; i++) {
+		x[i] = float(a[i]);
+	}
+	y.copy(x);
+	z.copy(x);
+	timer.restart();
+	std::sort(y.begin(), y.end(), std::greater<float>());
+	stlTime = elapsed();
+	parallelSort(threadman, z, std::greater<float>());
+	parallelTime = elapsed();
+	failures += !std::equal(y.begin(), y.end(), z.begin());
+	report("sort, comparison");
+
+	if (failures) {
+		progress.error("Results differ from the STL");
+		return 1;
+	}
+	return 0;
+}
+
+// A few microseconds of arithmetic
+static float spin(int seed) {
+	float v = float(seed);
+	for (int k = 0; k < 2000; k++) {
+		v = v * 0.999f + 0.001f;
+	}
+	return v;
+}
+
+// Latency of submit() and get() on the ThreadManager, then tasks from several host threads at once,
+// then tasks in flight next to fork-join jobs
+static int benchSubmit(ProgressCallback &progress) {
+	const int numTasks = 4000;
+	const int numSubmitters = 4;
+
+	ThreadManager threadman;
+	int failures = 0;
+	progress.info("%d CPU(s)", getProcessorCount());
+
+	// Warm up the pool
+	threadman.submit([] { return 0; }).get();
+	Timer timer;
+	for (int i = 0; i < numTasks; i++) {
+		failures += (threadman.submit([i] { return i; }).get() != i);
+	}
+	progress.info("submit + get of an empty task      : %8.2fus", double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-3 / numTasks);
+
+	timer.restart();
+	float serial = 0.0f;
+	for (int i = 0; i < numTasks; i++) {
+		serial += spin(i);
+	}
+	const double serialTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+
+	timer.restart();
+	std::vector<std::thread> submitters;
+	std::vector<float> sums(numSubmitters, 0.0f);
+	for (int t = 0; t < numSubmitters; t++) {
+		submitters.push_back(std::thread([&threadman, &sums, t] {
+			std::vector<std::future<float> > results;
+			for (int i = t; i < numTasks; i += numSubmitters) {
+				results.push_back(threadman.submit([i] { return spin(i); }));
+			}
+			for (int i = 0; i < int(results.size()); i++) {
+				sums[t] += results[i].get();
+			}
+		}));
+	}
+	for (int t = 0; t < numSubmitters; t++) {
+		submitters[t].join();
+	}
+	const double submitTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+	float total = 0.0f;
+	for (int t = 0; t < numSubmitters; t++) {
+		total += sums[t];
+	}
+	// Only the order of the additions differs
+	failures += (fabsf(total - serial) > 1e-3f * fabsf(serial));
+	progress.info("%d tasks, serial                  : %8.2fms", numTasks, serialTime);
+	progress.info("%d tasks from %d submitting threads : %8.2fms", numTasks, numSubmitters, submitTime);
+
+	// Tasks, such as decoding the next image, running while the caller runs jobs on the pool
+	timer.restart();
+	std::vector<std::future<float> > results;
+	for (int i = 0; i < numTasks; i++) {
+		results.push_back(threadman.submit([i] { return spin(i); }));
+	}
+	EmptyJob job;
+	const int numJobs = 100;
+	for (int i = 0; i < numJobs; i++) {
+		threadman.run(&job, getProcessorCount() + 1);
+	}
+	total = 0.0f;
+	for (int i = 0; i < numTasks; i++) {
+		total += results[i].get();
+	}
+	failures += (fabsf(total - serial) > 1e-3f * fabsf(serial));
+	failures += (job.calls != numJobs * (getProcessorCount() + 1));
+	progress.info("%d tasks next to %d jobs          : %8.2fms", numTasks, numJobs, double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3);
+
+	// A task that submits while the pool is torn down. Its own task must run, not deadlock nor be dropped
+	std::future<int> inner;
+	{
+		ThreadManager pool;
+		std::atomic<bool> started(false);
+		pool.submit([&pool, &inner, &started] {
+			started = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			inner = pool.submit([] { return 42; });
+		});
+		while (!started) {
+			std::this_thread::yield();
+		}
+	}
+	failures += (inner.get() != 42);
+
+	if (failures) {
+		progress.error("Results are wrong");
+		return 1;
+	}
+	return 0;
+}
+
+// The baseline for the lock-free queues: a std::deque behind a Mutex, with the same calls
+template <typename T>
+struct LockedDeque {
+	LockedDeque(size_t capacity) : capacity(capacity) {}
+	int pushBatch(const T* batch, int count) {
+		MutexRAII guard(lock);
+		int n = 0;
+		for (; n < count && items.size() < capacity; n++) {
+			items.push_back(batch[n]);
+		}
+		return n;
+	}
+	int popBatch(T* batch, int maxCount) {
+		MutexRAII guard(lock);
+		int n = 0;
+		for (; n < maxCount && !items.empty(); n++) {
+			batch[n] = items.front();
+			items.pop_front();
+		}
+		return n;
+	}
+	Mutex lock;
+	std::deque<T> items;
+	size_t capacity;
+};
+
+// Push count items, batch at a time, in producers threads, and pop them all in consumers threads
+// @return Time in ms, or a negative number if the items popped do not add up
+template <typename Queue>
+static double queueThroughput(Queue &queue, int count, int batch, int producers, int consumers) {
+	std::atomic<long long> sum(0);
+	std::vector<std::thread> threads;
+	Timer timer;
+	for (int p = 0; p < producers; p++) {
+		threads.push_back(std::thread([&queue, count, batch, producers, p] {
+			std::vector<int> items(batch);
+			for (int i = p; i < count; ) {
+				int n = 0;
+				for (int k = i; n < batch && k < count; k += producers) {
+					items[n++] = k;
+				}
+				int pushed = 0;
+				while (pushed < n) {
+					const int done = queue.pushBatch(&items[pushed], n - pushed);
+					pushed += done;
+					if (!done) {
+						std::this_thread::yield();
+					}
+				}
+				i += n * producers;
+			}
+		}));
+	}
+	std::atomic<int> popped(0);
+	for (int c = 0; c < consumers; c++) {
+		threads.push_back(std::thread([&queue, &sum, &popped, count, batch] {
+			std::vector<int> items(batch);
+			long long local = 0;
+			while (popped < count) {
+				const int n = queue.popBatch(&items[0], batch);
+				if (!n) {
+					std::this_thread::yield();
+					continue;
+				}
+				for (int i = 0; i < n; i++) {
+					local += items[i];
+				}
+				popped += n;
+			}
+			sum += local;
+		}));
+	}
+	for (int i = 0; i < int(threads.size()); i++) {
+		threads[i].join();
+	}
+	const double time = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3;
+	return (sum == (long long)count * (count - 1) / 2) ? time : -1.0;
+}
+
+// Round trip of one item through two queues, bounced back by a second thread
+// @return Time in us per round trip
+template <typename Queue>
+static double queueLatency(Queue &forth, Queue &back, int count) {
+	std::thread echo([&forth, &back, count] {
+		for (int i = 0; i < count; i++) {
+			int item = 0;
+			while (!forth.popBatch(&item, 1)) {
+				std::this_thread::yield();
+			}
+			while (!back.pushBatch(&item, 1)) {
+				std::this_thread::yield();
+			}
+		}
+	});
+	Timer timer;
+	for (int i = 0; i < count; i++) {
+		int item = i;
+		while (!forth.pushBatch(&item, 1)) {
+			std::this_thread::yield();
+		}
+		while (!back.popBatch(&item, 1)) {
+			std::this_thread::yield();
+		}
+	}
+	const double time = double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-3 / count;
+	echo.join();
+	return time;
+}
+
+// Throughput of SpscQueue and MpmcQueue, single items and batches, and their round trip latency,
+// against a std::deque behind a Mutex
+static int benchQueues(ProgressCallback &progress) {
+	const int count = 1 << 22;
+	const int roundTrips = 20000;
+	const size_t capacity = 1024;
+
+	int failures = 0;
+	progress.info("%d CPU(s), %dM items, capacity %d", getProcessorCount(), count >> 20, int(capacity));
+	progress.info("%-28s %12s %12s", "Mitems/s", "lock-free", "locked deque");
+	const int batches[] = { 1, 64 };
+	for (int b = 0; b < 2; b++) {
+		const int batch = batches[b];
+		SpscQueue<int> spsc(capacity);
+		LockedDeque<int> deque1(capacity);
+		const double spscTime = queueThroughput(spsc, count, batch, 1, 1);
+		const double dequeTime1 = queueThroughput(deque1, count, batch, 1, 1);
+
+		MpmcQueue<int> mpmc(capacity);
+		LockedDeque<int> deque4(capacity);
+		const double mpmcTime = queueThroughput(mpmc, count, batch, 2, 2);
+		const double dequeTime4 = queueThroughput(deque4, count, batch, 2, 2);
+
+		failures += (spscTime < 0.0) + (dequeTime1 < 0.0) + (mpmcTime < 0.0) + (dequeTime4 < 0.0);
+		progress.info("SPSC, 1 to 1, batch %-7d %12.2f %12.2f", batch, count * 1e-3 / spscTime, count * 1e-3 / dequeTime1);
+		progress.info("MPMC, 2 to 2, batch %-7d %12.2f %12.2f", batch, count * 1e-3 / mpmcTime, count * 1e-3 / dequeTime4);
+	}
+
+	SpscQueue<int> spscForth(capacity), spscBack(capacity);
+	MpmcQueue<int> mpmcForth(capacity), mpmcBack(capacity);
+	LockedDeque<int> dequeForth(capacity), dequeBack(capacity);
+	const double spscLatency = queueLatency(spscForth, spscBack, roundTrips);
+	const double mpmcLatency = queueLatency(mpmcForth, mpmcBack, roundTrips);
+	const double dequeLatency = queueLatency(dequeForth, dequeBack, roundTrips);
+	progress.info("round trip, SPSC %7.2fus, MPMC %7.2fus, locked deque %7.2fus", spscLatency, mpmcLatency, dequeLatency);
+
+	if (failures) {
+		progress.error("Items were lost or duplicated");
+		return 1;
+	}
+	return 0;
+}
+
+// A semaphore made of a mutex and a condition variable, the way it is done without futexes
+struct LockedSemaphore {
+	LockedSemaphore() : count(0) {}
+	void post() {
+		std::unique_lock<std::mutex> lk(m);
+		count++;
+		c.notify_one();
+	}
+	void wait() {
+		std::unique_lock<std::mutex> lk(m);
+		c.wait(lk, [this] { return count > 0; });
+		count--;
+	}
+	std::mutex m;
+	std::condition_variable c;
+	int count;
+};
+
+// Ping-pong between two threads through a pair of semaphores
+// @return Time in us per round trip
+template <typename Sem>
+static double pingPong(Sem &ping, Sem &pong, int count) {
+	std::thread echo([&ping, &pong, count] {
+		for (int i = 0; i < count; i++) {
+			ping.wait();
+			pong.post();
+		}
+	});
+	Timer timer;
+	for (int i = 0; i < count; i++) {
+		ping.post();
+		pong.wait();
+	}
+	const double time = double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-3 / count;
+	echo.join();
+	return time;
+}
+
+// Cost of Semaphore and Event when nobody has to block, and their round trip between two threads,
+// against a semaphore built on a condition variable
+static int benchEvents(ProgressCallback &progress) {
+	const int count = 1000000;
+	const int roundTrips = 20000;
+	int failures = 0;
+	progress.info("%d CPU(s)", getProcessorCount());
+
+	// A signal sent before the wait must not be lost
+	Event event;
+	event.signal();
+	std::thread late([&event] { event.wait(); });
+	late.join();
+
+	Semaphore semaphore;
+	Timer timer;
+	for (int i = 0; i < count; i++) {
+		semaphore.post();
+		semaphore.wait();
+	}
+	const double semaphoreTime = double(timer.elapsed(Timer::Precision::Nanoseconds)) / count;
+	failures += semaphore.tryWait();
+
+	LockedSemaphore locked;
+	timer.restart();
+	for (int i = 0; i < count; i++) {
+		locked.post();
+		locked.wait();
+	}
+	const double lockedTime = double(timer.elapsed(Timer::Precision::Nanoseconds)) / count;
+
+	timer.restart();
+	for (int i = 0; i < count; i++) {
+		event.signal();
+		event.wait();
+	}
+	const double eventTime = double(timer.elapsed(Timer::Precision::Nanoseconds)) / count;
+	progress.info("post + wait, nobody blocked : Semaphore %6.1fns, Event %6.1fns, condition variable %6.1fns", semaphoreTime, eventTime, lockedTime);
+
+	Semaphore ping, pong;
+	LockedSemaphore lockedPing, lockedPong;
+	const double futexTrip = pingPong(ping, pong, roundTrips);
+	const double lockedTrip = pingPong(lockedPing, lockedPong, roundTrips);
+	progress.info("round trip between threads  : Semaphore %6.2fus, condition variable %6.2fus", futexTrip, lockedTrip);
+
+	if (failures) {
+		progress.error("Semaphore kept a permit it should not have");
+		return 1;
+	}
+	return 0;
+}
+
+// Emulated kernel writing twice its index
+static void doubleEmulated(const EmulatorContext &ctx, void** params) {
+	int* out = *(int**)params[0];
+	const int offset = *(int*)params[1];
+	const int i = getGlobalID(ctx);
+	out[offset + i] = 2 * (offset + i);
+}
+
+// A job with a known cost on every device. Candidate 0 pays perItem for every item, the emulator standing in for
+// a GPU pays a fixed round trip and a far lower per item cost, so the route has to change at a known work size
+struct CostedJob : DeviceJob {
+	CostedJob(Device &gpu, int maxCount) : gpu(gpu), kernel("double", doubleEmulated), out(maxCount, -1) {}
+
+	std::string getName() const override { return "costed"; }
+
+	CUresult execute(ThreadData &launcher, int offset, int count) override {
+		Timer timer;
+		kernel.reset();
+		kernel.addParamPtr(&out[0]);
+		kernel.addParamInt(offset);
+		const CUresult err = launcher.launch(kernel, count);
+		const bool onGpu = (&launcher.getDevice() == &gpu);
+		const double seconds = onGpu ? GPU_OVERHEAD + GPU_PER_ITEM * count : CPU_PER_ITEM * count;
+		while (double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-9 < seconds) {
+			//spin
+		}
+		return err;
+	}
+
+	static int getCrossover() { return int(GPU_OVERHEAD / (CPU_PER_ITEM - GPU_PER_ITEM)); }
+
+	static constexpr double CPU_PER_ITEM = 100e-9;
+	static constexpr double GPU_PER_ITEM = 10e-9;
+	static constexpr double GPU_OVERHEAD = 500e-6;
+
+	Device &gpu;
+	Kernel kernel;
+	std::vector<int> out;
+};
+
+// The Dispatcher learning the costs of a job on an emulator and an emulator standing in for a GPU,
+// then routing work sizes on either side of the crossover to the right one
+static int benchDispatch(ProgressCallback &progress) {
+	const int minCount = 256;
+	const int maxCount = 256 << 10;
+	const int rounds = 8;
+
+	Device cpu(1);
+	cpu.params.name = "Emulator";
+	Device gpu(1);
+	gpu.params.name = "StandIn";
+	gpu.params.multiProcessorCount = 16;
+	gpu.params.clockRate = 1000000;
+
+	std::vector<Device*> devices;
+	devices.push_back(&cpu);
+	devices.push_back(&gpu);
+	// A few samples more than the default before trusting a model, a single preempted run must not lock a device out
+	Dispatcher::Config config;
+	config.warmupSamples = 4;
+	Dispatcher dispatcher(devices, progress, nullptr, config);
+	CostedJob job(gpu, maxCount);
+
+	int failures = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int count = minCount; count <= maxCount; count *= 2) {
+			std::fill(job.out.begin(), job.out.begin() + count, -1);
+			if (dispatcher.run(job, count) != CUDA_SUCCESS) {
+				progress.error("Dispatching %d items failed", count);
+				return 1;
+			}
+			for (int i = 0; i < count; i++) {
+				failures += (job.out[i] != 2 * i);
+			}
+		}
+	}
+
+	const int expected = CostedJob::getCrossover();
+	const int crossover = dispatcher.getCrossover(job.getName());
+	progress.info("Crossover: expected %d items, learned %d items", expected, crossover);
+	for (int i = 0; i < dispatcher.getCandidateCount(); i++) {
+		const CostModel* model = dispatcher.getModel(job.getName(), i);
+		progress.info("%-8s: overhead %8.1fus, per item %6.1fns, %d samples", dispatcher.getCandidate(i).params.name.c_str(),
+			model->getOverhead() * 1e6, model->getPerItem() * 1e9, model->getSampleCount());
+	}
+	if (crossover < expected / 2 || crossover > expected * 2) {
+		progress.error("Learned crossover is off by more than a factor of two");
+		failures++;
+	}
+
+	// The last round ran with settled models. Work far enough from the crossover has a single right answer
+	const std::vector<DispatchRecord> &history = dispatcher.getHistory();
+	for (int i = int(history.size()) - 1; i >= 0 && history[i].workSize > minCount; i--) {
+		const int best = (history[i].workSize < expected) ? 0 : 1;
+		const bool clear = (history[i].workSize * 4 <= expected || history[i].workSize >= expected * 4);
+		progress.info("%7d items -> %s", history[i].workSize, dispatcher.getCandidate(history[i].device).params.name.c_str());
+		if (clear && history[i].device != best) {
+			progress.error("%d items went to %s", history[i].workSize, dispatcher.getCandidate(history[i].device).params.name.c_str());
+			failures++;
+		}
+	}
+	if (dispatcher.choose(job, expected / 4) != 0 || dispatcher.choose(job, expected * 4) != 1) {
+		progress.error("choose() disagrees with the crossover");
+		failures++;
+	}
+	return failures ? 1 : 0;
+}
+
+// Emulated kernel writing a value every item can be checked against
+static void stampEmulated(const EmulatorContext &ctx, void** params) {
+	int* out = *(int**)params[0];
+	const int offset = *(int*)params[1];
+	const int i = getGlobalID(ctx);
+	out[i] = (offset + i) * 7 + 3;
+}
+
+// Every partition goes through a buffer of its own device and is downloaded at its offset of the shared output
+struct StampJob : DeviceJob {
+	StampJob(int count) : out(count, -1) {}
+
+	std::string getName() const override { return "stamp"; }
+
+	CUresult execute(ThreadData &launcher, int offset, int count) override {
+		DeviceBuffer buffer("stamp", launcher.getDevice().isEmulator());
+		if (buffer.alloc(count * sizeof(int))) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+		Kernel kernel("stamp", stampEmulated);
+		kernel.addParamPtr(buffer.get());
+		kernel.addParamInt(offset);
+		const CUresult err = launcher.launch(kernel, count);
+		if (err != CUDA_SUCCESS) {
+			return err;
+		}
+		launcher.wait();
+		return buffer.download(&out[offset]) ? CUDA_ERROR_UNKNOWN : CUDA_SUCCESS;
+	}
+
+	std::vector<int> out;
+};
+
+// One grid split over several emulated devices at once, all of them handed the same ThreadManager
+static int benchSplit(ProgressCallback &progress) {
+	const int numDevices = 3;
+	const int runs = 10;
+	const Grid grid(1024, 768);
+
+	std::vector<Device> emulators(numDevices, Device(1));
+	std::vector<Device*> devices;
+	for (int i = 0; i < numDevices; i++) {
+		emulators[i].params.name = "Emulator" + std::to_string(i);
+		devices.push_back(&emulators[i]);
+	}
+	ThreadManager threadman;
+	SplitLauncher launcher(devices, progress, &threadman);
+	StampJob job(grid.count());
+
+	int failures = 0;
+	Timer timer;
+	for (int r = 0; r < runs; r++) {
+		std::fill(job.out.begin(), job.out.end(), -1);
+		if (launcher.run(job, grid) != CUDA_SUCCESS) {
+			progress.error("Split run %d failed", r);
+			return 1;
+		}
+		for (int i = 0; i < grid.count(); i++) {
+			failures += (job.out[i] != i * 7 + 3);
+		}
+
+		// The partitions cover the grid in whole rows, every device keeps a share
+		int offset = 0;
+		for (int d = 0; d < numDevices; d++) {
+			const Partition &part = launcher.getPartitions()[d];
+			failures += (part.offset != offset || part.count % grid.width != 0 || part.count == 0);
+			offset += part.count;
+		}
+		failures += (offset != grid.count());
+	}
+	const double time = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-3 / runs;
+
+	progress.info("%dx%d grid over %d emulated devices, %.2fms per run", grid.width, grid.height, numDevices, time);
+	for (int d = 0; d < numDevices; d++) {
+		const Partition &part = launcher.getPartitions()[d];
+		progress.info("%-10s: rows [%4d, %4d), %7.1f Mitems/s", launcher.getDevice(d).params.name.c_str(),
+			part.offset / grid.width, (part.offset + part.count) / grid.width, launcher.getThroughput(d) * 1e-6);
+	}
+	if (failures) {
+		progress.error("%d items or partitions are wrong", failures);
+		return 1;
+	}
+	return 0;
+}
+
+// Point NVML at the mock library built along with devman, unless DEVMAN_NVML_LIBRARY names another one already
+static void useMockNVML() {
+#ifdef DEVMAN_MOCK_NVML
+	const char* current = getenv("DEVMAN_NVML_LIBRARY");
+	if (current && current[0]) {
+		return;
+	}
+#ifdef _WIN32
+	_putenv_s("DEVMAN_NVML_LIBRARY", DEVMAN_MOCK_NVML);
+#else
+	setenv("DEVMAN_NVML_LIBRARY", DEVMAN_MOCK_NVML, 1);
+#endif
+#endif
+}
+
+// Devices standing in for the GPUs of the mock NVML, found by their PCI bus ID. See mock/mock_nvml.cpp
+// @param reversed Give device d the bus of mock device count-1-d, so matching by index would go wrong
+static std::vector<Device> getMockDevices(int count, bool reversed) {
+	std::vector<Device> devices(count, Device(1));
+	for (int d = 0; d < count; d++) {
+		char busId[32];
+		snprintf(busId, sizeof(busId), "0000:%02x:00.0", 0x10 + (reversed ? count - 1 - d : d));
+		devices[d].params.pciBusId = busId;
+		devices[d].params.devId = d;
+		devices[d].params.name = "Mock";
+	}
+	return devices;
+}
+
+// The topology of the mock NVML's six devices, listed in reverse, with an emulator without PCI bus ID at the end.
+// Checks the link counts, cliques, peer rates and best groups against the known graph
+static int benchTopology(ProgressCallback &progress) {
+	const int numMock = 6;
+	const int queries = 1000;
+	useMockNVML();
+
+	std::vector<Device> devices = getMockDevices(numMock, true);
+	devices.push_back(Device(1));
+	devices.back().params.name = "Emulator";
+	const int numDevices = int(devices.size());
+
+	Topology topology;
+	NVMLSession session;
+	ErrorCode err = queryTopologyWithNVML(&devices[0], numDevices, topology);
+	if (err.error()) {
+		progress.error("%s", err.getError().c_str());
+		return 1;
+	}
+	Timer timer;
+	for (int q = 0; q < queries; q++) {
+		queryTopologyWithNVML(&devices[0], numDevices, topology);
+	}
+	const double queryTime = double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-3 / queries;
+	progress.info("Topology of %d devices, %.1fus per query:\n%s", numDevices, queryTime, topology.getInfo().c_str());
+
+	// Links of the mock, by mock index. Device d is mock device 5-d
+	static const int mockLinks[numMock][numMock] = {
+		{ 0, 2, 1, 1, 0, 0 },
+		{ 2, 0, 1, 1, 0, 0 },
+		{ 1, 1, 0, 1, 0, 0 },
+		{ 1, 1, 1, 0, 1, 0 },
+		{ 0, 0, 0, 1, 0, 3 },
+		{ 0, 0, 0, 0, 3, 0 },
+	};
+	int failures = 0;
+	for (int a = 0; a < numDevices; a++) {
+		for (int b = 0; b < numDevices; b++) {
+			const int expected = (a < numMock && b < numMock) ? mockLinks[numMock - 1 - a][numMock - 1 - b] : 0;
+			if (topology.getLinkCount(a, b) != expected) {
+				progress.error("Device[%d] -> Device[%d] has %d links, expected %d", a, b, topology.getLinkCount(a, b), expected);
+				failures++;
+			}
+			const Topology::Rates &rates = topology.getRates();
+			const double rate = expected ? expected * rates.nvLink : rates.host;
+			failures += (a != b && topology.getRate(a, b) != rate);
+		}
+	}
+
+	// Mock devices {0, 1, 2, 3}, {3, 4} and {4, 5}
+	std::vector<std::vector<int>> cliques;
+	const int expectedCliques[][4] = { { 0, 1, -1, -1 }, { 1, 2, -1, -1 }, { 2, 3, 4, 5 } };
+	for (int c = 0; c < 3; c++) {
+		cliques.push_back(std::vector<int>());
+		for (int i = 0; i < 4 && expectedCliques[c][i] >= 0; i++) {
+			cliques.back().push_back(expectedCliques[c][i]);
+		}
+	}
+	if (topology.getCliques() != cliques) {
+		progress.error("Cliques are wrong");
+		failures++;
+	}
+
+	// The three links of mock devices 4 and 5 make the best pair, the fully connected four the best quad
+	const std::vector<int> pair = topology.getBestGroup(2);
+	const std::vector<int> quad = topology.getBestGroup(4);
+	progress.info("Best pair {%d, %d}, best quad {%d, %d, %d, %d}", pair[0], pair[1], quad[0], quad[1], quad[2], quad[3]);
+	if (pair != cliques[0] || quad != cliques[2]) {
+		progress.error("Best groups are wrong");
+		failures++;
+	}
+
+	if (failures) {
+		progress.error("%d checks failed", failures);
+		return 1;
+	}
+	return 0;
+}
+
+// The call counter of the mock NVML, read through a handle of our own on the library nvml.cpp loads.
+// The handle also keeps the library, and the count, alive between sessions
+struct MockNVMLCounter {
+	typedef long long (*GetCount)(void);
+	typedef void (*Reset)(void);
+
+	MockNVMLCounter() : handle(nullptr), getCount(nullptr), reset(nullptr) {
+#ifdef __linux__
+		const char* path = getenv("DEVMAN_NVML_LIBRARY");
+		handle = (path && path[0]) ? dlopen(path, RTLD_NOW) : nullptr;
+		if (handle) {
+			getCount = reinterpret_cast<GetCount>(dlsym(handle, "mockNvmlGetCallCount"));
+			reset = reinterpret_cast<Reset>(dlsym(handle, "mockNvmlResetCallCount"));
+		}
+#endif
+	}
+	~MockNVMLCounter() {
+#ifdef __linux__
+		if (handle) {
+			dlclose(handle);
+		}
+#endif
+	}
+	bool valid() const { return getCount && reset; }
+	long long read() const { return valid() ? getCount() : 0; }
+	void clear() { if (valid()) reset(); }
+private:
+	void* handle;
+	GetCount getCount;
+	Reset reset;
+};
+
+// NVML calls and time per topology query of the mock NVML's six devices, with every query opening NVML on its own
+// against an NVMLSession held across them. Calls are counted on a separate pass, as the counter's own handle
+// on the library would keep it from being unloaded between queries
+static int benchNvml(ProgressCallback &progress) {
+	const int numDevices = 6;
+	const int queries = 2000;
+	useMockNVML();
+
+	if (!MockNVMLCounter().valid()) {
+		progress.error("The call counter of the mock NVML is not available");
+		return 1;
+	}
+	std::vector<Device> devices = getMockDevices(numDevices, false);
+	Topology topology;
+
+	int failures = 0;
+	progress.info("%d mock devices, %d topology queries", numDevices, queries);
+	progress.info("%-16s %14s %14s", "", "calls/query", "us/query");
+	for (int held = 0; held < 2; held++) {
+		NVMLSession* session = held ? new NVMLSession() : nullptr;
+		Timer timer;
+		for (int q = 0; q < queries; q++) {
+			failures += queryTopologyWithNVML(&devices[0], numDevices, topology).error();
+		}
+		const double time = double(timer.elapsed(Timer::Precision::Nanoseconds)) * 1e-3 / queries;
+		failures += (topology.getLinkCount(4, 5) != 3);
+
+		MockNVMLCounter counter;
+		counter.clear();
+		for (int q = 0; q < queries; q++) {
+			queryTopologyWithNVML(&devices[0], numDevices, topology);
+		}
+		const double calls = double(counter.read()) / queries;
+		delete session;
+
+		progress.info("%-16s %14.1f %14.2f", held ? "session held" : "no session", calls, time);
+	}
+
+	if (failures) {
+		progress.error("%d queries failed or returned a wrong topology", failures);
+		return 1;
+	}
+	return 0;
+}
+
+// The sample the mock NVML reports for reading n. See mock/mock_nvml.cpp
+static TelemetrySample getMockSample(long long n, long long timestamp) {
+	TelemetrySample sample;
+	sample.timestamp = timestamp;
+	sample.gpuUtilization = int(n % 101);
+	sample.memoryUtilization = int(n * 7 % 101);
+	sample.memoryUsed = n << 12;
+	sample.memoryTotal = 16ll << 30;
+	sample.smClock = int(1000 + n % 1000);
+	sample.memoryClock = int(5000 + n % 1000);
+	sample.power = int(100000 + n % 100000);
+	sample.temperature = int(40 + n % 50);
+	sample.throttleReasons = n & 0xff;
+	return sample;
+}
+
+// True if every counter of the sample comes from the same reading
+static bool isWhole(const TelemetrySample &sample) {
+	const TelemetrySample expected = getMockSample(sample.memoryUsed >> 12, sample.timestamp);
+	return memcmp(&expected, &sample, sizeof(sample)) == 0;
+}
+
+// Counts samples read back torn, or older than one read before them
+struct SampleChecker {
+	SampleChecker() : latest(-1), torn(0), outOfOrder(0), reads(0) {}
+
+	void checkLatest(const TelemetrySample &sample) {
+		torn += !isWhole(sample);
+		outOfOrder += (sample.timestamp < latest);
+		latest = std::max(latest, sample.timestamp);
+		reads++;
+	}
+
+	void checkHistory(const TelemetrySample* samples, int count) {
+		for (int i = 0; i < count; i++) {
+			torn += !isWhole(samples[i]);
+			outOfOrder += (i > 0 && samples[i].timestamp <= samples[i - 1].timestamp);
+		}
+		reads++;
+	}
+
+	long long latest;
+	long long torn;
+	long long outOfOrder;
+	long long reads;
+};
+
+// A writer pushing samples into a ring as fast as it can while readers keep copying the latest one and the history
+template <int Capacity>
+static int stressSampleRing(int numReaders, long long count, ProgressCallback &progress) {
+	SampleRing<TelemetrySample, Capacity> ring;
+	std::atomic<bool> done(false);
+	std::vector<SampleChecker> checkers(numReaders);
+	std::vector<std::thread> readers;
+	for (int r = 0; r < numReaders; r++) {
+		readers.push_back(std::thread([&ring, &done, &checkers, r] {
+			TelemetrySample samples[Capacity];
+			SampleChecker &checker = checkers[r];
+			while (!done.load(std::memory_order_relaxed)) {
+				TelemetrySample sample;
+				if (ring.latest(sample)) {
+					checker.checkLatest(sample);
+				}
+				checker.checkHistory(samples, ring.history(samples, Capacity));
+			}
+		}));
+	}
+
+	Timer timer;
+	for (long long n = 0; n < count; n++) {
+		ring.push(getMockSample(n, n));
+	}
+	const double time = double(timer.elapsed(Timer::Precision::Nanoseconds)) / count;
+	done = true;
+	for (int r = 0; r < numReaders; r++) {
+		readers[r].join();
+	}
+
+	SampleChecker total;
+	for (int r = 0; r < numReaders; r++) {
+		total.torn += checkers[r].torn;
+		total.outOfOrder += checkers[r].outOfOrder;
+		total.reads += checkers[r].reads;
+	}
+	progress.info("ring of %3d: %lld pushes at %5.1fns, %lld reads by %d readers, %lld torn, %lld out of order",
+		Capacity, count, time, total.reads, numReaders, total.torn, total.outOfOrder);
+	return (total.torn || total.outOfOrder || ring.count() != (unsigned long long)count) ? 1 : 0;
+}
+
+// The seqlock rings under a writer running flat out, then the TelemetrySampler polling the mock NVML's devices
+// at its highest rate while a reader checks every sample it sees
+static int benchTelemetry(ProgressCallback &progress) {
+	const int numReaders = 2;
+	const long long pushes = 2000000;
+	const int numMock = 6;
+	const int samplingMs = 300;
+	useMockNVML();
+
+	int failures = 0;
+	progress.info("%d CPU(s)", getProcessorCount());
+	failures += stressSampleRing<4>(numReaders, pushes, progress);
+	failures += stressSampleRing<TelemetrySampler::HISTORY_SIZE>(numReaders, pushes, progress);
+
+	// An emulator without PCI bus ID goes along, it must never get samples
+	std::vector<Device> devices = getMockDevices(numMock, false);
+	devices.push_back(Device(1));
+	const int numDevices = int(devices.size());
+	TelemetrySampler sampler(&devices[0], numDevices, progress);
+	ErrorCode err = sampler.start(1);
+	if (err.error()) {
+		progress.error("Telemetry failed to start: %s", err.getError().c_str());
+		return 1;
+	}
+	std::vector<SampleChecker> checkers(numDevices);
+	std::vector<TelemetrySample> samples(TelemetrySampler::HISTORY_SIZE);
+	Timer timer;
+	while (timer.elapsed(Timer::Precision::Milliseconds) < samplingMs) {
+		for (int d = 0; d < numDevices; d++) {
+			TelemetrySample sample;
+			if (sampler.getLatest(d, sample)) {
+				checkers[d].checkLatest(sample);
+			}
+			checkers[d].checkHistory(&samples[0], sampler.getHistory(d, &samples[0], int(samples.size())));
+		}
+	}
+	sampler.stop();
+	progress.info("Sampled %d devices every 1ms for %dms:\n%s", numDevices, samplingMs, sampler.getInfo().c_str());
+
+	for (int d = 0; d < numDevices; d++) {
+		const int count = sampler.getHistory(d, &samples[0], int(samples.size()));
+		checkers[d].checkHistory(&samples[0], count);
+		if (checkers[d].torn || checkers[d].outOfOrder) {
+			progress.error("Device[%d]: %lld torn, %lld out of order samples", d, checkers[d].torn, checkers[d].outOfOrder);
+			failures++;
+		}
+		// Half the nominal rate is plenty, a loaded machine wakes the sampler late
+		const bool expected = (d < numMock);
+		if (expected ? count < samplingMs / 2 && count < int(samples.size()) : count != 0) {
+			progress.error("Device[%d] has %d samples", d, count);
+			failures++;
+		}
+	}
+
+	if (failures) {
+		progress.error("%d checks failed", failures);
+		return 1;
+	}
+	return 0;
+}
+
+int a7az0th::runBenchmark(const std::string &name, ProgressCallback &progress) {
+	if (name == "collectives") {
+		return benchCollectives(progress);
+	}
+	if (name == "replicated") {
+		return benchReplicated(progress);
+	}
+	if (name == "workers") {
+		return benchWorkers(progress);
+	}
+	if (name == "persistent") {
+		return benchPersistent(progress);
+	}
+	if (name == "loops") {
+		return benchLoops(progress);
+	}
+	if (name == "mapped") {
+		return benchMapped(progress);
+	}
+	if (name == "async") {
+		return benchAsync(progress);
+	}
+	if (name == "constants") {
+		return benchConstants(progress);
+	}
+	if (name == "growable") {
+		return benchGrowable(progress);
+	}
+	if (name == "scheduler") {
+		return benchScheduler(progress);
+	}
+	if (name == "threadman") {
+		return benchThreadman(progress);
+	}
+	if (name == "numa") {
+		return benchNuma(progress);
+	}
+	if (name == "parallel") {
+		return benchParallel(progress);
+	}
+	if (name == "submit") {
+		return benchSubmit(progress);
+	}
+	if (name == "queues") {
+		return benchQueues(progress);
+	}
+	if (name == "events") {
+		return benchEvents(progress);
+	}
+	if (name == "dispatch") {
+		return benchDispatch(progress);
+	}
+	if (name == "split") {
+		return benchSplit(progress);
+	}
+	if (name == "topology") {
+		return benchTopology(progress);
+	}
+	if (name == "nvml") {
+		return benchNvml(progress);
+	}
+	if (name == "telemetry") {
+		return benchTelemetry(progress);
+	}
+	progress.error("Unknown benchmark \"%s\". Available: async, collectives, constants, dispatch, events, growable, loops, mapped, numa, nvml, parallel, persistent, queues, replicated, scheduler, split, submit, telemetry, threadman, topology, workers", name.c_str());
+	return 1;
+}
@@ -0,0 +1,290 @@
+#include "collectives.h"
+#include "cudacheck.h"
+#include "utils.h"
+
+#include <algorithm>
+
+using namespace a7az0th;
+
+// Host version of the reduce kernel in gpu_code/collectives.cu
+static void reduceEmulated(const EmulatorContext &ctx, void** params) {
+	float* dst = *(float**)params[0];
+	const float* src = *(const float**)params[1];
+	const int n = *(int*)params[2];
+	const ReduceOp op = ReduceOp(*(int*)params[3]);
+	const int i = getGlobalID(ctx);
+	if (i < n) {
+		const float a = dst[i];
+		const float b = src[i];
+		switch (op) {
+			case ReduceOp::Sum: dst[i] = a + b; break;
+			case ReduceOp::Min: dst[i] = (b < a) ? b : a; break;
+			case ReduceOp::Max: dst[i] = (b > a) ? b : a; break;
+		}
+	}
+}
+
+Collectives::Collectives(Device* devices, int numDevices, const Topology &topology, PeerRouter &router, ProgressCallback &progress, size_t chunkSize, ThreadManager *threadman) :
+	devices(devices),
+	numDevices(numDevices),
+	router(router),
+	progress(progress),
+	threadman(threadman),
+	chunkCount(std::max(int(chunkSize / sizeof(float)), 1))
+{
+	assert(topology.getDeviceCount() == numDevices);
+	assert(router.getDeviceCount() == numDevices);
+	buildRing(topology);
+}
+
+Collectives::~Collectives() {
+	freeMem();
+}
+
+void Collectives::freeMem() {
+	for (int i = 0; i < int(slots.size()); i++) {
+		DeviceSlot &slot = slots[i];
+		devices[i].makeCurrent();
+		if (slot.launcher) {
+			slot.launcher->wait();
+		}
+		for (int k = 0; k < 2; k++) {
+			if (slot.done[k]) cuEventDestroy(slot.done[k]);
+		}
+		delete slot.scratch;
+		delete slot.kernel;
+		if (slot.module) cuModuleUnload(slot.module);
+		delete slot.launcher;
+	}
+	slots.clear();
+}
+
+void Collectives::buildRing(const Topology &topology) {
+	ring.clear();
+	if (numDevices == 0) {
+		return;
+	}
+	std::vector<char> used(numDevices, 0);
+	ring.push_back(0);
+	used[0] = 1;
+	while (int(ring.size()) < numDevices) {
+		const int last = ring.back();
+		int pick = -1;
+		double pickRate = -1.0;
+		for (int c = 0; c < numDevices; c++) {
+			if (used[c]) {
+				continue;
+			}
+			// A link is only as fast as its slower direction
+			const double rate = std::min(topology.getRate(last, c), topology.getRate(c, last));
+			if (rate > pickRate) {
+				pick = c;
+				pickRate = rate;
+			}
+		}
+		ring.push_back(pick);
+		used[pick] = 1;
+	}
+}
+
+std::vector<int> Collectives::getRingFrom(int root) const {
+	std::vector<int> order(ring);
+	std::rotate(order.begin(), std::find(order.begin(), order.end(), root), order.end());
+	return order;
+}
+
+CUresult Collectives::init(const std::string &ptxFile) {
+	freeMem();
+	CUresult err = CUDA_SUCCESS;
+
+	slots.resize(numDevices);
+	memset(&slots[0], 0, sizeof(DeviceSlot) * numDevices);
+	for (int i = 0; i < numDevices; i++) {
+		Device &device = devices[i];
+		DeviceSlot &slot = slots[i];
+		device.makeCurrent();
+
+		slot.launcher = new ThreadData(device, threadman);
+		slot.scratch = new DeviceBuffer("collectiveScratch", device.isEmulator());
+		if (slot.scratch->alloc(chunkCount * sizeof(float))) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+
+		if (device.isEmulator()) {
+			slot.kernel = new Kernel("reduce", reduceEmulated);
+			continue;
+		}
+
+		err = cuModuleLoad(&slot.module, ptxFile.c_str());
+		checkError(err);
+		slot.kernel = new Kernel("reduce", slot.module);
+		for (int k = 0; k < 2; k++) {
+			err = cuEventCreate(&slot.done[k], CU_EVENT_DISABLE_TIMING);
+			checkError(err);
+		}
+	}
+
+	std::string order;
+	for (int i = 0; i < int(ring.size()); i++) {
+		order += (i ? " -> " : "") + std::to_string(ring[i]);
+	}
+	progress.debug("Collectives: %d device(s), ring %s", numDevices, order.c_str());
+	return err;
+}
+
+CUresult Collectives::validate(const std::vector<DeviceBuffer*> &buffers, int count, int root) const {
+	if (int(slots.size()) != numDevices) {
+		return CUDA_ERROR_NOT_INITIALIZED;
+	}
+	if (int(buffers.size()) != numDevices || count < 0 || root < 0 || root >= numDevices) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+	for (int i = 0; i < numDevices; i++) {
+		if (!buffers[i] || buffers[i]->getSize() < count * sizeof(float)) {
+			return CUDA_ERROR_INVALID_VALUE;
+		}
+	}
+	return CUDA_SUCCESS;
+}
+
+CUresult Collectives::transfer(DeviceBuffer &dstBuffer, int dst, size_t dstOffset, const DeviceBuffer &srcBuffer, int src, size_t srcOffset, int count, int srcStep) {
+	const int owner = router.getStreamOwner(dst, src);
+	CUstream stream = slots[owner].launcher->getStream();
+	CUresult err = CUDA_SUCCESS;
+
+	// Emulators finish their steps before returning, so only GPU sources have to be waited for.
+	// When the copy runs on the source's own stream it is ordered after the step anyway
+	if (srcStep >= 0 && owner != src && !devices[src].isEmulator()) {
+		devices[owner].makeCurrent();
+		err = cuStreamWaitEvent(stream, slots[src].done[srcStep & 1], 0);
+		checkError(err);
+	}
+
+	err = router.copyAsync(dstBuffer, dst, dstOffset * sizeof(float), srcBuffer, src, srcOffset * sizeof(float), count * sizeof(float), stream);
+	checkError(err);
+
+	// The emulator on one end reads or writes the host memory right away, so it must not race the copy
+	if (router.getRoute(dst, src) == PeerRoute::Host) {
+		devices[owner].makeCurrent();
+		err = cuStreamSynchronize(stream);
+	}
+	return err;
+}
+
+CUresult Collectives::reduceScratch(DeviceBuffer &buffer, int device, size_t offset, int count, ReduceOp op) {
+	DeviceSlot &slot = slots[device];
+	slot.kernel->reset();
+	slot.kernel->addParamPtr(static_cast<const float*>(buffer.get()) + offset);
+	slot.kernel->addParamPtr(slot.scratch->get());
+	slot.kernel->addParamInt(count);
+	slot.kernel->addParamInt(int(op));
+
+	devices[device].makeCurrent();
+	return slot.launcher->launch(*slot.kernel, count);
+}
+
+CUresult Collectives::record(int device, int step) {
+	if (devices[device].isEmulator()) {
+		return CUDA_SUCCESS;
+	}
+	devices[device].makeCurrent();
+	return cuEventRecord(slots[device].done[step & 1], slots[device].launcher->getStream());
+}
+
+CUresult Collectives::finish() {
+	CUresult res = CUDA_SUCCESS;
+	for (int i = 0; i < numDevices; i++) {
+		devices[i].makeCurrent();
+		const CUresult err = CUresult(slots[i].launcher->wait());
+		if (res == CUDA_SUCCESS) {
+			res = err;
+		}
+	}
+	return res;
+}
+
+CUresult Collectives::broadcast(const std::vector<DeviceBuffer*> &buffers, int count, int root) {
+	CUresult err = validate(buffers, count, root);
+	checkError(err);
+
+	// A chain starting at the root. Chunk c is forwarded by device h while device h-1 already sends chunk c+1
+	const std::vector<int> order = getRingFrom(root);
+	int step = 0;
+	for (int offset = 0; offset < count; offset += chunkCount, step++) {
+		const int n = std::min(chunkCount, count - offset);
+		for (int h = 1; h < numDevices; h++) {
+			const int src = order[h - 1];
+			const int dst = order[h];
+			err = transfer(*buffers[dst], dst, offset, *buffers[src], src, offset, n, (h > 1) ? step : -1);
+			checkError(err);
+			err = record(dst, step);
+			checkError(err);
+		}
+	}
+	return finish();
+}
+
+CUresult Collectives::reduce(const std::vector<DeviceBuffer*> &buffers, int count, int root, ReduceOp op) {
+	CUresult err = validate(buffers, count, root);
+	checkError(err);
+
+	// A chain ending at the root. Every device adds its own values to the partial result of the device behind it
+	const std::vector<int> order = getRingFrom(root);
+	int step = 0;
+	for (int offset = 0; offset < count; offset += chunkCount, step++) {
+		const int n = std::min(chunkCount, count - offset);
+		for (int h = numDevices - 1; h > 0; h--) {
+			const int src = order[h];
+			const int dst = order[h - 1];
+			err = transfer(*slots[dst].scratch, dst, 0, *buffers[src], src, offset, n, (h < numDevices - 1) ? step : -1);
+			checkError(err);
+			err = reduceScratch(*buffers[dst], dst, offset, n, op);
+			checkError(err);
+			err = record(dst, step);
+			checkError(err);
+		}
+	}
+	return finish();
+}
+
+CUresult Collectives::allReduce(const std::vector<DeviceBuffer*> &buffers, int count, ReduceOp op) {
+	CUresult err = validate(buffers, count, 0);
+	checkError(err);
+
+	const int n = numDevices;
+	// Every slice is split in one segment per device, each at most a chunk large
+	const int sliceCount = chunkCount * n;
+	int step = 0;
+	for (int sliceOffset = 0; sliceOffset < count; sliceOffset += sliceCount) {
+		const int slice = std::min(sliceCount, count - sliceOffset);
+		const int segment = (slice + n - 1) / n;
+
+		// Steps 0..n-2 reduce-scatter: ring position p adds segment p-s into its successor.
+		// Afterwards position p holds the complete result of segment p+1.
+		// Steps n-1..2n-3 all-gather: the complete segments travel around the ring once more
+		for (int s = 0; s < 2 * (n - 1); s++, step++) {
+			const bool gather = (s >= n - 1);
+			for (int p = 0; p < n; p++) {
+				const int src = ring[p];
+				const int dst = ring[(p + 1) % n];
+				const int seg = gather ? (p + 1 - (s - (n - 1)) + n) % n : (p - s + n) % n;
+				const int begin = std::min(seg * segment, slice);
+				const int end = std::min(begin + segment, slice);
+				const int offset = sliceOffset + begin;
+
+				if (gather) {
+					err = transfer(*buffers[dst], dst, offset, *buffers[src], src, offset, end - begin, step - 1);
+					checkError(err);
+				} else {
+					err = transfer(*slots[dst].scratch, dst, 0, *buffers[src], src, offset, end - begin, step - 1);
+					checkError(err);
+					err = reduceScratch(*buffers[dst], dst, offset, end - begin, op);
+					checkError(err);
+				}
+				err = record(dst, step);
+				checkError(err);
+			}
+		}
+	}
+	return finish();
+}
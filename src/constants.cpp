@@ -0,0 +1,75 @@
+#include "constants.h"
+#include "cudacheck.h"
+
+#include <assert.h>
+
+using namespace a7az0th;
+
+ConstantBuffer::ConstantBuffer(const std::string &name, CUmodule module) :
+	name(name),
+	devicePtr(0),
+	hostSymbol(nullptr),
+	dirtyBegin(0),
+	dirtyEnd(0),
+	flushCount(0),
+	bytesFlushed(0)
+{
+	size_t size = 0;
+	CUresult err = CUDA_SUCCESS;
+	err = cuModuleGetGlobal(&devicePtr, &size, module, name.c_str());
+	assert(err == CUDA_SUCCESS);
+	shadow.resize(size);
+	// Start from the initial value the module gave the variable, so partial writes leave the rest of it intact
+	if (size) {
+		err = cuMemcpyDtoH(&shadow[0], devicePtr, size);
+		assert(err == CUDA_SUCCESS);
+	}
+}
+
+ConstantBuffer::ConstantBuffer(const std::string &name, void* hostSymbol, size_t size) :
+	name(name),
+	devicePtr(0),
+	hostSymbol(hostSymbol),
+	shadow(static_cast<const char*>(hostSymbol), static_cast<const char*>(hostSymbol) + size),
+	dirtyBegin(0),
+	dirtyEnd(0),
+	flushCount(0),
+	bytesFlushed(0)
+{
+	assert(hostSymbol != nullptr);
+}
+
+int ConstantBuffer::write(const void* data, size_t offset, size_t size) {
+	if (offset + size > shadow.size()) return CUDA_ERROR_INVALID_VALUE;
+	if (size == 0) return 0;
+
+	memcpy(&shadow[offset], data, size);
+	// Consecutive writes usually touch neighbouring fields, so a single range covering them all is copied
+	if (dirtyBegin == dirtyEnd) {
+		dirtyBegin = offset;
+		dirtyEnd = offset + size;
+	} else {
+		dirtyBegin = (offset < dirtyBegin) ? offset : dirtyBegin;
+		dirtyEnd = (offset + size > dirtyEnd) ? offset + size : dirtyEnd;
+	}
+	return 0;
+}
+
+int ConstantBuffer::flush(CUstream stream) {
+	if (dirtyBegin == dirtyEnd) {
+		return 0;
+	}
+	const size_t size = dirtyEnd - dirtyBegin;
+	CUresult err = CUDA_SUCCESS;
+	if (hostSymbol) {
+		memcpy(static_cast<char*>(hostSymbol) + dirtyBegin, &shadow[dirtyBegin], size);
+	} else {
+		// Pageable memory is staged by the driver before the call returns, so the host copy may change right after
+		err = cuMemcpyHtoDAsync(devicePtr + dirtyBegin, &shadow[dirtyBegin], size, stream);
+		checkError(err);
+	}
+	flushCount++;
+	bytesFlushed += size;
+	dirtyBegin = dirtyEnd = 0;
+	return 0;
+}
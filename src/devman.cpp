@@ -1,8 +1,18 @@
 #include "devman.h"
+#include "cudacheck.h"
+#include "peer.h"
+#include "streampool.h"
+#include "threadman.h"
 
 #include <assert.h>
+#include <atomic>
 #include <fstream>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 using namespace a7az0th;
 
 typedef CUresult GPUResult;
@@ -12,16 +22,51 @@ typedef CUresult GPUResult;
 // @return Empty string on failure and the file contents on success
 std::string getFileContents(const std::string& file);
 
-// Method is called when a cuda error is encountered to print information
-// error code, in what file, what line and which funtion was executed at the time of the error
 void printMessage(int error, const char* file, int line, const char* func) {
 	printf("CUDA Error %d encountered at %s[%d] in function %s\n", error, file, line, func);
 }
 
-#define checkError(err)                                       \
-if ((err) != CUDA_SUCCESS) {                                   \
-	printMessage(int(err), __FILE__, __LINE__, __FUNCTION__); \
-	return (err);                                             \
+/////////////////////////////////////////////////////////////////////////////////
+
+// Bumped whenever a context is created or destroyed. Creating one pushes it on the calling thread,
+// and a destroyed context's handle may be reused, so every thread's cached context is stale afterwards
+static std::atomic<unsigned> contextGeneration(0);
+
+// The context the thread made current last, valid while cachedGeneration matches contextGeneration
+static thread_local CUcontext cachedContext = nullptr;
+static thread_local unsigned cachedGeneration = 0;
+
+void Device::makeCurrent() const {
+	if (emulate && !context) {
+		//Pure CPU emulators have no context to make current
+		return;
+	}
+	const unsigned generation = contextGeneration.load(std::memory_order_acquire);
+	if (cachedContext == context && cachedGeneration == generation) {
+		//The context is already current. Nothing to do
+		return;
+	}
+
+	CUresult err = cuCtxSetCurrent(context);
+	assert(err == CUDA_SUCCESS);
+	cachedContext = context;
+	cachedGeneration = generation;
+}
+
+void Device::freeMem() {
+	CUresult res = CUDA_SUCCESS;
+	if (program) {
+		res = cuModuleUnload(program);
+		assert(res == CUDA_SUCCESS);
+		program = nullptr;
+	}
+	if (context) {
+		makeCurrent();
+		StreamPool::release(context);
+		res = cuCtxDestroy(context);
+		context = nullptr;
+		contextGeneration++;
+	}
 }
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -37,6 +82,10 @@ int DeviceManager::init(int emulation) {
 		return err;
 	}
 
+	emulator.setEmulation(1);
+	emulator.params.name = std::string("Emulator");
+	emulator.params.multiProcessorCount = getProcessorCount();
+
 	if (cuewInit(CUEW_INIT_CUDA) != CUEW_SUCCESS) {
 		printf("CUDA could not be initialized! Setting up the CPU as a CUDA emulation device!\n");
 		numDevices = 1;
@@ -46,6 +95,7 @@ int DeviceManager::init(int emulation) {
 		devInfo.setEmulation(1);
 		devInfo.params.devId = devIdx;
 		devInfo.params.name = std::string("Emulator");
+		devInfo.params.multiProcessorCount = getProcessorCount();
 	} else {
 
 		err = cuInit(0);
@@ -150,10 +200,12 @@ int DeviceManager::getDeviceInfo(int deviceIndex, Device &devInfo) {
 	devInfo.params.memory = bytes;
 
 	CUcontext ctx = nullptr;
-	int flags = 0;
+	// Allow mapped host memory, see DeviceBuffer::allocMapped
+	int flags = CU_CTX_MAP_HOST;
 	err = cuCtxCreate(&ctx, flags, device);
 	checkError(err);
 	devInfo.context = ctx;
+	contextGeneration++;
 
 	return err != GPU_SUCCESS;
 }
@@ -164,15 +216,42 @@ int DeviceManager::getDeviceInfo(int deviceIndex, Device &devInfo) {
 int DeviceBuffer::free() {
 	GPUResult err = GPU_SUCCESS;
 	if (buffer) {
-		if (emulate) {
+		if (mode == Mode::Alias) {
+			// The memory belongs to the caller
+		} else if (mode == Mode::Growable && emulate) {
+#ifdef __linux__
+			munmap(buffer, capacity);
+#else
+			const char* handle = static_cast<char*>(buffer);
+			delete [] handle;
+#endif
+		} else if (mode == Mode::Growable && reserved) {
+			const CUdeviceptr base = (CUdeviceptr)buffer;
+			err = cuMemUnmap(base, capacity);
+			assert(err == CUDA_SUCCESS);
+			for (size_t i = 0; i < chunks.size(); i++) {
+				cuMemRelease(chunks[i]);
+			}
+			err = cuMemAddressFree(base, reserved);
+			assert(err == CUDA_SUCCESS);
+			chunks.clear();
+			chunkSizes.clear();
+		} else if (emulate) {
 			const char* handle = static_cast<char*>(buffer);
 			delete [] handle;
+		} else if (mode == Mode::Mapped) {
+			err = cuMemFreeHost(hostBuffer);
+			assert(err == CUDA_SUCCESS);
 		} else {
 			err = cuMemFree((CUdeviceptr)buffer);
 			assert(err == CUDA_SUCCESS);
 		}
 		buffer = NULL;
+		hostBuffer = NULL;
 		size = 0;
+		capacity = 0;
+		reserved = 0;
+		mode = Mode::Device;
 	}
 	return err != GPU_SUCCESS;
 }
@@ -185,15 +264,267 @@ int DeviceBuffer::alloc(size_t size) {
 	if (size != 0) {
 		if (emulate) {
 			buffer = new char[size];
+			hostBuffer = buffer;
 		} else {
 			err = cuMemAlloc((CUdeviceptr*)&buffer, size);
 			assert(err == CUDA_SUCCESS);
 		}
 	}
 	this->size = size;
+	this->capacity = size;
+	return err != GPU_SUCCESS;
+}
+
+int DeviceBuffer::allocMapped(size_t size) {
+	if (emulate) {
+		// Emulated buffers live in host memory already
+		const int res = alloc(size);
+		mode = Mode::Mapped;
+		return res;
+	}
+	GPUResult err = GPU_SUCCESS;
+	if (buffer) {
+		free();
+	}
+	if (size != 0) {
+		err = cuMemHostAlloc(&hostBuffer, size, CU_MEMHOSTALLOC_DEVICEMAP | CU_MEMHOSTALLOC_PORTABLE);
+		checkError(err);
+		err = cuMemHostGetDevicePointer((CUdeviceptr*)&buffer, hostBuffer, 0);
+		if (err != CUDA_SUCCESS) {
+			cuMemFreeHost(hostBuffer);
+			hostBuffer = NULL;
+			checkError(err);
+		}
+	}
+	this->size = size;
+	this->capacity = size;
+	mode = Mode::Mapped;
+	return err != GPU_SUCCESS;
+}
+
+int DeviceBuffer::alias(void* host, size_t size) {
+	if (!emulate) return CUDA_ERROR_NOT_SUPPORTED;
+	if (buffer) {
+		free();
+	}
+	buffer = host;
+	hostBuffer = host;
+	this->size = size;
+	this->capacity = size;
+	mode = Mode::Alias;
+	return 0;
+}
+
+int DeviceBuffer::allocGrowable(size_t size, size_t capacity) {
+	if (buffer) {
+		free();
+	}
+	mode = Mode::Growable;
+	const int res = reserve((capacity > size) ? capacity : size);
+	if (res) {
+		return res;
+	}
+	this->size = size;
+	return 0;
+}
+
+int DeviceBuffer::allocAsync(size_t size, CUstream stream) {
+	if (buffer) {
+		freeAsync(stream);
+	}
+	if (size != 0) {
+		void* mem = NULL;
+		GPUResult err = StreamPool::get(emulate).alloc(&mem, size, &capacity, stream);
+		checkError(err);
+		buffer = mem;
+		hostBuffer = emulate ? mem : NULL;
+	}
+	this->size = size;
+	mode = Mode::Pooled;
+	return 0;
+}
+
+int DeviceBuffer::freeAsync(CUstream stream) {
+	if (!buffer || mode != Mode::Pooled) {
+		return free();
+	}
+	GPUResult err = StreamPool::get(emulate).free(buffer, capacity, stream);
+	buffer = NULL;
+	hostBuffer = NULL;
+	size = 0;
+	capacity = 0;
+	mode = Mode::Device;
 	return err != GPU_SUCCESS;
 }
 
+int DeviceBuffer::reserve(size_t capacity) {
+	if (capacity <= this->capacity) {
+		return 0;
+	}
+	if (mode == Mode::Mapped || mode == Mode::Alias) {
+		return CUDA_ERROR_NOT_SUPPORTED;
+	}
+	return (mode == Mode::Growable) ? grow(capacity) : reallocate(capacity);
+}
+
+int DeviceBuffer::resize(size_t size) {
+	if (size > capacity) {
+		// Doubling amortizes the copy of a reallocation, and the mremap or mapping call of a growable buffer
+		const size_t target = (size > 2 * capacity) ? size : 2 * capacity;
+		const int res = reserve(target);
+		if (res) {
+			return res;
+		}
+	}
+	this->size = size;
+	return 0;
+}
+
+// Bytes a buffer that reallocates at powers of two would copy to grow from capacity to newCapacity
+static size_t getDoublingCopy(size_t size, size_t capacity, size_t newCapacity) {
+	size_t doubled = 1;
+	while (doubled < capacity) {
+		doubled *= 2;
+	}
+	return (newCapacity > doubled) ? size : 0;
+}
+
+int DeviceBuffer::grow(size_t newCapacity) {
+	if (emulate) {
+#ifdef __linux__
+		const size_t page = size_t(sysconf(_SC_PAGESIZE));
+		newCapacity = (newCapacity + page - 1) / page * page;
+		// The kernel moves the page table entries when it cannot extend the mapping, the contents are never copied
+		void* mem = buffer ?
+			mremap(buffer, capacity, newCapacity, MREMAP_MAYMOVE) :
+			mmap(NULL, newCapacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+		copyBytesAvoided += getDoublingCopy(size, capacity, newCapacity);
+		buffer = mem;
+		hostBuffer = mem;
+		capacity = newCapacity;
+		return 0;
+#else
+		return reallocate(newCapacity);
+#endif
+	}
+
+	// Buffers that fell back to a plain allocation once keep doing so
+	if (buffer && !reserved) {
+		return reallocate(newCapacity);
+	}
+	const bool hasVMM = cuMemAddressReserve && cuMemAddressFree && cuMemCreate && cuMemRelease && cuMemMap && cuMemUnmap && cuMemSetAccess && cuMemGetAllocationGranularity;
+	if (!hasVMM) {
+		return reallocate(newCapacity);
+	}
+
+	CUresult err = CUDA_SUCCESS;
+	CUdevice device;
+	err = cuCtxGetDevice(&device);
+	checkError(err);
+
+	CUmemAllocationProp prop;
+	memset(&prop, 0, sizeof(prop));
+	prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+	prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+	prop.location.id = device;
+	size_t granularity = 0;
+	if (cuMemGetAllocationGranularity(&granularity, &prop, CU_MEM_ALLOC_GRANULARITY_RECOMMENDED) != CUDA_SUCCESS || !granularity) {
+		return reallocate(newCapacity);
+	}
+	newCapacity = (newCapacity + granularity - 1) / granularity * granularity;
+
+	CUmemAccessDesc access;
+	memset(&access, 0, sizeof(access));
+	access.location = prop.location;
+	access.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+
+	CUdeviceptr base = (CUdeviceptr)buffer;
+	if (newCapacity > reserved) {
+		// Out of address space. Reserve a larger range and map the same physical memory into it, nothing is copied
+		const size_t minReserve = size_t(4) * 1024 * 1024 * 1024;
+		size_t newReserved = (2 * reserved > newCapacity) ? 2 * reserved : newCapacity;
+		newReserved = (newReserved > minReserve) ? newReserved : minReserve;
+		newReserved = (newReserved + granularity - 1) / granularity * granularity;
+
+		CUdeviceptr newBase = 0;
+		err = cuMemAddressReserve(&newBase, newReserved, granularity, 0, 0);
+		checkError(err);
+		size_t offset = 0;
+		for (size_t i = 0; i < chunks.size() && err == CUDA_SUCCESS; i++) {
+			err = cuMemMap(newBase + offset, chunkSizes[i], 0, chunks[i], 0);
+			offset += chunkSizes[i];
+		}
+		if (err == CUDA_SUCCESS && capacity) {
+			err = cuMemSetAccess(newBase, capacity, &access, 1);
+		}
+		if (err != CUDA_SUCCESS) {
+			if (offset) cuMemUnmap(newBase, offset);
+			cuMemAddressFree(newBase, newReserved);
+			checkError(err);
+		}
+		if (reserved) {
+			cuMemUnmap(base, capacity);
+			cuMemAddressFree(base, reserved);
+		}
+		base = newBase;
+		buffer = (void*)base;
+		reserved = newReserved;
+	}
+
+	const size_t extra = newCapacity - capacity;
+	CUmemGenericAllocationHandle handle;
+	err = cuMemCreate(&handle, extra, &prop, 0);
+	checkError(err);
+	err = cuMemMap(base + capacity, extra, 0, handle, 0);
+	if (err != CUDA_SUCCESS) {
+		cuMemRelease(handle);
+		checkError(err);
+	}
+	chunks.push_back(handle);
+	chunkSizes.push_back(extra);
+	err = cuMemSetAccess(base + capacity, extra, &access, 1);
+	copyBytesAvoided += getDoublingCopy(size, capacity, newCapacity);
+	capacity = newCapacity;
+	checkError(err);
+	return 0;
+}
+
+int DeviceBuffer::reallocate(size_t newCapacity) {
+	void* mem = NULL;
+	CUresult err = CUDA_SUCCESS;
+	if (emulate) {
+		mem = new char[newCapacity];
+		if (size) {
+			memcpy(mem, buffer, size);
+		}
+	} else {
+		err = cuMemAlloc((CUdeviceptr*)&mem, newCapacity);
+		checkError(err);
+		if (size) {
+			err = cuMemcpyDtoD((CUdeviceptr)mem, (CUdeviceptr)buffer, size);
+			if (err != CUDA_SUCCESS) {
+				cuMemFree((CUdeviceptr)mem);
+				checkError(err);
+			}
+		}
+	}
+	copyBytes += size;
+
+	// free() forgets the size and mode, both stay the same
+	const size_t oldSize = size;
+	const Mode oldMode = mode;
+	free();
+	buffer = mem;
+	hostBuffer = emulate ? mem : NULL;
+	size = oldSize;
+	capacity = newCapacity;
+	// The new memory does not come from a pool
+	mode = (oldMode == Mode::Pooled) ? Mode::Device : oldMode;
+	return 0;
+}
 
 int DeviceBuffer::upload(void* host, size_t size) {
 	if (!buffer) return CUDA_ERROR_NOT_INITIALIZED;
@@ -203,8 +534,12 @@ int DeviceBuffer::upload(void* host, size_t size) {
 	
 	GPUResult err = GPU_SUCCESS;
 
-	if (emulate) {
-		memcpy(buffer, host, size);
+	void* hostPtr = getHostPtr();
+	if (hostPtr) {
+		// Nothing to move if the caller filled the buffer in place
+		if (hostPtr != host) {
+			memcpy(hostPtr, host, size);
+		}
 	} else {
 		err = cuMemcpyHtoD((CUdeviceptr)buffer, host, size);
 	}
@@ -219,9 +554,14 @@ int DeviceBuffer::uploadAsync(void* host, size_t size, CUstream stream) {
 	
 	GPUResult err = GPU_SUCCESS;
 
-	if (emulate) {
-		memcpy(buffer, host, size);
+	void* hostPtr = getHostPtr();
+	if (hostPtr == host) {
+		// Nothing to move if the caller filled the buffer in place
+	} else if (emulate) {
+		// Emulated launches are synchronous, nothing on the stream can still be reading the buffer
+		memcpy(hostPtr, host, size);
 	} else {
+		// Mapped memory is copied on the stream too, kernels enqueued before may still read it
 		err = cuMemcpyHtoDAsync((CUdeviceptr)buffer, host, size, stream);
 	}
 	return err != GPU_SUCCESS;
@@ -233,8 +573,11 @@ int DeviceBuffer::download(void* host) {
 	assert(host != nullptr);
 	GPUResult err = GPU_SUCCESS;
 
-	if (emulate) {
-		memcpy(host, buffer, size);
+	void* hostPtr = getHostPtr();
+	if (hostPtr) {
+		if (hostPtr != host) {
+			memcpy(host, hostPtr, size);
+		}
 	} else {
 		err = cuMemcpyDtoH(host, (CUdeviceptr)buffer, size);
 		checkError(err);
@@ -246,15 +589,32 @@ int DeviceBuffer::downloadAsync(void* host, CUstream stream) {
 	assert(host != nullptr);
 	GPUResult err = GPU_SUCCESS;
 
-	if (emulate) {
-		memcpy(host, buffer, size);
+	void* hostPtr = getHostPtr();
+	if (hostPtr == host) {
+		// The results are read in place once the stream is synchronized
+	} else if (emulate) {
+		// Emulated launches are synchronous, the kernels writing the buffer have finished
+		memcpy(host, hostPtr, size);
 	} else {
+		// Mapped memory is copied on the stream too, kernels enqueued before may still write it
 		err = cuMemcpyDtoHAsync(host, (CUdeviceptr)buffer, size, stream);
 		checkError(err);
 	}
 	return err != GPU_SUCCESS;
 }
 
+int DeviceBuffer::copyPeer(const DeviceBuffer &src, size_t size, PeerRouter &router, int dstDevice, int srcDevice) {
+	if (!buffer) return CUDA_ERROR_NOT_INITIALIZED;
+	GPUResult err = router.copy(*this, dstDevice, src, srcDevice, size);
+	return err != GPU_SUCCESS;
+}
+
+int DeviceBuffer::copyPeerAsync(const DeviceBuffer &src, size_t size, PeerRouter &router, int dstDevice, int srcDevice, CUstream stream) {
+	if (!buffer) return CUDA_ERROR_NOT_INITIALIZED;
+	GPUResult err = router.copyAsync(*this, dstDevice, src, srcDevice, size, stream);
+	return err != GPU_SUCCESS;
+}
+
 /////////////////////////////////////////////////////////////////////////////////
 
 std::string Device::getInfo() const {
@@ -350,7 +710,9 @@ GPUResult Device::setSource(const std::string& ptxFile, const CompileOptions &op
 //////////////////////////////////////////////////////////////////////////////
 
 Kernel::Kernel(const std::string &name, CUmodule program): 
+	name(name),
 	function(nullptr),
+	hostFunction(nullptr),
 	offset(0),
 	numParams(0)
 {
@@ -359,6 +721,16 @@ Kernel::Kernel(const std::string &name, CUmodule program):
 	assert(err == CUDA_SUCCESS);
 }
 
+Kernel::Kernel(const std::string &name, EmulatedKernel hostFunction):
+	name(name),
+	function(nullptr),
+	hostFunction(hostFunction),
+	offset(0),
+	numParams(0)
+{
+	assert(hostFunction != nullptr);
+}
+
 Kernel::~Kernel() {
 	//blank
 }
@@ -385,16 +757,53 @@ void Kernel::addParamInt(int i) {
 	offset += size;
 }
 
+void Kernel::addParamFloat(float f) {
+	addParam(&f, sizeof(float), alignof(float));
+}
+
+void Kernel::addParam(const void* data, int size, int alignment) {
+	offset = (offset + alignment - 1) / alignment * alignment;
+	assert(offset + size <= int(sizeof(pool)));
+	void* dest = (void*)(&pool[offset]);
+	memcpy(dest, data, size);
+
+	params[numParams] = dest;
+	numParams++;
+	offset += size;
+}
+
 void Kernel::reset() {
 	numParams = 0;
 	offset = 0;
 }
 //////////////////////////////////////////////////////////////////////////////
 
-ThreadData::ThreadData(Device& device): 
+// Runs the host implementation of a kernel once for every work item
+struct EmulatedLaunch : MultiThreadedFor {
+	EmulatedLaunch(const Kernel &kernel, void** params): kernel(kernel), params(params) {
+		// Work items are far too cheap to be handed out one at a time
+		setSchedule(Schedule::Guided, 64);
+	}
+
+	void body(int index, int threadIdx, int numThreads) override {
+		EmulatorContext ctx;
+		ctx.globalId = index;
+		kernel.hostHandle()(ctx, params);
+	}
+private:
+	const Kernel &kernel;
+	void** params;
+};
+
+ThreadData::ThreadData(Device& device, ThreadManager *threadman): 
 	device(device), 
-	stream(nullptr) 
+	stream(nullptr),
+	threadman(threadman)
 {
+	if (device.isEmulator() && !device.getContext()) {
+		// Emulated launches are synchronous. There is no stream to create
+		return;
+	}
 	CUresult err = cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING);
 	assert(err == CUDA_SUCCESS);
 }
@@ -421,6 +830,23 @@ CUresult ThreadData::launch(const Kernel& ker, const int workSize) {
 	}
 
 	CUresult err = CUDA_SUCCESS;
+
+	if (device.isEmulator()) {
+		if (!ker.hostFunction) {
+			return CUDA_ERROR_NOT_FOUND;
+		}
+		if (threadman) {
+			EmulatedLaunch job(ker, (void**)ker.params);
+			job.run(*threadman, workSize, getProcessorCount());
+		} else {
+			EmulatorContext ctx;
+			for (ctx.globalId = 0; ctx.globalId < workSize; ctx.globalId++) {
+				ker.hostFunction(ctx, (void**)ker.params);
+			}
+		}
+		return err;
+	}
+
 	const int sharedMem = 0;
 
 	const int threadsPerBlock = device.getMaxThreads();
@@ -440,6 +866,10 @@ CUresult ThreadData::launch(const Kernel& ker, const int workSize) {
 
 int ThreadData::wait() const {
 	CUresult err = CUDA_SUCCESS;
+	if (!stream) {
+		// Emulated launches have already finished
+		return err;
+	}
 	err = cuStreamSynchronize(stream);
 	assert(err == CUDA_SUCCESS);
 	return err;
@@ -0,0 +1,259 @@
+#include "dispatch.h"
+#include "threadman.h"
+#include "timer.h"
+
+#include <assert.h>
+
+using namespace a7az0th;
+
+// How quickly old measurements are forgotten. Every new sample multiplies the weight of the older ones by this
+static const double HISTORY_DECAY = 0.9;
+
+/////////////////////////////////////////////////////////////////////////////////
+
+CostModel::CostModel() :
+	priorPerItem(0.0),
+	weight(0.0),
+	sumX(0.0),
+	sumY(0.0),
+	sumXX(0.0),
+	sumXY(0.0),
+	overhead(0.0),
+	perItem(0.0),
+	samples(0),
+	priorSet(false)
+{
+	//blank
+}
+
+void CostModel::setPrior(double overhead, double perItem) {
+	this->priorPerItem = perItem;
+	this->priorSet = true;
+	if (samples == 0) {
+		this->overhead = overhead;
+		this->perItem = perItem;
+	}
+}
+
+void CostModel::addSample(int workSize, double seconds) {
+	const double x = double(workSize);
+	weight = weight * HISTORY_DECAY + 1.0;
+	sumX   = sumX   * HISTORY_DECAY + x;
+	sumY   = sumY   * HISTORY_DECAY + seconds;
+	sumXX  = sumXX  * HISTORY_DECAY + x * x;
+	sumXY  = sumXY  * HISTORY_DECAY + x * seconds;
+	samples++;
+	refit();
+}
+
+void CostModel::refit() {
+	const double meanX = sumX / weight;
+	const double meanY = sumY / weight;
+	const double varX = sumXX / weight - meanX * meanX;
+
+	if (varX > 1e-6 * (meanX * meanX + 1.0)) {
+		// Enough distinct work sizes to fit both terms
+		perItem = (sumXY / weight - meanX * meanY) / varX;
+		overhead = meanY - perItem * meanX;
+	} else {
+		// All samples have (nearly) the same size. Trust the prior for the slope
+		perItem = priorPerItem;
+		overhead = meanY - perItem * meanX;
+	}
+
+	// Neither term can be negative. Refit the other one when clamping
+	if (perItem < 0.0) {
+		perItem = 0.0;
+		overhead = meanY;
+	}
+	if (overhead < 0.0) {
+		overhead = 0.0;
+		perItem = (sumXX > 0.0) ? sumXY / sumXX : priorPerItem;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+Dispatcher::Dispatcher(DeviceManager &devman, ProgressCallback &progress, ThreadManager *threadman, const Config &config) :
+	config(config),
+	progress(progress),
+	threadman(threadman)
+{
+	candidates.push_back(&devman.getEmulator());
+	for (int i = 0; i < devman.getDeviceCount(); i++) {
+		Device &device = devman.getDevice(i);
+		if (!device.isEmulator()) {
+			candidates.push_back(&device);
+		}
+	}
+	launchers.resize(candidates.size(), nullptr);
+}
+
+Dispatcher::Dispatcher(const std::vector<Device*> &devices, ProgressCallback &progress, ThreadManager *threadman, const Config &config) :
+	config(config),
+	progress(progress),
+	threadman(threadman),
+	candidates(devices)
+{
+	assert(!candidates.empty());
+	launchers.resize(candidates.size(), nullptr);
+}
+
+Dispatcher::~Dispatcher() {
+	for (int i = 0; i < int(launchers.size()); i++) {
+		if (launchers[i]) {
+			candidates[i]->makeCurrent();
+			delete launchers[i];
+			launchers[i] = nullptr;
+		}
+	}
+}
+
+ThreadData& Dispatcher::getLauncher(int index) {
+	assert(index >= 0 && index < int(candidates.size()));
+	if (!launchers[index]) {
+		candidates[index]->makeCurrent();
+		launchers[index] = new ThreadData(*candidates[index], threadman);
+	}
+	return *launchers[index];
+}
+
+std::vector<CostModel>& Dispatcher::getModels(DeviceJob &job) {
+	std::vector<CostModel> &jobModels = models[job.getName()];
+	if (!jobModels.empty()) {
+		return jobModels;
+	}
+
+	jobModels.resize(candidates.size());
+
+	// Bytes moved per work item and per launch, assuming the sizes are linear in the work size
+	const int refCount = 1024;
+	const double fixedBytes = double(job.getUploadSize(0) + job.getDownloadSize(0));
+	const double itemBytes = (double(job.getUploadSize(refCount) + job.getDownloadSize(refCount)) - fixedBytes) / refCount;
+
+	for (int i = 0; i < int(candidates.size()); i++) {
+		const Device &device = *candidates[i];
+		double overhead = 0.0;
+		double perItem = 0.0;
+		if (i == 0) {
+			const int cores = (threadman) ? device.params.multiProcessorCount : 1;
+			const double lanes = double(cores > 0 ? cores : 1);
+			overhead = config.emulatorLatency;
+			perItem = config.cyclesPerItem / (lanes * config.cpuClockRate);
+		} else {
+			const int sms = device.params.multiProcessorCount;
+			const double lanes = double(sms > 0 ? sms : 1) * config.coresPerSM;
+			// CUDA reports the clock rate in kHz
+			const double clockRate = (device.params.clockRate > 0) ? device.params.clockRate * 1000.0 : 1e9;
+			overhead = config.launchLatency + fixedBytes / config.hostBandwidth;
+			perItem = config.cyclesPerItem / (lanes * clockRate) + itemBytes / config.hostBandwidth;
+		}
+		jobModels[i].setPrior(overhead, perItem);
+	}
+	return jobModels;
+}
+
+int Dispatcher::choose(DeviceJob &job, int workSize) {
+	const std::vector<CostModel> &jobModels = getModels(job);
+
+	int best = 0;
+	for (int i = 1; i < int(jobModels.size()); i++) {
+		if (jobModels[i].predict(workSize) < jobModels[best].predict(workSize)) {
+			best = i;
+		}
+	}
+
+	// Give devices without enough history a chance, unless they are clearly a bad fit for this size
+	const double limit = jobModels[best].predict(workSize) * config.explorationFactor;
+	int explore = -1;
+	for (int i = 0; i < int(jobModels.size()); i++) {
+		const CostModel &model = jobModels[i];
+		if (model.getSampleCount() >= config.warmupSamples || model.predict(workSize) > limit) {
+			continue;
+		}
+		if (explore == -1 || model.predict(workSize) < jobModels[explore].predict(workSize)) {
+			explore = i;
+		}
+	}
+	return (explore != -1) ? explore : best;
+}
+
+CUresult Dispatcher::run(DeviceJob &job, int workSize) {
+	if (workSize <= 0) {
+		return CUDA_SUCCESS;
+	}
+
+	const int index = choose(job, workSize);
+	std::vector<CostModel> &jobModels = getModels(job);
+	const double predicted = jobModels[index].predict(workSize);
+
+	ThreadData &launcher = getLauncher(index);
+	launcher.getDevice().makeCurrent();
+
+	Timer timer;
+	const CUresult err = job.execute(launcher, 0, workSize);
+	const double measured = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6;
+	if (err != CUDA_SUCCESS) {
+		progress.error("Dispatch %s: job failed on %s with error %d", job.getName().c_str(), candidates[index]->params.name.c_str(), int(err));
+		return err;
+	}
+
+	std::string estimates;
+	for (int i = 0; i < int(jobModels.size()); i++) {
+		char buff[128];
+		snprintf(buff, sizeof(buff), "%s%s[%d]=%.3fms", i ? " " : "", candidates[i]->params.name.c_str(), i, jobModels[i].predict(workSize) * 1e3);
+		estimates += buff;
+	}
+	progress.debug("Dispatch %s: workSize=%d predicted {%s} -> %s[%d], measured %.3fms",
+		job.getName().c_str(),
+		workSize,
+		estimates.c_str(),
+		candidates[index]->params.name.c_str(),
+		index,
+		measured * 1e3
+	);
+
+	jobModels[index].addSample(workSize, measured);
+
+	DispatchRecord record;
+	record.job = job.getName();
+	record.workSize = workSize;
+	record.device = index;
+	record.predicted = predicted;
+	record.measured = measured;
+	history.push_back(record);
+
+	return err;
+}
+
+int Dispatcher::getCrossover(const std::string &job) const {
+	std::map<std::string, std::vector<CostModel>>::const_iterator it = models.find(job);
+	if (it == models.end() || it->second.size() < 2) {
+		return -1;
+	}
+	const std::vector<CostModel> &jobModels = it->second;
+	const CostModel &cpu = jobModels[0];
+
+	// The GPU with the cheapest per item cost determines where the lines cross
+	int gpu = 1;
+	for (int i = 2; i < int(jobModels.size()); i++) {
+		if (jobModels[i].getPerItem() < jobModels[gpu].getPerItem()) {
+			gpu = i;
+		}
+	}
+
+	const double slope = cpu.getPerItem() - jobModels[gpu].getPerItem();
+	if (slope <= 0.0) {
+		return -1;
+	}
+	const double crossover = (jobModels[gpu].getOverhead() - cpu.getOverhead()) / slope;
+	return (crossover > 0.0) ? int(crossover) : 0;
+}
+
+const CostModel* Dispatcher::getModel(const std::string &job, int index) const {
+	std::map<std::string, std::vector<CostModel>>::const_iterator it = models.find(job);
+	if (it == models.end() || index < 0 || index >= int(it->second.size())) {
+		return nullptr;
+	}
+	return &it->second[index];
+}
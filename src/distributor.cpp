@@ -0,0 +1,120 @@
+#include "distributor.h"
+#include "timer.h"
+
+#include <assert.h>
+
+using namespace a7az0th;
+
+void WorkDistributor::drain(int index, DeviceJob &job, int workSize, int chunkSize) {
+	DeviceStats &stats = this->stats[index];
+	ThreadData &launcher = *launchers[index];
+
+	Timer timer;
+	while (!failed) {
+		const int offset = (nextChunk++) * chunkSize;
+		if (offset >= workSize) {
+			break;
+		}
+		const int count = (workSize - offset < chunkSize) ? workSize - offset : chunkSize;
+
+		timer.restart();
+		const CUresult err = job.execute(launcher, offset, count);
+		stats.busy += double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6;
+
+		if (err != CUDA_SUCCESS) {
+			results[index] = err;
+			failed = true;
+			break;
+		}
+		stats.chunks++;
+		stats.items += count;
+	}
+}
+
+WorkDistributor::WorkDistributor(const std::vector<Device*> &devices, ProgressCallback &progress) :
+	progress(progress),
+	devices(devices),
+	nextChunk(0),
+	failed(false),
+	wallTime(0.0)
+{
+	assert(!devices.empty());
+	launchers.resize(devices.size(), nullptr);
+	for (int i = 0; i < int(devices.size()); i++) {
+		// Emulated launches run on the worker thread itself. Several emulated devices can not share one ThreadManager
+		workers.push_back(new DeviceWorker(*devices[i]));
+		workers[i]->run([this, i] { launchers[i] = new ThreadData(*this->devices[i]); });
+	}
+	stats.resize(devices.size());
+	results.resize(devices.size(), CUDA_SUCCESS);
+}
+
+WorkDistributor::~WorkDistributor() {
+	for (int i = 0; i < int(workers.size()); i++) {
+		workers[i]->run([this, i] { delete launchers[i]; });
+		delete workers[i];
+	}
+	launchers.clear();
+	workers.clear();
+}
+
+CUresult WorkDistributor::run(DeviceJob &job, int workSize, int chunkSize) {
+	const int numDevices = int(devices.size());
+	for (int i = 0; i < numDevices; i++) {
+		stats[i] = DeviceStats();
+		results[i] = CUDA_SUCCESS;
+	}
+	wallTime = 0.0;
+	if (workSize <= 0) {
+		return CUDA_SUCCESS;
+	}
+	if (chunkSize <= 0) {
+		chunkSize = workSize;
+	}
+
+	nextChunk = 0;
+	failed = false;
+
+	Timer timer;
+	for (int i = 0; i < numDevices; i++) {
+		workers[i]->submit([this, i, &job, workSize, chunkSize] { drain(i, job, workSize, chunkSize); });
+	}
+	for (int i = 0; i < numDevices; i++) {
+		workers[i]->sync();
+	}
+	wallTime = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6;
+
+	for (int i = 0; i < numDevices; i++) {
+		if (results[i] != CUDA_SUCCESS) {
+			progress.error("Distribute %s: %s[%d] failed with error %d", job.getName().c_str(), devices[i]->params.name.c_str(), i, int(results[i]));
+			return results[i];
+		}
+	}
+	return CUDA_SUCCESS;
+}
+
+void WorkDistributor::report(const DeviceJob &job) const {
+	long long total = 0;
+	for (int i = 0; i < int(stats.size()); i++) {
+		total += stats[i].items;
+	}
+	progress.info("Distribute %s: %lld items on %d device(s) in %.3fms (%.1f Mitems/s)",
+		job.getName().c_str(),
+		total,
+		int(devices.size()),
+		wallTime * 1e3,
+		(wallTime > 0.0) ? double(total) / wallTime * 1e-6 : 0.0
+	);
+	for (int i = 0; i < int(stats.size()); i++) {
+		const DeviceStats &s = stats[i];
+		progress.info("  %s[%d]: %d chunk(s), %lld items (%.1f%%), busy %.3fms, %.1f Mitems/s",
+			devices[i]->params.name.c_str(),
+			i,
+			s.chunks,
+			s.items,
+			total ? 100.0 * double(s.items) / double(total) : 0.0,
+			s.busy * 1e3,
+			s.getThroughput() * 1e-6
+		);
+	}
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <math.h>
+#include "bench.h"
 #include "devman.h"
+#include "distributor.h"
 #include "timer.h"
 #include "progress.h"
 #include "utils.h"
@@ -7,20 +10,105 @@
 #include "threadman.h"
 
 #include "nvml.h"
+#include "topology.h"
+#include "telemetry.h"
 
 using namespace a7az0th;
 
-void resetContexts() {
-	CUcontext ctx=0;
-	do {
-		cuCtxGetCurrent(&ctx);
-		cuCtxPopCurrent(NULL);
-		cuCtxGetCurrent(&ctx);
-	} while (ctx);
+// Host version of the fill kernel in gpu_code/kernel.cu
+void fillEmulated(const EmulatorContext &ctx, void** params) {
+	float* x = *(float**)params[0];
+	const int offset = *(int*)params[1];
+	const int n = *(int*)params[2];
+	const int i = getGlobalID(ctx);
+	if (i < n) {
+		x[i] = sqrtf(float(offset + i));
+	}
 }
 
+// Fills a host buffer with the square roots of the item indices
+struct FillJob : DeviceJob {
+	FillJob(int workSize) : result(workSize, 0.f) {}
+
+	std::string getName() const override { return "fill"; }
+
+	size_t getDownloadSize(int count) const override { return count * sizeof(float); }
+
+	CUresult execute(ThreadData &launcher, int offset, int count) override {
+		Device &device = launcher.getDevice();
+		DeviceBuffer buffer("fill", device.isEmulator());
+		// Emulators write the results straight into place, which makes the download below a no-op
+		int err = device.isEmulator() ? buffer.alias(&result[offset], count * sizeof(float)) : buffer.alloc(count * sizeof(float));
+		if (err) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+
+		Kernel kernel = device.isEmulator() ? Kernel("fill", fillEmulated) : Kernel("fill", device.getProgram());
+		kernel.addParamPtr(buffer.get());
+		kernel.addParamInt(offset);
+		kernel.addParamInt(count);
+
+		CUresult res = launcher.launch(kernel, count);
+		if (res != CUDA_SUCCESS) {
+			return res;
+		}
+		launcher.wait();
+		err = buffer.download(&result[offset]);
+		return err ? CUDA_ERROR_UNKNOWN : CUDA_SUCCESS;
+	}
+
+	std::vector<float> result;
+};
+
 void launchWork(DeviceManager &devman, ThreadManager &threadman, ProgressCallback &progress) {
+	CompileOptions options;
+	options.maxThreads = 1024;
+
+	std::vector<Device*> devices;
+	int numGPUs = 0;
+	for (int i = 0; i < devman.getDeviceCount(); i++) {
+		Device &device = devman.getDevice(i);
+		if (!device.isEmulator()) {
+			device.makeCurrent();
+			if (device.setSource("kernel.ptx", options) != CUDA_SUCCESS) {
+				progress.warning("Device[%d] could not load kernel.ptx. It will not take part in the work", i);
+				continue;
+			}
+			numGPUs++;
+		}
+		devices.push_back(&device);
+	}
+
+	// Without GPUs emulate a few devices so that the work is still spread
+	const int minDevices = 4;
+	const int numEmulated = (numGPUs == 0 && int(devices.size()) < minDevices) ? minDevices - int(devices.size()) : 0;
+	std::vector<Device> emulated(numEmulated, Device(1));
+	for (int i = 0; i < numEmulated; i++) {
+		emulated[i].params.name = std::string("Emulator");
+		emulated[i].params.devId = int(devices.size());
+		devices.push_back(&emulated[i]);
+	}
+
+	const int workSize = 1 << 22;
+	const int chunkSize = 1 << 16;
+	FillJob job(workSize);
+	WorkDistributor distributor(devices, progress);
+	CUresult err = distributor.run(job, workSize, chunkSize);
+	if (err != CUDA_SUCCESS) {
+		progress.error("Work distribution failed with error %d", int(err));
+		return;
+	}
+	distributor.report(job);
 
+	int mismatches = 0;
+	for (int i = 0; i < workSize; i++) {
+		if (fabsf(job.result[i] - sqrtf(float(i))) > 1e-3f) {
+			mismatches++;
+		}
+	}
+	if (mismatches) {
+		progress.error("%d of %d results are wrong", mismatches, workSize);
+	}
 }
 
 int main(int argc, char *argv[]) {
@@ -28,6 +116,13 @@ int main(int argc, char *argv[]) {
 	ProgressCallback progress;
 	progress.setLogLevel(ProgressCallback::LogLevel::debug);
 	printVersion(progress);
+
+	if (argc > 2 && std::string(argv[1]) == "--bench") {
+		return runBenchmark(argv[2], progress);
+	}
+
+	// Keep NVML loaded while we query it
+	NVMLSession nvml;
 	std::string driverVersion;
 	ErrorCode err = getDriverVersionWithNVML(driverVersion);
 	if (err.error()) {
@@ -73,8 +168,34 @@ int main(int argc, char *argv[]) {
 			progress.info("  Device[%d] has no NVLink connections", i);
 		}
 	}
-	devman.deinit();
+
+	Topology topology;
+	err = queryTopologyWithNVML(devices, numDevices, topology);
+	if (err.error()) {
+		progress.error("%s", err.getError().c_str());
+	}
+	if (topology.queryPeerAccess(devices, numDevices) != CUDA_SUCCESS) {
+		progress.error("Failed to query peer access between devices");
+	}
+	progress.info("Device topology:\n%s", topology.getInfo().c_str());
+	if (numDevices > 1) {
+		const std::vector<int> group = topology.getBestGroup(2);
+		progress.info("Best connected device pair: Device[%d] and Device[%d]", group[0], group[1]);
+	}
+
+	TelemetrySampler telemetry(devices, numDevices, progress);
+	err = telemetry.start(100);
+	if (err.error()) {
+		progress.warning("Telemetry is not available: %s", err.getError().c_str());
+	}
 
 	launchWork(devman, threadman, progress);
+
+	if (telemetry.isRunning()) {
+		telemetry.stop();
+		progress.info("Device telemetry:\n%s", telemetry.getInfo().c_str());
+	}
+
+	devman.deinit();
 	return 0;
 }
@@ -1,6 +1,13 @@
 #include "nvml.h"
 #include "devman.h"
 #include "progress.h"
+#include "topology.h"
+#include "telemetry.h"
+#include "threadman.h"
+
+#include <stdlib.h>
+#include <vector>
+#include <map>
 
 #ifdef _WIN32
 #  define WIN32_LEAN_AND_MEAN
@@ -103,6 +110,44 @@ typedef enum nvmlNvLinkCapability_enum
     NVML_NVLINK_CAP_COUNT
 } nvmlNvLinkCapability_t;
 
+/**
+ * Utilization information for a device.
+ */
+typedef struct nvmlUtilization_st
+{
+    unsigned int gpu;                //!< Percent of time over the past sample period during which one or more kernels was executing on the GPU
+    unsigned int memory;             //!< Percent of time over the past sample period during which global (device) memory was being read or written
+} nvmlUtilization_t;
+
+/**
+ * Memory allocation information for a device.
+ */
+typedef struct nvmlMemory_st
+{
+    unsigned long long total;        //!< Total installed FB memory (in bytes)
+    unsigned long long free;         //!< Unallocated FB memory (in bytes)
+    unsigned long long used;         //!< Allocated FB memory (in bytes). Note that the driver/GPU always sets aside a small amount of memory for bookkeeping
+} nvmlMemory_t;
+
+/**
+ * Clock types.
+ */
+typedef enum nvmlClockType_enum
+{
+    NVML_CLOCK_GRAPHICS  = 0,        //!< Graphics clock domain
+    NVML_CLOCK_SM        = 1,        //!< SM clock domain
+    NVML_CLOCK_MEM       = 2,        //!< Memory clock domain
+    NVML_CLOCK_VIDEO     = 3         //!< Video encoder/decoder clock domain
+} nvmlClockType_t;
+
+/**
+ * Temperature sensors.
+ */
+typedef enum nvmlTemperatureSensors_enum
+{
+    NVML_TEMPERATURE_GPU      = 0    //!< Temperature sensor for the GPU die
+} nvmlTemperatureSensors_t;
+
 /// Typedefs for the NVML functions that we need.
 typedef nvmlReturn_t (*nvmlInit_t)(void);
 typedef nvmlReturn_t (*nvmlSystemGetDriverVersion_t)(char *version, unsigned int length);
@@ -117,6 +162,7 @@ typedef void* nvmlDevice_t;
 
 #define LOAD_SYMBOL(X) X = reinterpret_cast<X##_t>(loadSymbol(hMod, #X))
 
+typedef nvmlReturn_t (*nvmlDeviceGetCount_t)(unsigned int *deviceCount);
 typedef nvmlReturn_t (*nvmlDeviceGetHandleByIndex_t)(unsigned int index, nvmlDevice_t *device);
 typedef nvmlReturn_t (*nvmlDeviceGetPciInfo_t)(nvmlDevice_t device, nvmlPciInfo_t *pci); 
 typedef nvmlReturn_t (*nvmlDeviceGetHandleByUUID_t)(const char *uuid, nvmlDevice_t *device);
@@ -126,6 +172,22 @@ typedef nvmlReturn_t (*nvmlDeviceGetNvLinkCapability_t)(nvmlDevice_t device, uns
 typedef nvmlReturn_t (*nvmlDeviceGetNvLinkRemotePciInfo_t)(nvmlDevice_t device, unsigned int link, nvmlPciInfo_t *pci); 
 typedef nvmlReturn_t (*nvmlDeviceGetNvLinkState_t)(nvmlDevice_t device, unsigned int link, nvmlEnableState_t *isActive);
 
+/// Telemetry related. These are optional. Missing ones are reported as unsupported
+typedef nvmlReturn_t (*nvmlDeviceGetUtilizationRates_t)(nvmlDevice_t device, nvmlUtilization_t *utilization);
+typedef nvmlReturn_t (*nvmlDeviceGetMemoryInfo_t)(nvmlDevice_t device, nvmlMemory_t *memory);
+typedef nvmlReturn_t (*nvmlDeviceGetClockInfo_t)(nvmlDevice_t device, nvmlClockType_t type, unsigned int *clock);
+typedef nvmlReturn_t (*nvmlDeviceGetPowerUsage_t)(nvmlDevice_t device, unsigned int *power);
+typedef nvmlReturn_t (*nvmlDeviceGetTemperature_t)(nvmlDevice_t device, nvmlTemperatureSensors_t sensorType, unsigned int *temp);
+typedef nvmlReturn_t (*nvmlDeviceGetCurrentClocksThrottleReasons_t)(nvmlDevice_t device, unsigned long long *clocksThrottleReasons);
+
+static nvmlDeviceGetUtilizationRates_t nvmlDeviceGetUtilizationRates = nullptr;
+static nvmlDeviceGetMemoryInfo_t nvmlDeviceGetMemoryInfo = nullptr;
+static nvmlDeviceGetClockInfo_t nvmlDeviceGetClockInfo = nullptr;
+static nvmlDeviceGetPowerUsage_t nvmlDeviceGetPowerUsage = nullptr;
+static nvmlDeviceGetTemperature_t nvmlDeviceGetTemperature = nullptr;
+static nvmlDeviceGetCurrentClocksThrottleReasons_t nvmlDeviceGetCurrentClocksThrottleReasons = nullptr;
+
+static nvmlDeviceGetCount_t nvmlDeviceGetCount = nullptr;
 static nvmlDeviceGetHandleByIndex_t nvmlDeviceGetHandleByIndex = nullptr;
 static nvmlDeviceGetPciInfo_t nvmlDeviceGetPciInfo = nullptr;
 static nvmlDeviceGetHandleByUUID_t nvmlDeviceGetHandleByUUID = nullptr;
@@ -144,6 +206,7 @@ int initNVML(LibHandle &hMod) {
 		return errorCode;
 	}
 	_nvmlInitialized = true;
+	errorCode = 0;
 
 	//List of all possible locations of NVML
 #ifdef _WIN32
@@ -157,7 +220,13 @@ int initNVML(LibHandle &hMod) {
 #endif
 	const int count = COUNT_OF(nvmlPaths);
 
-	for (int i=0; i < count; i++) {
+	// Allow loading a specific NVML build instead. Used with mock libraries on hosts without GPUs
+	const char* overridePath = getenv("DEVMAN_NVML_LIBRARY");
+	if (overridePath && overridePath[0]) {
+		hMod = loadLib(overridePath);
+	}
+
+	for (int i=0; i < count && !hMod; i++) {
 		hMod = loadLib(nvmlPaths[i]);
 		if (hMod) {
 			break;
@@ -168,6 +237,8 @@ int initNVML(LibHandle &hMod) {
 		nvmlDeinitialize = reinterpret_cast<nvmlShutdown_t>(loadSymbol(hMod, "nvmlShutdown"));
 		nvmlGetDriverVersion = reinterpret_cast<nvmlSystemGetDriverVersion_t>(loadSymbol(hMod, "nvmlSystemGetDriverVersion"));
 
+		LOAD_SYMBOL(nvmlDeviceGetCount);
+
 		//NVLink related
 
 		LOAD_SYMBOL(nvmlDeviceGetHandleByIndex);
@@ -177,11 +248,21 @@ int initNVML(LibHandle &hMod) {
 		LOAD_SYMBOL(nvmlDeviceGetNvLinkCapability);
 		LOAD_SYMBOL(nvmlDeviceGetNvLinkRemotePciInfo);
 		LOAD_SYMBOL(nvmlDeviceGetNvLinkState);
+
+		//Telemetry related
+
+		LOAD_SYMBOL(nvmlDeviceGetUtilizationRates);
+		LOAD_SYMBOL(nvmlDeviceGetMemoryInfo);
+		LOAD_SYMBOL(nvmlDeviceGetClockInfo);
+		LOAD_SYMBOL(nvmlDeviceGetPowerUsage);
+		LOAD_SYMBOL(nvmlDeviceGetTemperature);
+		LOAD_SYMBOL(nvmlDeviceGetCurrentClocksThrottleReasons);
 	}
 
 	if (nullptr == nvmlInitialize ||
 		nullptr == nvmlDeinitialize ||
 		nullptr == nvmlGetDriverVersion ||
+		nullptr == nvmlDeviceGetCount ||
 		nullptr == nvmlDeviceGetHandleByIndex ||
 		nullptr == nvmlDeviceGetPciInfo ||
 		nullptr == nvmlDeviceGetHandleByUUID ||
@@ -198,12 +279,13 @@ int initNVML(LibHandle &hMod) {
 
 /// Deinitialize NVML
 int deinitNVML(LibHandle &hMod) {
-	const bool res = unloadLib(hMod);
+	const bool res = hMod ? unloadLib(hMod) : false;
 	hMod = nullptr;
 
 	nvmlInitialize = nullptr;
 	nvmlDeinitialize = nullptr;
 	nvmlGetDriverVersion = nullptr;
+	nvmlDeviceGetCount = nullptr;
 	//NVLink
 	nvmlDeviceGetHandleByIndex = nullptr;
 	nvmlDeviceGetPciInfo = nullptr;
@@ -212,42 +294,158 @@ int deinitNVML(LibHandle &hMod) {
 	nvmlDeviceGetNvLinkCapability = nullptr;
 	nvmlDeviceGetNvLinkRemotePciInfo = nullptr;
 	nvmlDeviceGetNvLinkState = nullptr;
+	//Telemetry
+	nvmlDeviceGetUtilizationRates = nullptr;
+	nvmlDeviceGetMemoryInfo = nullptr;
+	nvmlDeviceGetClockInfo = nullptr;
+	nvmlDeviceGetPowerUsage = nullptr;
+	nvmlDeviceGetTemperature = nullptr;
+	nvmlDeviceGetCurrentClocksThrottleReasons = nullptr;
 
 	_nvmlInitialized = false;
 	return res;
 }
 
-ErrorCode getDriverVersionWithNVML(std::string &driverVersion) {
-	ErrorCode error;
-	driverVersion = "(unknown)";
-	LibHandle hMod = nullptr;
-	const int res = initNVML(hMod);
-	if (res) {
-		return ErrorCode(nullptr, -1, "Failed to load NVML");
+/// Pack the PCI location of a device in a single comparable number
+static unsigned long long getPciKey(unsigned int domain, unsigned int bus, unsigned int device) {
+	return (static_cast<unsigned long long>(domain) << 32) | (bus << 8) | device;
+}
+
+static unsigned long long getPciKey(const nvmlPciInfo_t &pci) {
+	return getPciKey(pci.domain, pci.bus, pci.device);
+}
+
+/// Key that matches no device
+static const unsigned long long INVALID_PCI_KEY = ~0ull;
+
+/// Parse a "domain:bus:device.function" PCI bus ID as reported by CUDA
+static unsigned long long getPciKey(const std::string &pciBusId) {
+	unsigned int domain = 0, bus = 0, device = 0;
+	if (sscanf(pciBusId.c_str(), "%x:%x:%x", &domain, &bus, &device) != 3) {
+		return INVALID_PCI_KEY;
 	}
+	return getPciKey(domain, bus, device);
+}
 
-	nvmlReturn_t err;
-	err = nvmlInitialize();
+/// A device as enumerated by NVML
+struct NVMLDeviceEntry {
+	nvmlDevice_t handle;      //< NVML handle of the device
+	unsigned long long pciKey; //< PCI location of the device
+};
+
+/// Shared state of all NVML sessions.
+/// The library stays loaded and the device index stays valid for as long as at least one session is open
+static struct NVMLState {
+	a7az0th::Mutex lock;                          //< Guards opening and closing of sessions
+	int refCount;                                 //< Number of open sessions
+	LibHandle hMod;                               //< Handle to the loaded library
+	bool initialized;                             //< True if nvmlInit succeeded
+	ErrorCode error;                              //< The error encountered while opening the first session
+	std::vector<NVMLDeviceEntry> devices;         //< Every device known to NVML, by NVML index
+	std::map<unsigned long long, int> pciIndex;   //< PCI location to NVML index
+
+	NVMLState() : refCount(0), hMod(nullptr), initialized(false) {}
+} nvmlState;
+
+/// Open a session. Loads and initializes NVML and builds the device index on the first call
+static ErrorCode acquireNVML() {
+	a7az0th::MutexRAII guard(nvmlState.lock);
+	if (nvmlState.refCount++ > 0) {
+		return nvmlState.error;
+	}
 
-	if(err == NVML_SUCCESS) {
-		char version[256];
-		err = nvmlGetDriverVersion(version, 256);
-		if (err == NVML_SUCCESS) {
-			driverVersion = std::string(version);
-		}
-		nvmlDeinitialize();
+	nvmlState.error = ErrorCode();
+	if (initNVML(nvmlState.hMod)) {
+		nvmlState.error = ErrorCode(nullptr, -1, "Failed to load NVML");
+		return nvmlState.error;
+	}
+
+	nvmlReturn_t err = nvmlInitialize();
+	if (err == NVML_SUCCESS) {
+		nvmlState.initialized = true;
 	} else if (err == NVML_ERROR_DRIVER_NOT_LOADED) {
-		error = ErrorCode(nullptr, err, "NVidia driver is not running. Initialization failed.");
+		nvmlState.error = ErrorCode(nullptr, err, "NVidia driver is not running. Initialization failed.");
 	} else if(err == NVML_ERROR_NO_PERMISSION) {
-		error = ErrorCode(nullptr, err, "NVML does not have permission to talk to the driver.");
+		nvmlState.error = ErrorCode(nullptr, err, "NVML does not have permission to talk to the driver.");
 	} else {
-		error = ErrorCode(nullptr, err, "NVML encountered an unexpected error during initialization.");
+		nvmlState.error = ErrorCode(nullptr, err, "NVML encountered an unexpected error during initialization.");
+	}
+	if (!nvmlState.initialized) {
+		return nvmlState.error;
+	}
+
+	unsigned int count = 0;
+	if (nvmlDeviceGetCount(&count) != NVML_SUCCESS) {
+		count = 0;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		NVMLDeviceEntry entry;
+		entry.handle = nullptr;
+		entry.pciKey = INVALID_PCI_KEY;
+		if (nvmlDeviceGetHandleByIndex(i, &entry.handle) == NVML_SUCCESS) {
+			nvmlPciInfo_t pci;
+			memset(&pci, 0, sizeof(pci));
+			if (nvmlDeviceGetPciInfo(entry.handle, &pci) == NVML_SUCCESS) {
+				entry.pciKey = getPciKey(pci);
+				nvmlState.pciIndex[entry.pciKey] = int(nvmlState.devices.size());
+			}
+		}
+		nvmlState.devices.push_back(entry);
 	}
-	
-	deinitNVML(hMod);
-	return error;
+	return nvmlState.error;
 }
 
+/// Close a session. Shuts NVML down and unloads it when the last session closes
+static void releaseNVML() {
+	a7az0th::MutexRAII guard(nvmlState.lock);
+	assert(nvmlState.refCount > 0);
+	if (--nvmlState.refCount > 0) {
+		return;
+	}
+	if (nvmlState.initialized) {
+		nvmlDeinitialize();
+		nvmlState.initialized = false;
+	}
+	deinitNVML(nvmlState.hMod);
+	nvmlState.devices.clear();
+	nvmlState.pciIndex.clear();
+}
+
+/// Find the NVML handle of the device at the given PCI bus ID using the session's index. Null if there is no such device
+/// Valid only while a session is open
+static nvmlDevice_t findNvmlDevice(const std::string &pciBusId) {
+	std::map<unsigned long long, int>::const_iterator it = nvmlState.pciIndex.find(getPciKey(pciBusId));
+	if (it == nvmlState.pciIndex.end()) {
+		return nullptr;
+	}
+	return nvmlState.devices[it->second].handle;
+}
+
+NVMLSession::NVMLSession() {
+	error = acquireNVML();
+}
+
+NVMLSession::~NVMLSession() {
+	releaseNVML();
+}
+
+int NVMLSession::getDeviceCount() const {
+	return int(nvmlState.devices.size());
+}
+
+ErrorCode getDriverVersionWithNVML(std::string &driverVersion) {
+	driverVersion = "(unknown)";
+	NVMLSession session;
+	if (!session.isOpen()) {
+		return session.getError();
+	}
+
+	char version[256];
+	if (nvmlGetDriverVersion(version, 256) == NVML_SUCCESS) {
+		driverVersion = std::string(version);
+	}
+	return ErrorCode();
+}
 
 nvmlDevice_t getNvmlDeviceByUUID(char* uuid) {
 	nvmlDevice_t device = nullptr;
@@ -258,85 +456,138 @@ nvmlDevice_t getNvmlDeviceByUUID(char* uuid) {
 	return device;
 }
 
-nvmlDevice_t getNvmlDeviceByIndex(const int deviceID) {
-	nvmlDevice_t device = nullptr;
-	nvmlReturn_t result = nvmlDeviceGetHandleByIndex(deviceID, &device);
-	if (result != NVML_SUCCESS) {
-		printf("Could not get device handle for index %d\n", deviceID);
+/// Maximum number of NVLink links per device reported by NVML
+static const int NVLINK_MAX_LINKS_PER_DEVICE = 18;
+
+/// Append the index of the peer at the other end of every active NVLink link of the device.
+/// Peers are looked up in pciKeys. Links to NVSwitches, CPUs and unlisted devices are skipped
+static void getNVLinkPeers(nvmlDevice_t device, const std::vector<unsigned long long> &pciKeys, std::vector<int> &peers) {
+	for (int link = 0; link < NVLINK_MAX_LINKS_PER_DEVICE; ++link) {
+		unsigned int isSupported = 0;
+		nvmlReturn_t result = nvmlDeviceGetNvLinkCapability(device, link, NVML_NVLINK_CAP_P2P_SUPPORTED, &isSupported);
+		if (result != NVML_SUCCESS || !isSupported) {
+			continue;
+		}
+		nvmlEnableState_t isActive = NVML_FEATURE_DISABLED;
+		result = nvmlDeviceGetNvLinkState(device, link, &isActive);
+		if (result != NVML_SUCCESS || isActive != NVML_FEATURE_ENABLED) {
+			continue;
+		}
+
+		// Find the peer to which we are connected on this link
+		nvmlPciInfo_t pci;
+		memset(&pci, 0, sizeof(pci));
+		result = nvmlDeviceGetNvLinkRemotePciInfo(device, link, &pci);
+		if (result != NVML_SUCCESS) {
+			continue;
+		}
+		const unsigned long long peerKey = getPciKey(pci);
+		for (int p = 0; p < int(pciKeys.size()); p++) {
+			if (pciKeys[p] == peerKey) {
+				peers.push_back(p);
+				break;
+			}
+		}
 	}
-	return device;
 }
 
-std::string getDevicePCIID(const int deviceID) {
-	nvmlDevice_t device = getNvmlDeviceByIndex(deviceID);
-	std::string res = "";
-	if (device) {
-		nvmlPciInfo_t pciInfo;
-		memset(&pciInfo, 0, sizeof(pciInfo));
-
-		nvmlReturn_t result = nvmlDeviceGetPciInfo(device, &pciInfo);
-		if (NVML_SUCCESS == result) {
-			res = std::string(pciInfo.busIdLegacy);
+/// Return the PCI location of every device. Devices without a PCI bus ID, such as emulators, get an invalid key
+static std::vector<unsigned long long> getPciKeys(const a7az0th::Device* devices, int numDevices) {
+	std::vector<unsigned long long> pciKeys(numDevices, INVALID_PCI_KEY);
+	for (int d = 0; d < numDevices; d++) {
+		if (!devices[d].params.pciBusId.empty()) {
+			pciKeys[d] = getPciKey(devices[d].params.pciBusId);
 		}
 	}
-	return res;
+	return pciKeys;
 }
 
-
 ErrorCode queryNVLinkConnectedComponents(a7az0th::Device* devices, int numDevices) {
-
-	LibHandle hMod = nullptr;
-	const int res = initNVML(hMod);
-	if (res) {
-		return ErrorCode(nullptr, -1, "Failed to load NVML");
+	NVMLSession session;
+	if (!session.isOpen()) {
+		return session.getError();
 	}
 
-	nvmlReturn_t err;
-	err = nvmlInitialize();
-
-	/// There are total of 6 maximum NVLink islands as of Mar.2020 so we loop on all of them.
-	/// We find the link on which our current device is on
-	/// Then we loop through all the other devices and look whether any of them has the same PCI ID
-	/// Apparently this is what tells us whether they are in an NVLink connection
-	const int NVML_NVLINK_MAX_LINKS = 6;
+	const std::vector<unsigned long long> pciKeys = getPciKeys(devices, numDevices);
+	std::vector<int> peers;
 	for (int d = 0; d < numDevices; d++) {
-		bool found = false;
-		nvmlDevice_t device = getNvmlDeviceByIndex(devices[d].params.devId);
-
-		for (int link = 0; link < NVML_NVLINK_MAX_LINKS; ++link) {
-			unsigned int isSupported = 0;
-			nvmlReturn_t result = nvmlDeviceGetNvLinkCapability(device, link, NVML_NVLINK_CAP_P2P_SUPPORTED, &isSupported);
-			if (result != NVML_SUCCESS || !isSupported) {
-				continue;
-			}
-			nvmlEnableState_t isActive = NVML_FEATURE_DISABLED;
-			result = nvmlDeviceGetNvLinkState(device, link, &isActive);
-			if (result != NVML_SUCCESS || isActive != NVML_FEATURE_ENABLED) {
-				continue;
+		devices[d].params.nvLink = 0;
+		nvmlDevice_t device = findNvmlDevice(devices[d].params.pciBusId);
+		if (!device) {
+			continue;
+		}
+		peers.clear();
+		getNVLinkPeers(device, pciKeys, peers);
+		for (int i = 0; i < int(peers.size()); i++) {
+			const int deviceID = devices[peers[i]].params.devId;
+			// The bitmask can only describe the first 32 devices. Use queryTopologyWithNVML for more
+			if (deviceID >= 0 && deviceID < int(sizeof(unsigned) * 8)) {
+				devices[d].params.nvLink |= 1u << deviceID;
 			}
+		}
+	}
+	return ErrorCode();
+}
 
-			// Find the peer to which we are connected on this link
-			nvmlPciInfo_t pci;
-			memset(&pci, 0, sizeof(pci));
-			result = nvmlDeviceGetNvLinkRemotePciInfo(device, link, &pci);
-			if (result != NVML_SUCCESS) {
-				continue;
-			}
+ErrorCode queryTopologyWithNVML(a7az0th::Device* devices, int numDevices, a7az0th::Topology &topology) {
+	topology.init(numDevices);
 
-			// Loop though all devices to find the index of the peer.
-			// We search by the PCI ID returned above
-			std::string peerPciId(pci.busIdLegacy);
-			for (int i = 0; i < numDevices; i++) {
-				const int deviceID = devices[i].params.devId;
-				const std::string pci = getDevicePCIID(deviceID);
-				if (pci == peerPciId) {
-					devices[d].params.nvLink |= 1 << deviceID;
-					break;
-				}
+	NVMLSession session;
+	if (!session.isOpen()) {
+		return session.getError();
+	}
+
+	const std::vector<unsigned long long> pciKeys = getPciKeys(devices, numDevices);
+	std::vector<int> peers;
+	for (int d = 0; d < numDevices; d++) {
+		nvmlDevice_t device = findNvmlDevice(devices[d].params.pciBusId);
+		if (!device) {
+			continue;
+		}
+		peers.clear();
+		getNVLinkPeers(device, pciKeys, peers);
+		for (int i = 0; i < int(peers.size()); i++) {
+			if (peers[i] != d) {
+				topology.addLink(d, peers[i]);
 			}
 		}
 	}
+	return ErrorCode();
+}
+
+ErrorCode sampleDeviceWithNVML(const std::string &pciBusId, a7az0th::TelemetrySample &sample) {
+	sample = a7az0th::TelemetrySample();
+	nvmlDevice_t device = findNvmlDevice(pciBusId);
+	if (!device) {
+		return ErrorCode(nullptr, NVML_ERROR_NOT_FOUND, "Device not found by NVML");
+	}
 
-	deinitNVML(hMod);
+	nvmlUtilization_t utilization;
+	if (nvmlDeviceGetUtilizationRates && nvmlDeviceGetUtilizationRates(device, &utilization) == NVML_SUCCESS) {
+		sample.gpuUtilization = int(utilization.gpu);
+		sample.memoryUtilization = int(utilization.memory);
+	}
+	nvmlMemory_t memory;
+	if (nvmlDeviceGetMemoryInfo && nvmlDeviceGetMemoryInfo(device, &memory) == NVML_SUCCESS) {
+		sample.memoryUsed = static_cast<long long>(memory.used);
+		sample.memoryTotal = static_cast<long long>(memory.total);
+	}
+	unsigned int value = 0;
+	if (nvmlDeviceGetClockInfo && nvmlDeviceGetClockInfo(device, NVML_CLOCK_SM, &value) == NVML_SUCCESS) {
+		sample.smClock = int(value);
+	}
+	if (nvmlDeviceGetClockInfo && nvmlDeviceGetClockInfo(device, NVML_CLOCK_MEM, &value) == NVML_SUCCESS) {
+		sample.memoryClock = int(value);
+	}
+	if (nvmlDeviceGetPowerUsage && nvmlDeviceGetPowerUsage(device, &value) == NVML_SUCCESS) {
+		sample.power = int(value);
+	}
+	if (nvmlDeviceGetTemperature && nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, &value) == NVML_SUCCESS) {
+		sample.temperature = int(value);
+	}
+	unsigned long long reasons = 0;
+	if (nvmlDeviceGetCurrentClocksThrottleReasons && nvmlDeviceGetCurrentClocksThrottleReasons(device, &reasons) == NVML_SUCCESS) {
+		sample.throttleReasons = static_cast<long long>(reasons);
+	}
 	return ErrorCode();
 }
@@ -0,0 +1,255 @@
+#include "peer.h"
+#include "cudacheck.h"
+
+#include <assert.h>
+
+using namespace a7az0th;
+
+PeerRouter::PeerRouter(Device* devices, int numDevices, const Topology &topology, size_t chunkSize) :
+	devices(devices),
+	numDevices(numDevices),
+	chunkSize(chunkSize ? chunkSize : DEFAULT_CHUNK_SIZE)
+{
+	assert(topology.getDeviceCount() == numDevices);
+	routes.resize(numDevices * numDevices, PeerRoute::Staged);
+	peerEnabled.resize(numDevices * numDevices, 0);
+	staging.resize(numDevices * numDevices, nullptr);
+
+	for (int dst = 0; dst < numDevices; dst++) {
+		for (int src = 0; src < numDevices; src++) {
+			PeerRoute &route = routes[dst * numDevices + src];
+			const bool dstEmulated = devices[dst].isEmulator();
+			const bool srcEmulated = devices[src].isEmulator();
+			if (dstEmulated && srcEmulated) {
+				route = PeerRoute::Memcpy;
+			} else if (dstEmulated || srcEmulated) {
+				route = PeerRoute::Host;
+			} else if (dst == src || topology.getLinkCount(dst, src) > 0 || topology.canAccessPeer(dst, src)) {
+				route = PeerRoute::Direct;
+			} else {
+				route = PeerRoute::Staged;
+			}
+		}
+	}
+}
+
+PeerRouter::~PeerRouter() {
+	for (int dst = 0; dst < numDevices; dst++) {
+		for (int src = 0; src < numDevices; src++) {
+			freeStaging(dst, src);
+		}
+	}
+}
+
+PeerRoute PeerRouter::getRoute(int dst, int src) const {
+	assert(dst >= 0 && dst < numDevices && src >= 0 && src < numDevices);
+	return routes[dst * numDevices + src];
+}
+
+void PeerRouter::enablePeerAccess(int dst, int src) {
+	const int index = dst * numDevices + src;
+	if (peerEnabled[index] || dst == src) {
+		return;
+	}
+	peerEnabled[index] = 1;
+	peerEnabled[src * numDevices + dst] = 1;
+
+	CUresult err = CUDA_SUCCESS;
+	devices[dst].makeCurrent();
+	err = cuCtxEnablePeerAccess(devices[src].getContext(), 0);
+	bool ok = (err == CUDA_SUCCESS || err == CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED);
+
+	devices[src].makeCurrent();
+	err = cuCtxEnablePeerAccess(devices[dst].getContext(), 0);
+	ok = ok && (err == CUDA_SUCCESS || err == CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED);
+
+	if (!ok) {
+		// The topology promised more than the driver delivers. Go through the host instead
+		routes[index] = PeerRoute::Staged;
+		routes[src * numDevices + dst] = PeerRoute::Staged;
+	}
+}
+
+PeerRouter::Staging* PeerRouter::getStaging(int dst, int src) {
+	Staging* &stage = staging[dst * numDevices + src];
+	if (stage) {
+		return stage;
+	}
+
+	Staging* s = new Staging;
+	memset(s, 0, sizeof(Staging));
+	CUresult err = CUDA_SUCCESS;
+
+	devices[src].makeCurrent();
+	err = cuStreamCreate(&s->download, CU_STREAM_NON_BLOCKING);
+	for (int i = 0; i < 2 && err == CUDA_SUCCESS; i++) {
+		// Portable, so that both contexts can use them
+		err = cuMemHostAlloc(&s->buffers[i], chunkSize, CU_MEMHOSTALLOC_PORTABLE);
+		if (err == CUDA_SUCCESS) {
+			err = cuEventCreate(&s->downloaded[i], CU_EVENT_DISABLE_TIMING);
+		}
+	}
+
+	devices[dst].makeCurrent();
+	if (err == CUDA_SUCCESS) {
+		err = cuStreamCreate(&s->upload, CU_STREAM_NON_BLOCKING);
+	}
+	for (int i = 0; i < 2 && err == CUDA_SUCCESS; i++) {
+		err = cuEventCreate(&s->uploaded[i], CU_EVENT_DISABLE_TIMING);
+	}
+	if (err == CUDA_SUCCESS) {
+		err = cuEventCreate(&s->ready, CU_EVENT_DISABLE_TIMING);
+	}
+
+	stage = s;
+	if (err != CUDA_SUCCESS) {
+		freeStaging(dst, src);
+		return nullptr;
+	}
+	return stage;
+}
+
+void PeerRouter::freeStaging(int dst, int src) {
+	Staging* &stage = staging[dst * numDevices + src];
+	if (!stage) {
+		return;
+	}
+	devices[dst].makeCurrent();
+	for (int i = 0; i < 2; i++) {
+		if (stage->uploaded[i]) cuEventDestroy(stage->uploaded[i]);
+	}
+	if (stage->ready) cuEventDestroy(stage->ready);
+	if (stage->upload) cuStreamDestroy(stage->upload);
+
+	devices[src].makeCurrent();
+	if (stage->download) cuStreamSynchronize(stage->download);
+	for (int i = 0; i < 2; i++) {
+		if (stage->downloaded[i]) cuEventDestroy(stage->downloaded[i]);
+		if (stage->buffers[i]) cuMemFreeHost(stage->buffers[i]);
+	}
+	if (stage->download) cuStreamDestroy(stage->download);
+
+	delete stage;
+	stage = nullptr;
+}
+
+CUresult PeerRouter::copyStaged(CUdeviceptr dst, int dstDevice, CUdeviceptr src, int srcDevice, size_t size, CUstream stream) {
+	Staging* stage = getStaging(dstDevice, srcDevice);
+	if (!stage) {
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	}
+	CUresult err = CUDA_SUCCESS;
+
+	// Everything enqueued on the destination stream so far, including waits on other devices, happens before the first download
+	devices[dstDevice].makeCurrent();
+	err = cuEventRecord(stage->ready, stream);
+	checkError(err);
+	devices[srcDevice].makeCurrent();
+	err = cuStreamWaitEvent(stage->download, stage->ready, 0);
+	checkError(err);
+
+	int chunk = 0;
+	for (size_t offset = 0; offset < size; offset += chunkSize, chunk++) {
+		const size_t bytes = (size - offset < chunkSize) ? size - offset : chunkSize;
+		const int k = chunk & 1;
+
+		// Download the chunk once the previous upload from the same staging buffer is done
+		devices[srcDevice].makeCurrent();
+		if (stage->used[k]) {
+			err = cuStreamWaitEvent(stage->download, stage->uploaded[k], 0);
+			checkError(err);
+		}
+		err = cuMemcpyDtoHAsync(stage->buffers[k], src + offset, bytes, stage->download);
+		checkError(err);
+		err = cuEventRecord(stage->downloaded[k], stage->download);
+		checkError(err);
+
+		// Upload it as soon as it reached the host
+		devices[dstDevice].makeCurrent();
+		err = cuStreamWaitEvent(stream, stage->downloaded[k], 0);
+		checkError(err);
+		err = cuMemcpyHtoDAsync(dst + offset, stage->buffers[k], bytes, stream);
+		checkError(err);
+		err = cuEventRecord(stage->uploaded[k], stream);
+		checkError(err);
+		stage->used[k] = true;
+	}
+	return err;
+}
+
+int PeerRouter::getStreamOwner(int dst, int src) const {
+	return (getRoute(dst, src) == PeerRoute::Host && devices[dst].isEmulator()) ? src : dst;
+}
+
+CUresult PeerRouter::copyAsync(DeviceBuffer &dst, int dstDevice, const DeviceBuffer &src, int srcDevice, size_t size, CUstream stream) {
+	return copyAsync(dst, dstDevice, 0, src, srcDevice, 0, size, stream);
+}
+
+CUresult PeerRouter::copyAsync(DeviceBuffer &dst, int dstDevice, size_t dstOffset, const DeviceBuffer &src, int srcDevice, size_t srcOffset, size_t size, CUstream stream) {
+	assert(dstDevice >= 0 && dstDevice < numDevices && srcDevice >= 0 && srcDevice < numDevices);
+	if (dstOffset + size > dst.getSize() || srcOffset + size > src.getSize()) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+	if (size == 0) {
+		return CUDA_SUCCESS;
+	}
+
+	// Device pointers are plain addresses, so offsetting them works for both real and emulated buffers
+	void* dstPtr = static_cast<char*>(const_cast<void*>(dst.get())) + dstOffset;
+	const void* srcPtr = static_cast<const char*>(src.get()) + srcOffset;
+	CUresult err = CUDA_SUCCESS;
+
+	if (getRoute(dstDevice, srcDevice) == PeerRoute::Direct) {
+		enablePeerAccess(dstDevice, srcDevice);
+	}
+
+	switch (getRoute(dstDevice, srcDevice)) {
+		case PeerRoute::Memcpy: {
+			memcpy(dstPtr, srcPtr, size);
+			break;
+		}
+		case PeerRoute::Host: {
+			if (devices[dstDevice].isEmulator()) {
+				devices[srcDevice].makeCurrent();
+				err = cuMemcpyDtoHAsync(dstPtr, (CUdeviceptr)srcPtr, size, stream);
+			} else {
+				devices[dstDevice].makeCurrent();
+				err = cuMemcpyHtoDAsync((CUdeviceptr)dstPtr, srcPtr, size, stream);
+			}
+			break;
+		}
+		case PeerRoute::Direct: {
+			devices[dstDevice].makeCurrent();
+			err = cuMemcpyPeerAsync((CUdeviceptr)dstPtr, devices[dstDevice].getContext(), (CUdeviceptr)srcPtr, devices[srcDevice].getContext(), size, stream);
+			break;
+		}
+		case PeerRoute::Staged: {
+			err = copyStaged((CUdeviceptr)dstPtr, dstDevice, (CUdeviceptr)srcPtr, srcDevice, size, stream);
+			break;
+		}
+	}
+	return err;
+}
+
+CUresult PeerRouter::copy(DeviceBuffer &dst, int dstDevice, const DeviceBuffer &src, int srcDevice, size_t size) {
+	const PeerRoute route = getRoute(dstDevice, srcDevice);
+	if (route == PeerRoute::Memcpy) {
+		return copyAsync(dst, dstDevice, src, srcDevice, size, nullptr);
+	}
+
+	// The legacy default stream of the context doing the copy serializes with everything else on it
+	CUstream stream = nullptr;
+	if (route == PeerRoute::Staged) {
+		Staging* stage = getStaging(dstDevice, srcDevice);
+		if (!stage) {
+			return CUDA_ERROR_OUT_OF_MEMORY;
+		}
+		stream = stage->upload;
+	}
+
+	CUresult err = copyAsync(dst, dstDevice, src, srcDevice, size, stream);
+	checkError(err);
+
+	devices[getStreamOwner(dstDevice, srcDevice)].makeCurrent();
+	return (stream) ? cuStreamSynchronize(stream) : cuCtxSynchronize();
+}
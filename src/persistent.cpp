@@ -0,0 +1,203 @@
+#include "persistent.h"
+#include "cudacheck.h"
+#include "threadman.h"
+
+using namespace a7az0th;
+
+// Polls before a waiting host thread starts yielding its time slice, or an idle emulated worker blocks.
+// With a single CPU the other side can not make progress while we spin, so stop polling right away
+static const int SPIN_COUNT = (getProcessorCount() > 1) ? 4000 : 0;
+
+PersistentKernel::PersistentKernel(Device &device, ProgressCallback &progress) :
+	device(device),
+	progress(progress),
+	queue(nullptr),
+	queueDevice(0),
+	module(nullptr),
+	stream(nullptr),
+	lastTicket(0),
+	running(false),
+	published(0),
+	sleepers(0)
+{
+	for (int i = 0; i < PERSISTENT_QUEUE_SIZE; i++) {
+		finished[i] = 0;
+	}
+}
+
+PersistentKernel::~PersistentKernel() {
+	stop();
+}
+
+CUresult PersistentKernel::start(const std::string &ptxFile, int numWorkers) {
+	if (running) {
+		return CUDA_SUCCESS;
+	}
+	CUresult err = CUDA_SUCCESS;
+	lastTicket = 0;
+
+	if (device.isEmulator()) {
+		published.value = 0;
+		queue = new PersistentQueue;
+		memset(queue, 0, sizeof(PersistentQueue));
+		numWorkers = (numWorkers > 0) ? numWorkers : getProcessorCount();
+		for (int i = 0; i < numWorkers; i++) {
+			workers.push_back(std::thread(&PersistentKernel::emulate, this, i, numWorkers));
+		}
+		running = true;
+		progress.debug("Persistent kernel: %d emulated worker(s) on %s", numWorkers, device.params.name.c_str());
+		return err;
+	}
+
+	device.makeCurrent();
+	void* hostQueue = nullptr;
+	CUfunction function = nullptr;
+	err = cuMemHostAlloc(&hostQueue, sizeof(PersistentQueue), CU_MEMHOSTALLOC_DEVICEMAP | CU_MEMHOSTALLOC_PORTABLE);
+	if (err == CUDA_SUCCESS) {
+		queue = static_cast<PersistentQueue*>(hostQueue);
+		memset(queue, 0, sizeof(PersistentQueue));
+		err = cuMemHostGetDevicePointer(&queueDevice, hostQueue, 0);
+	}
+	if (err == CUDA_SUCCESS) {
+		err = cuModuleLoad(&module, ptxFile.c_str());
+	}
+	if (err == CUDA_SUCCESS) {
+		err = cuModuleGetFunction(&function, module, "persistent");
+	}
+	if (err == CUDA_SUCCESS) {
+		err = cuStreamCreate(&stream, CU_STREAM_NON_BLOCKING);
+	}
+	if (err != CUDA_SUCCESS) {
+		// stop() only frees a running kernel, so free what was created here
+		release();
+		checkError(err);
+	}
+
+	// More blocks than can be resident at once would never get scheduled and deadlock the others
+	numWorkers = (numWorkers > 0) ? numWorkers : device.params.multiProcessorCount;
+	void* params[] = { &queueDevice };
+	err = cuLaunchKernel(function, numWorkers, 1, 1, BLOCK_SIZE, 1, 1, 0, stream, params, nullptr);
+	if (err != CUDA_SUCCESS) {
+		release();
+		checkError(err);
+	}
+
+	running = true;
+	progress.debug("Persistent kernel: %d block(s) of %d on %s", numWorkers, BLOCK_SIZE, device.params.name.c_str());
+	return err;
+}
+
+CUresult PersistentKernel::stop() {
+	if (!running) {
+		return CUDA_SUCCESS;
+	}
+	PersistentTask exitTask;
+	memset(&exitTask, 0, sizeof(exitTask));
+	exitTask.type = PERSISTENT_TASK_EXIT;
+	sync();
+	wait(push(exitTask));
+	running = false;
+
+	CUresult err = CUDA_SUCCESS;
+	if (device.isEmulator()) {
+		for (int i = 0; i < int(workers.size()); i++) {
+			workers[i].join();
+		}
+		workers.clear();
+		delete queue;
+		queue = nullptr;
+		return err;
+	}
+
+	device.makeCurrent();
+	err = cuStreamSynchronize(stream);
+	release();
+	return err;
+}
+
+void PersistentKernel::release() {
+	if (stream) {
+		cuStreamDestroy(stream);
+		stream = nullptr;
+	}
+	if (module) {
+		cuModuleUnload(module);
+		module = nullptr;
+	}
+	if (queue) {
+		cuMemFreeHost(queue);
+		queue = nullptr;
+	}
+	queueDevice = 0;
+}
+
+unsigned int PersistentKernel::push(const PersistentTask &task) {
+	assert(running);
+	const unsigned int ticket = lastTicket + 1;
+	// The slot is free once the task that used it before has finished
+	if (ticket > PERSISTENT_QUEUE_SIZE) {
+		wait(ticket - PERSISTENT_QUEUE_SIZE);
+	}
+
+	PersistentSlot &slot = queue->slots[(ticket - 1) % PERSISTENT_QUEUE_SIZE];
+	slot.task = task;
+	// The descriptor must be in memory before the ticket that publishes it
+	__atomic_store_n(&slot.ticket, ticket, __ATOMIC_RELEASE);
+	lastTicket = ticket;
+
+	// Wake the emulated workers that blocked. A worker that misses the store below counted itself first
+	// and finds the ticket when it looks again
+	published.value = int(ticket);
+	if (sleepers > 0) {
+		published.wake(INT_MAX);
+	}
+	return ticket;
+}
+
+bool PersistentKernel::isDone(unsigned int ticket) const {
+	return __atomic_load_n(&queue->completed, __ATOMIC_ACQUIRE) >= ticket;
+}
+
+void PersistentKernel::wait(unsigned int ticket) const {
+	for (int spin = 0; !isDone(ticket); spin++) {
+		if (spin >= SPIN_COUNT) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void PersistentKernel::emulate(int index, int numWorkers) {
+	for (unsigned int ticket = 1; ; ticket++) {
+		const unsigned int slotIndex = (ticket - 1) % PERSISTENT_QUEUE_SIZE;
+		const PersistentSlot &slot = queue->slots[slotIndex];
+
+		for (int spin = 0; __atomic_load_n(&slot.ticket, __ATOMIC_ACQUIRE) != ticket; spin++) {
+			if (spin < SPIN_COUNT) {
+				continue;
+			}
+			// Idle. Block until push() publishes a ticket newer than the one seen here
+			sleepers++;
+			const int seen = published.value;
+			if (__atomic_load_n(&slot.ticket, __ATOMIC_ACQUIRE) != ticket) {
+				published.wait(seen);
+			}
+			sleepers--;
+		}
+		const PersistentTask task = slot.task;
+
+		if (task.type != PERSISTENT_TASK_EXIT) {
+			for (int i = index; i < task.count; i += numWorkers) {
+				runPersistentItem(task, i);
+			}
+		}
+
+		// The last worker done with the task reports it
+		if (finished[slotIndex].fetch_add(1, std::memory_order_acq_rel) == unsigned(numWorkers - 1)) {
+			finished[slotIndex].store(0, std::memory_order_relaxed);
+			__atomic_store_n(&queue->completed, ticket, __ATOMIC_RELEASE);
+		}
+		if (task.type == PERSISTENT_TASK_EXIT) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,142 @@
+#include "replicated.h"
+
+using namespace a7az0th;
+
+ReplicatedBuffer::ReplicatedBuffer(const std::string &name, Device* devices, int numDevices, const Topology &topology, PeerRouter &router) :
+	name(name),
+	devices(devices),
+	numDevices(numDevices),
+	topology(topology),
+	router(router),
+	replicas(numDevices, nullptr),
+	valid(numDevices, 0),
+	hostBytes(0),
+	peerBytes(0)
+{
+	assert(topology.getDeviceCount() == numDevices);
+	assert(router.getDeviceCount() == numDevices);
+}
+
+ReplicatedBuffer::~ReplicatedBuffer() {
+	freeReplicas();
+}
+
+void ReplicatedBuffer::freeReplicas() {
+	for (int i = 0; i < numDevices; i++) {
+		if (replicas[i]) {
+			// Buffers must be freed in the context they were allocated in
+			devices[i].makeCurrent();
+			delete replicas[i];
+			replicas[i] = nullptr;
+		}
+		valid[i] = 0;
+	}
+}
+
+int ReplicatedBuffer::write(const void* data, size_t size) {
+	MutexRAII guard(lock);
+	if (size != host.size()) {
+		// The replicas no longer fit. Freed right away, the caller has synchronized every device using them
+		freeReplicas();
+		host.resize(size);
+	}
+	if (size) {
+		memcpy(&host[0], data, size);
+	}
+	valid.assign(numDevices, 0);
+	return 0;
+}
+
+int ReplicatedBuffer::write(const void* data, size_t offset, size_t size) {
+	MutexRAII guard(lock);
+	if (offset + size > host.size()) {
+		return CUDA_ERROR_INVALID_VALUE;
+	}
+	if (size) {
+		memcpy(&host[offset], data, size);
+	}
+	valid.assign(numDevices, 0);
+	return 0;
+}
+
+int ReplicatedBuffer::findSource(int dst) const {
+	// Emulators read host memory. Nothing is faster than a plain copy from the master
+	if (devices[dst].isEmulator()) {
+		return -1;
+	}
+	int best = -1;
+	double bestRate = topology.getRates().host;
+	for (int src = 0; src < numDevices; src++) {
+		// Staged peer copies go through the host anyway, so only direct peers can beat an upload
+		if (src == dst || !valid[src] || router.getRoute(dst, src) != PeerRoute::Direct) {
+			continue;
+		}
+		const double rate = topology.getRate(dst, src);
+		if (rate > bestRate) {
+			best = src;
+			bestRate = rate;
+		}
+	}
+	return best;
+}
+
+const void* ReplicatedBuffer::get(int device) {
+	assert(device >= 0 && device < numDevices);
+	MutexRAII guard(lock);
+	if (valid[device]) {
+		return replicas[device]->get();
+	}
+	if (host.empty()) {
+		return nullptr;
+	}
+
+	devices[device].makeCurrent();
+	DeviceBuffer* &replica = replicas[device];
+	if (!replica) {
+		replica = new DeviceBuffer(name, devices[device].isEmulator());
+		if (replica->alloc(host.size())) {
+			delete replica;
+			replica = nullptr;
+			return nullptr;
+		}
+	}
+
+	const int src = findSource(device);
+	int err = 0;
+	if (src >= 0) {
+		err = replica->copyPeer(*replicas[src], host.size(), router, device, src);
+		peerBytes += err ? 0 : host.size();
+	} else {
+		err = replica->upload(&host[0], host.size());
+		hostBytes += err ? 0 : host.size();
+	}
+	if (err) {
+		return nullptr;
+	}
+	valid[device] = 1;
+	return replica->get();
+}
+
+const void* ReplicatedBuffer::get(const Device &device) {
+	for (int i = 0; i < numDevices; i++) {
+		if (&devices[i] == &device) {
+			return get(i);
+		}
+	}
+	assert(false);
+	return nullptr;
+}
+
+bool ReplicatedBuffer::isValid(int device) const {
+	MutexRAII guard(lock);
+	return valid[device] != 0;
+}
+
+int ReplicatedBuffer::getReplicaCount() const {
+	MutexRAII guard(lock);
+	int count = 0;
+	for (int i = 0; i < numDevices; i++) {
+		count += (replicas[i] != nullptr);
+	}
+	return count;
+}
@@ -0,0 +1,172 @@
+#include "split.h"
+#include "timer.h"
+
+#include <assert.h>
+#include <algorithm>
+
+using namespace a7az0th;
+
+// How much of the previous throughput estimate is kept after every run
+static const double THROUGHPUT_SMOOTHING = 0.5;
+
+// Processes the partition of every device from its own host thread
+struct SplitLauncher::PartitionLaunch : MultiThreaded {
+	PartitionLaunch(SplitLauncher &owner, DeviceJob &job) : owner(owner), job(job) {}
+
+	void threadProc(int index, int numThreads) override {
+		const Partition &part = owner.partitions[index];
+		owner.elapsed[index] = 0.0;
+		owner.results[index] = CUDA_SUCCESS;
+		if (part.count == 0) {
+			return;
+		}
+		ThreadData &launcher = *owner.launchers[index];
+		launcher.getDevice().makeCurrent();
+
+		Timer timer;
+		owner.results[index] = job.execute(launcher, part.offset, part.count);
+		owner.elapsed[index] = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6;
+	}
+private:
+	SplitLauncher &owner;
+	DeviceJob &job;
+};
+
+SplitLauncher::SplitLauncher(DeviceManager &devman, ProgressCallback &progress, ThreadManager *threadman) :
+	progress(progress)
+{
+	devices.push_back(&devman.getEmulator());
+	for (int i = 0; i < devman.getDeviceCount(); i++) {
+		Device &device = devman.getDevice(i);
+		if (!device.isEmulator()) {
+			devices.push_back(&device);
+		}
+	}
+	init(threadman);
+}
+
+SplitLauncher::SplitLauncher(const std::vector<Device*> &devices, ProgressCallback &progress, ThreadManager *threadman) :
+	progress(progress),
+	devices(devices)
+{
+	init(threadman);
+}
+
+void SplitLauncher::init(ThreadManager *threadman) {
+	assert(!devices.empty());
+	const int numDevices = int(devices.size());
+	for (int i = 0; i < numDevices; i++) {
+		devices[i]->makeCurrent();
+		// Partitions run at the same time and a ThreadManager takes a single job at a time.
+		// Only the first emulated device spreads its launches over the CPU cores, any other runs them on its host thread
+		ThreadManager *pool = (devices[i]->isEmulator()) ? threadman : nullptr;
+		if (devices[i]->isEmulator()) {
+			threadman = nullptr;
+		}
+		launchers.push_back(new ThreadData(*devices[i], pool));
+	}
+	partitions.resize(numDevices);
+	throughput.resize(numDevices, 0.0);
+	elapsed.resize(numDevices, 0.0);
+	results.resize(numDevices, CUDA_SUCCESS);
+}
+
+SplitLauncher::~SplitLauncher() {
+	for (int i = 0; i < int(launchers.size()); i++) {
+		devices[i]->makeCurrent();
+		delete launchers[i];
+	}
+	launchers.clear();
+}
+
+void SplitLauncher::partition(const Grid &grid) {
+	const int numDevices = int(devices.size());
+
+	// 2D grids are split in whole rows
+	const int granule = (grid.height > 1) ? grid.width : 1;
+	const int numGranules = (grid.height > 1) ? grid.height : grid.width;
+
+	// Devices that have not been measured yet are assumed to be as fast as the average measured one
+	double known = 0.0;
+	int numKnown = 0;
+	for (int i = 0; i < numDevices; i++) {
+		if (throughput[i] > 0.0) {
+			known += throughput[i];
+			numKnown++;
+		}
+	}
+	const double fallback = numKnown ? known / numKnown : 1.0;
+
+	std::vector<double> weights(numDevices);
+	double total = 0.0;
+	for (int i = 0; i < numDevices; i++) {
+		weights[i] = (throughput[i] > 0.0) ? throughput[i] : fallback;
+		total += weights[i];
+	}
+
+	// Every device keeps at least one granule when possible, so its throughput keeps being measured
+	const int minGranules = (numGranules >= numDevices) ? 1 : 0;
+	std::vector<int> granules(numDevices);
+	std::vector<double> remainders(numDevices);
+	int assigned = 0;
+	for (int i = 0; i < numDevices; i++) {
+		const double share = double(numGranules - minGranules * numDevices) * weights[i] / total;
+		granules[i] = minGranules + int(share);
+		remainders[i] = share - int(share);
+		assigned += granules[i];
+	}
+
+	// Hand out what is left to the largest remainders
+	while (assigned < numGranules) {
+		const int next = int(std::max_element(remainders.begin(), remainders.end()) - remainders.begin());
+		granules[next]++;
+		remainders[next] = -1.0;
+		assigned++;
+	}
+
+	int offset = 0;
+	for (int i = 0; i < numDevices; i++) {
+		partitions[i].offset = offset;
+		partitions[i].count = granules[i] * granule;
+		offset += partitions[i].count;
+	}
+	assert(offset == grid.count());
+}
+
+CUresult SplitLauncher::run(DeviceJob &job, const Grid &grid) {
+	if (grid.count() <= 0) {
+		return CUDA_SUCCESS;
+	}
+	const int numDevices = int(devices.size());
+	partition(grid);
+
+	PartitionLaunch launch(*this, job);
+	launch.run(hostThreads, numDevices);
+
+	CUresult err = CUDA_SUCCESS;
+	for (int i = 0; i < numDevices; i++) {
+		const Partition &part = partitions[i];
+		if (results[i] != CUDA_SUCCESS) {
+			progress.error("Split %s: %s failed on items [%d, %d) with error %d", job.getName().c_str(), devices[i]->params.name.c_str(), part.offset, part.offset + part.count, int(results[i]));
+			if (err == CUDA_SUCCESS) {
+				err = results[i];
+			}
+			continue;
+		}
+		if (part.count == 0 || elapsed[i] <= 0.0) {
+			continue;
+		}
+		const double measured = part.count / elapsed[i];
+		throughput[i] = (throughput[i] > 0.0) ? THROUGHPUT_SMOOTHING * throughput[i] + (1.0 - THROUGHPUT_SMOOTHING) * measured : measured;
+		progress.debug("Split %s: %s[%d] items [%d, %d) in %.3fms (%.1f Mitems/s)",
+			job.getName().c_str(),
+			devices[i]->params.name.c_str(),
+			i,
+			part.offset,
+			part.offset + part.count,
+			elapsed[i] * 1e3,
+			measured * 1e-6
+		);
+	}
+	return err;
+}
@@ -0,0 +1,202 @@
+#include "streampool.h"
+#include "cudacheck.h"
+
+using namespace a7az0th;
+
+// Requests are rounded up to this, so that buffers of slightly different sizes share blocks
+static const size_t BLOCK_ALIGNMENT = 256;
+
+// All pools created so far, one per context plus the emulator's
+static Mutex registryLock;
+static std::vector<StreamPool*> registry;
+
+StreamPool& StreamPool::get(int emulate) {
+	CUcontext context = nullptr;
+	if (!emulate) {
+		cuCtxGetCurrent(&context);
+	}
+	MutexRAII guard(registryLock);
+	for (int i = 0; i < int(registry.size()); i++) {
+		if (registry[i]->context == context && registry[i]->emulate == emulate) {
+			return *registry[i];
+		}
+	}
+	registry.push_back(new StreamPool(context, emulate));
+	return *registry.back();
+}
+
+void StreamPool::release(CUcontext context) {
+	MutexRAII guard(registryLock);
+	for (int i = 0; i < int(registry.size()); i++) {
+		if (registry[i]->context == context && !registry[i]->emulate) {
+			delete registry[i];
+			registry.erase(registry.begin() + i);
+			return;
+		}
+	}
+}
+
+StreamPool::StreamPool(CUcontext context, int emulate) :
+	context(context),
+	emulate(emulate),
+	driverPool(0),
+	allocCount(0),
+	reuseCount(0)
+{
+	if (emulate || !cuMemAllocAsync || !cuMemFreeAsync) {
+		return;
+	}
+	CUdevice device;
+	int supported = 0;
+	if (cuCtxGetDevice(&device) != CUDA_SUCCESS || cuDeviceGetAttribute(&supported, CU_DEVICE_ATTRIBUTE_MEMORY_POOLS_SUPPORTED, device) != CUDA_SUCCESS) {
+		return;
+	}
+	driverPool = supported;
+
+	// By default the driver gives unused memory back at every synchronization and has to map it again afterwards
+	CUmemoryPool pool;
+	if (driverPool && cuDeviceGetDefaultMemPool && cuMemPoolSetAttribute && cuDeviceGetDefaultMemPool(&pool, device) == CUDA_SUCCESS) {
+		unsigned long long threshold = ~0ULL;
+		cuMemPoolSetAttribute(pool, CU_MEMPOOL_ATTR_RELEASE_THRESHOLD, &threshold);
+	}
+}
+
+StreamPool::~StreamPool() {
+	for (int i = 0; i < int(blocks.size()); i++) {
+		freeBlock(blocks[i]);
+	}
+	for (int i = 0; i < int(events.size()); i++) {
+		cuEventDestroy(events[i]);
+	}
+}
+
+void StreamPool::freeBlock(const Block &block) {
+	if (emulate) {
+		const char* handle = static_cast<char*>(block.ptr);
+		delete [] handle;
+		return;
+	}
+	// Waits for the device to finish using it
+	cuMemFree((CUdeviceptr)block.ptr);
+	if (block.freed) {
+		cuEventDestroy(block.freed);
+	}
+}
+
+int StreamPool::findBlock(size_t size, CUstream stream, bool &ready) {
+	int best = -1;
+	int bestRank = -1;
+	for (int i = 0; i < int(blocks.size()); i++) {
+		const Block &block = blocks[i];
+		// A much larger block is better kept for a larger request
+		if (block.size < size || block.size > 2 * size) {
+			continue;
+		}
+		// Completed blocks are best. Next come blocks of the same stream, which runs the new work after the old anyway
+		const int rank = (emulate || cuEventQuery(block.freed) == CUDA_SUCCESS) ? 2 : (block.stream == stream) ? 1 : 0;
+		if (rank > bestRank || (rank == bestRank && block.size < blocks[best].size)) {
+			best = i;
+			bestRank = rank;
+		}
+	}
+	ready = (bestRank == 2);
+	return best;
+}
+
+CUresult StreamPool::alloc(void** ptr, size_t size, size_t* capacity, CUstream stream) {
+	MutexRAII guard(lock);
+	CUresult err = CUDA_SUCCESS;
+	size = (size + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+
+	if (driverPool) {
+		err = cuMemAllocAsync((CUdeviceptr*)ptr, size, stream);
+		checkError(err);
+		*capacity = size;
+		allocCount++;
+		return err;
+	}
+
+	bool ready = false;
+	const int index = findBlock(size, stream, ready);
+	if (index >= 0) {
+		const Block block = blocks[index];
+		blocks[index] = blocks.back();
+		blocks.pop_back();
+		if (block.freed) {
+			// The device waits, not the host. For the same stream this costs nothing and covers handles of destroyed streams being reused
+			if (!ready) {
+				err = cuStreamWaitEvent(stream, block.freed, 0);
+			}
+			events.push_back(block.freed);
+			if (err != CUDA_SUCCESS) {
+				freeBlock(Block{ block.ptr, block.size, block.stream, nullptr });
+				checkError(err);
+			}
+		}
+		*ptr = block.ptr;
+		*capacity = block.size;
+		reuseCount++;
+		return err;
+	}
+
+	if (emulate) {
+		*ptr = new char[size];
+	} else {
+		err = cuMemAlloc((CUdeviceptr*)ptr, size);
+		if (err == CUDA_ERROR_OUT_OF_MEMORY) {
+			// Cached blocks may be what is missing
+			for (int i = 0; i < int(blocks.size()); i++) {
+				freeBlock(blocks[i]);
+			}
+			blocks.clear();
+			err = cuMemAlloc((CUdeviceptr*)ptr, size);
+		}
+		checkError(err);
+	}
+	*capacity = size;
+	allocCount++;
+	return err;
+}
+
+CUresult StreamPool::free(void* ptr, size_t capacity, CUstream stream) {
+	MutexRAII guard(lock);
+	CUresult err = CUDA_SUCCESS;
+
+	if (driverPool) {
+		err = cuMemFreeAsync((CUdeviceptr)ptr, stream);
+		checkError(err);
+		return err;
+	}
+
+	Block block = { ptr, capacity, stream, nullptr };
+	if (!emulate) {
+		if (events.empty()) {
+			err = cuEventCreate(&block.freed, CU_EVENT_DISABLE_TIMING);
+		} else {
+			block.freed = events.back();
+			events.pop_back();
+		}
+		if (err == CUDA_SUCCESS) {
+			err = cuEventRecord(block.freed, stream);
+		}
+		if (err != CUDA_SUCCESS) {
+			freeBlock(block);
+			checkError(err);
+		}
+	}
+	blocks.push_back(block);
+	return err;
+}
+
+void StreamPool::trim() {
+	MutexRAII guard(lock);
+	for (int i = 0; i < int(blocks.size());) {
+		if (emulate || cuEventQuery(blocks[i].freed) == CUDA_SUCCESS) {
+			freeBlock(blocks[i]);
+			blocks[i] = blocks.back();
+			blocks.pop_back();
+		} else {
+			i++;
+		}
+	}
+}
@@ -0,0 +1,118 @@
+#include "telemetry.h"
+
+#include <chrono>
+
+using namespace a7az0th;
+
+TelemetrySampler::TelemetrySampler(const Device* devices, int numDevices, ProgressCallback &progress) :
+	progress(progress),
+	session(nullptr),
+	running(false),
+	intervalMs(0),
+	stopRequested(false)
+{
+	for (int i = 0; i < numDevices; i++) {
+		pciBusIds.push_back(devices[i].params.pciBusId);
+		rings.push_back(new Ring());
+	}
+}
+
+TelemetrySampler::~TelemetrySampler() {
+	stop();
+	for (int i = 0; i < int(rings.size()); i++) {
+		delete rings[i];
+	}
+	rings.clear();
+}
+
+ErrorCode TelemetrySampler::start(int intervalMs) {
+	if (running) {
+		return ErrorCode();
+	}
+	session = new NVMLSession();
+	if (!session->isOpen()) {
+		ErrorCode err = session->getError();
+		delete session;
+		session = nullptr;
+		return err;
+	}
+
+	this->intervalMs = (intervalMs > 0) ? intervalMs : 1;
+	stopRequested = false;
+	running = true;
+	thread = std::thread(&TelemetrySampler::threadProc, this);
+	progress.debug("Telemetry: sampling %d device(s) every %dms", int(rings.size()), this->intervalMs);
+	return ErrorCode();
+}
+
+void TelemetrySampler::stop() {
+	if (!running) {
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lk(stopMutex);
+		stopRequested = true;
+	}
+	stopSignal.notify_all();
+	thread.join();
+	running = false;
+
+	delete session;
+	session = nullptr;
+}
+
+void TelemetrySampler::threadProc() {
+	const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point nextSample = startTime;
+
+	for (;;) {
+		for (int i = 0; i < int(rings.size()); i++) {
+			if (pciBusIds[i].empty()) {
+				continue;
+			}
+			TelemetrySample sample;
+			if (sampleDeviceWithNVML(pciBusIds[i], sample).error()) {
+				continue;
+			}
+			sample.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+			rings[i]->push(sample);
+		}
+
+		// Keep a steady rate regardless of how long the queries took
+		nextSample += std::chrono::milliseconds(intervalMs);
+		std::unique_lock<std::mutex> lk(stopMutex);
+		if (stopSignal.wait_until(lk, nextSample, [this] { return stopRequested; })) {
+			break;
+		}
+	}
+}
+
+std::string TelemetrySampler::getInfo() const {
+	std::string message;
+	const int buffSize = 256;
+	char buff[buffSize];
+	for (int i = 0; i < int(rings.size()); i++) {
+		TelemetrySample s;
+		if (!getLatest(i, s)) {
+			snprintf(buff, buffSize, "Device[%d] : no samples\n", i);
+		} else {
+			char throttle[32] = "n/a";
+			if (s.throttleReasons >= 0) {
+				snprintf(throttle, sizeof(throttle), "0x%llx", static_cast<unsigned long long>(s.throttleReasons));
+			}
+			snprintf(buff, buffSize, "Device[%d] : GPU:%3d%% | Mem:%3d%% | Used:%.1fGB | SM:%dMHz | MemClk:%dMHz | Power:%.1fW | Temp:%dC | Throttle:%s\n",
+				i,
+				s.gpuUtilization,
+				s.memoryUtilization,
+				double(s.memoryUsed) / double(1024 * 1024 * 1024),
+				s.smClock,
+				s.memoryClock,
+				double(s.power) * 1e-3,
+				s.temperature,
+				throttle
+			);
+		}
+		message += buff;
+	}
+	return message;
+}
@@ -0,0 +1,277 @@
+#include "topology.h"
+#include "timer.h"
+
+#include <assert.h>
+#include <algorithm>
+
+using namespace a7az0th;
+
+void Topology::init(int numDevices) {
+	this->numDevices = numDevices;
+	links.assign(numDevices * numDevices, 0);
+	peerAccess.assign(numDevices * numDevices, 0);
+	bandwidth.assign(numDevices * numDevices, 0.0);
+}
+
+void Topology::addLink(int a, int b) {
+	assert(a >= 0 && a < numDevices && b >= 0 && b < numDevices);
+	links[a * numDevices + b]++;
+}
+
+int Topology::getLinkCount(int a, int b) const {
+	assert(a >= 0 && a < numDevices && b >= 0 && b < numDevices);
+	return links[a * numDevices + b];
+}
+
+void Topology::setPeerAccess(int a, int b, bool canAccess) {
+	assert(a >= 0 && a < numDevices && b >= 0 && b < numDevices);
+	peerAccess[a * numDevices + b] = canAccess;
+}
+
+bool Topology::canAccessPeer(int a, int b) const {
+	assert(a >= 0 && a < numDevices && b >= 0 && b < numDevices);
+	return peerAccess[a * numDevices + b] != 0;
+}
+
+void Topology::setBandwidth(int a, int b, double bytesPerSecond) {
+	assert(a >= 0 && a < numDevices && b >= 0 && b < numDevices);
+	bandwidth[a * numDevices + b] = bytesPerSecond;
+}
+
+double Topology::getBandwidth(int a, int b) const {
+	assert(a >= 0 && a < numDevices && b >= 0 && b < numDevices);
+	return bandwidth[a * numDevices + b];
+}
+
+double Topology::getRate(int a, int b) const {
+	const double measured = getBandwidth(a, b);
+	if (measured > 0.0) {
+		return measured;
+	}
+	const int numLinks = getLinkCount(a, b);
+	if (numLinks > 0) {
+		return numLinks * rates.nvLink;
+	}
+	return canAccessPeer(a, b) ? rates.pcieP2P : rates.host;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Bron-Kerbosch. Device counts are small enough to not bother with pivoting
+void Topology::cliques(std::vector<int> &current, std::vector<int> candidates, std::vector<int> excluded, std::vector<std::vector<int>> &result) const {
+	if (candidates.empty() && excluded.empty()) {
+		if (current.size() >= 2) {
+			result.push_back(current);
+		}
+		return;
+	}
+	while (!candidates.empty()) {
+		const int v = candidates.back();
+		candidates.pop_back();
+
+		std::vector<int> nextCandidates;
+		for (int i = 0; i < int(candidates.size()); i++) {
+			if (connected(v, candidates[i])) {
+				nextCandidates.push_back(candidates[i]);
+			}
+		}
+		std::vector<int> nextExcluded;
+		for (int i = 0; i < int(excluded.size()); i++) {
+			if (connected(v, excluded[i])) {
+				nextExcluded.push_back(excluded[i]);
+			}
+		}
+
+		current.push_back(v);
+		cliques(current, nextCandidates, nextExcluded, result);
+		current.pop_back();
+
+		excluded.push_back(v);
+	}
+}
+
+std::vector<std::vector<int>> Topology::getCliques() const {
+	std::vector<std::vector<int>> result;
+	std::vector<int> current;
+	std::vector<int> candidates;
+	for (int i = numDevices - 1; i >= 0; i--) {
+		candidates.push_back(i);
+	}
+	cliques(current, candidates, std::vector<int>(), result);
+
+	for (int i = 0; i < int(result.size()); i++) {
+		std::sort(result[i].begin(), result[i].end());
+	}
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+std::vector<int> Topology::getBestGroup(int k) const {
+	std::vector<int> best;
+	if (k <= 0) {
+		return best;
+	}
+	if (k >= numDevices) {
+		for (int i = 0; i < numDevices; i++) {
+			best.push_back(i);
+		}
+		return best;
+	}
+
+	// Grow a group greedily from every device and keep the best one
+	double bestMin = -1.0;
+	double bestSum = -1.0;
+	for (int start = 0; start < numDevices; start++) {
+		std::vector<int> group(1, start);
+		std::vector<char> used(numDevices, 0);
+		used[start] = 1;
+		double groupMin = 1e300;
+		double groupSum = 0.0;
+
+		while (int(group.size()) < k) {
+			int pick = -1;
+			double pickMin = -1.0;
+			double pickSum = -1.0;
+			for (int c = 0; c < numDevices; c++) {
+				if (used[c]) {
+					continue;
+				}
+				double cMin = 1e300;
+				double cSum = 0.0;
+				for (int g = 0; g < int(group.size()); g++) {
+					const double rate = std::min(getRate(c, group[g]), getRate(group[g], c));
+					cMin = std::min(cMin, rate);
+					cSum += rate;
+				}
+				if (cMin > pickMin || (cMin == pickMin && cSum > pickSum)) {
+					pick = c;
+					pickMin = cMin;
+					pickSum = cSum;
+				}
+			}
+			group.push_back(pick);
+			used[pick] = 1;
+			groupMin = std::min(groupMin, pickMin);
+			groupSum += pickSum;
+		}
+
+		if (groupMin > bestMin || (groupMin == bestMin && groupSum > bestSum)) {
+			best = group;
+			bestMin = groupMin;
+			bestSum = groupSum;
+		}
+	}
+	std::sort(best.begin(), best.end());
+	return best;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+CUresult Topology::queryPeerAccess(Device* devices, int numDevices) {
+	assert(numDevices == this->numDevices);
+	CUresult err = CUDA_SUCCESS;
+	for (int a = 0; a < numDevices; a++) {
+		for (int b = 0; b < numDevices; b++) {
+			if (a == b || devices[a].isEmulator() || devices[b].isEmulator()) {
+				setPeerAccess(a, b, false);
+				continue;
+			}
+			int canAccess = 0;
+			err = cuDeviceCanAccessPeer(&canAccess, devices[a].getHandle(), devices[b].getHandle());
+			if (err != CUDA_SUCCESS) {
+				return err;
+			}
+			setPeerAccess(a, b, canAccess != 0);
+		}
+	}
+	return err;
+}
+
+CUresult Topology::measurePeerBandwidth(Device* devices, int numDevices, size_t bytes) {
+	assert(numDevices == this->numDevices);
+	const int repetitions = 4;
+	CUresult err = CUDA_SUCCESS;
+	for (int a = 0; a < numDevices; a++) {
+		for (int b = 0; b < numDevices; b++) {
+			// Copies between a GPU and an emulator go through the host. That is not a peer copy
+			if (a == b || devices[a].isEmulator() != devices[b].isEmulator()) {
+				continue;
+			}
+			const bool emulate = devices[a].isEmulator();
+
+			DeviceBuffer src("bandwidthSrc", emulate);
+			DeviceBuffer dst("bandwidthDst", emulate);
+			devices[a].makeCurrent();
+			if (src.alloc(bytes)) {
+				return CUDA_ERROR_OUT_OF_MEMORY;
+			}
+			devices[b].makeCurrent();
+			if (dst.alloc(bytes)) {
+				return CUDA_ERROR_OUT_OF_MEMORY;
+			}
+
+			Timer timer;
+			for (int r = 0; r < repetitions; r++) {
+				if (emulate) {
+					memcpy(const_cast<void*>(dst.get()), src.get(), bytes);
+				} else {
+					err = cuMemcpyPeer((CUdeviceptr)dst.get(), devices[b].getContext(), (CUdeviceptr)src.get(), devices[a].getContext(), bytes);
+					if (err != CUDA_SUCCESS) {
+						return err;
+					}
+				}
+			}
+			if (!emulate) {
+				err = cuCtxSynchronize();
+				if (err != CUDA_SUCCESS) {
+					return err;
+				}
+			}
+			const double seconds = double(timer.elapsed(Timer::Precision::Microseconds)) * 1e-6;
+			if (seconds > 0.0) {
+				setBandwidth(a, b, double(bytes) * repetitions / seconds);
+			}
+
+			// Buffers must be freed in the context they were allocated in
+			devices[b].makeCurrent();
+			dst.free();
+			devices[a].makeCurrent();
+			src.free();
+		}
+	}
+	return err;
+}
+
+std::string Topology::getInfo() const {
+	std::string message;
+	const int buffSize = 256;
+	char buff[buffSize];
+
+	for (int a = 0; a < numDevices; a++) {
+		for (int b = 0; b < numDevices; b++) {
+			if (a == b) {
+				continue;
+			}
+			const int numLinks = getLinkCount(a, b);
+			const double measured = getBandwidth(a, b);
+			if (!numLinks && !canAccessPeer(a, b) && measured <= 0.0) {
+				continue;
+			}
+			snprintf(buff, buffSize, "Device[%d] -> Device[%d] : NVLink x%d | P2P:%d | Bandwidth: %.1f GB/s%s\n",
+				a, b, numLinks, int(canAccessPeer(a, b)), getRate(a, b) * 1e-9, measured > 0.0 ? "" : " (estimated)");
+			message += buff;
+		}
+	}
+
+	const std::vector<std::vector<int>> groups = getCliques();
+	for (int i = 0; i < int(groups.size()); i++) {
+		std::string members;
+		for (int j = 0; j < int(groups[i].size()); j++) {
+			snprintf(buff, buffSize, "%s%d", j ? ", " : "", groups[i][j]);
+			members += buff;
+		}
+		snprintf(buff, buffSize, "NVLink clique %d : {%s}\n", i, members.c_str());
+		message += buff;
+	}
+	return message;
+}
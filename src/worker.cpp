@@ -0,0 +1,118 @@
+#include "worker.h"
+
+using namespace a7az0th;
+
+DeviceWorker::DeviceWorker(Device &device) :
+	device(device),
+	head(nullptr),
+	tail(new Node()),
+	submitted(0),
+	completed(0),
+	sleeping(false),
+	waiters(0),
+	stopRequested(false)
+{
+	head = tail;
+	thread = std::thread(&DeviceWorker::threadProc, this);
+}
+
+DeviceWorker::~DeviceWorker() {
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		stopRequested = true;
+	}
+	wake.notify_one();
+	thread.join();
+	delete tail;
+}
+
+void DeviceWorker::submit(Task task) {
+	Node* node = new Node();
+	node->task = std::move(task);
+	submitted++;
+
+	// Publish the node. The worker sees it once the previous head links to it.
+	// The link and the sleeping flag are sequentially consistent, so either we see the worker asleep or it sees the node
+	Node* prev = head.exchange(node, std::memory_order_acq_rel);
+	prev->next.store(node);
+
+	if (sleeping.load()) {
+		std::unique_lock<std::mutex> lk(lock);
+		wake.notify_one();
+	}
+}
+
+bool DeviceWorker::pop(Task &task) {
+	Node* next = tail->next.load(std::memory_order_acquire);
+	if (!next) {
+		return false;
+	}
+	task = std::move(next->task);
+	delete tail;
+	tail = next;
+	return true;
+}
+
+void DeviceWorker::sync() {
+	const long long target = submitted.load();
+	if (completed.load() >= target) {
+		return;
+	}
+	// Tasks waiting on each other from the worker thread itself would never finish
+	assert(!isWorkerThread());
+
+	waiters++;
+	{
+		std::unique_lock<std::mutex> lk(lock);
+		done.wait(lk, [this, target] { return completed.load() >= target; });
+	}
+	waiters--;
+}
+
+void DeviceWorker::run(Task task) {
+	if (isWorkerThread()) {
+		task();
+		return;
+	}
+	submit(std::move(task));
+	sync();
+}
+
+void DeviceWorker::threadProc() {
+	// The only context switch this thread ever does
+	device.makeCurrent();
+
+	Task task;
+	int idle = 0;
+	for (;;) {
+		if (pop(task)) {
+			task();
+			task = nullptr;
+			idle = 0;
+			completed++;
+			if (waiters.load()) {
+				std::unique_lock<std::mutex> lk(lock);
+				done.notify_all();
+			}
+			continue;
+		}
+
+		if (++idle < SPIN_COUNT) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		// Announce the sleep before the last look at the queue, so a submitter either sees the flag or we see its task
+		std::unique_lock<std::mutex> lk(lock);
+		sleeping = true;
+		if (tail->next.load() == nullptr) {
+			if (stopRequested) {
+				sleeping = false;
+				break;
+			}
+			wake.wait(lk);
+		}
+		sleeping = false;
+		idle = 0;
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+
+namespace a7az0th {
+
+// The CPUs this process may run on and how they group into cores, packages and NUMA nodes.
+// Read from sysfs on Linux. Elsewhere, or when sysfs is missing, every CPU is a core of its own on a single node
+struct CpuTopology {
+	struct Cpu {
+		int id;      // Number of the CPU as the operating system knows it
+		int core;    // Physical core. Hyper-threads of one core share it. Unique across packages
+		int package; // Socket
+		int node;    // NUMA node, the memory the CPU reaches fastest
+	};
+
+	// The topology of the machine, read once
+	static const CpuTopology& get(void);
+
+	int getCpuCount(void) const { return int(cpus.size()); }
+	int getNodeCount(void) const { return numNodes; }
+	const Cpu& getCpu(int i) const { return cpus[i]; }
+
+	// Return the number of CPUs of a node this process may run on
+	int getNodeCpuCount(int node) const;
+
+	// Return the node of a CPU, 0 for CPUs not in the list
+	int getNodeOfCpu(int cpuId) const;
+private:
+	CpuTopology();
+	std::vector<Cpu> cpus; // Sorted by node, package, core and id
+	std::vector<int> nodeOfCpu; // Indexed by CPU id
+	int numNodes;
+};
+
+// Where the threads of a ThreadManager run
+struct AffinityPolicy {
+	enum class Kind {
+		None,       // Wherever the operating system puts them
+		Compact,    // Fill a core, then the next core of the same package and node. Threads close in index share caches
+		Scatter,    // Round robin over the nodes, one core at a time. Spreads the memory bandwidth of all nodes over few threads
+		OnePerCore, // Like Compact, but a single hyper-thread of every core
+		Explicit,   // Thread i runs on cpus[i % cpus.size()]
+	};
+
+	AffinityPolicy(Kind kind = Kind::None) : kind(kind) {}
+	AffinityPolicy(const std::vector<int> &cpus) : kind(Kind::Explicit), cpus(cpus) {}
+
+	// Return the CPU id for every thread index, starting at the caller's thread 0. Threads past the end wrap around.
+	// Empty for None
+	std::vector<int> getCpuOrder(void) const;
+
+	Kind kind;
+	std::vector<int> cpus; // The CPU ids of Explicit
+};
+
+// Bind a thread to a single CPU
+// @return 0 on success
+int setThreadAffinity(std::thread &thread, int cpuId);
+
+// Let a thread run on any CPU of the process again
+// @return 0 on success
+int clearThreadAffinity(std::thread &thread);
+
+// Bind or unbind the calling thread, such as the caller of ThreadManager::run, which is thread 0 of every job
+int setCurrentThreadAffinity(int cpuId);
+int clearCurrentThreadAffinity(void);
+
+// Return the CPU the calling thread runs on at the moment, -1 if unknown
+int getCurrentCpu(void);
+
+// Return the NUMA node the calling thread runs on at the moment
+inline int getCurrentNode(void) {
+	const int cpu = getCurrentCpu();
+	return (cpu < 0) ? 0 : CpuTopology::get().getNodeOfCpu(cpu);
+}
+
+} //namespace a7az0th
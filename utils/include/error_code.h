@@ -18,7 +18,7 @@ public:
 		//assert(false);
 	}
 
-	std::string getError() {
+	std::string getError() const {
 		char str[256];
 		if (functionName.length() > 0) {
 			sprintf(str, "%s: %s (Code: %d)", functionName.c_str(), errorMessage.c_str(), errorCode);
@@ -28,7 +28,7 @@ public:
 		return std::string(str);
 	}
 	~ErrorCode() {}
-	bool error() { return errorFlag; }
+	bool error() const { return errorFlag; }
 
 private:
 	//Parameters:
@@ -0,0 +1,471 @@
+#pragma once
+
+#include "threadman.h"
+#include "table.h"
+
+#include <algorithm>
+#include <type_traits>
+
+namespace a7az0th {
+
+// Parallel loops, reductions, scans, sorts and transforms on top of ThreadManager, so that a loop does not need
+// a MultiThreaded subclass of its own. Every function runs on all processors through the given ThreadManager and
+// returns when the work is done. They work on Table<T> and on raw arrays given as a pointer and a count.
+// None of them may be called from inside a job of the same ThreadManager.
+//
+// The grain is the number of items handed to a thread at a time. Zero picks one giving every thread a few blocks,
+// enough to balance uneven work without contending on the shared counter.
+
+namespace parallel_detail {
+
+	// Split [0, count) into blocks of grain items and call func(begin, end) for every block, blocks claimed from a shared counter
+	template <typename Func>
+	struct BlockJob : MultiThreaded {
+		BlockJob(const Func &func, int count, int grain) : func(func), count(count), grain(grain), next(0) {}
+		void threadProc(int index, int numThreads) override {
+			int begin = 0;
+			while ((begin = next.fetch_add(grain)) < count) {
+				const int end = (count - begin > grain) ? begin + grain : count;
+				func(begin, end);
+			}
+		}
+		const Func &func;
+		const int count;
+		const int grain;
+		alignas(CACHE_LINE_SIZE) std::atomic<int> next; // Written by every thread, kept off the line of the fields above
+	};
+
+	inline int getGrain(int count, int grain) {
+		if (grain > 0) {
+			return grain;
+		}
+		const int blocks = getProcessorCount() * 8;
+		return std::max((count + blocks - 1) / blocks, 1);
+	}
+
+	template <typename Func>
+	void runBlocks(ThreadManager &threadman, int count, int grain, const Func &func) {
+		if (count <= 0) {
+			return;
+		}
+		const int numBlocks = (count + grain - 1) / grain;
+		BlockJob<Func> job(func, count, grain);
+		threadman.run(&job, std::min(getProcessorCount(), numBlocks));
+	}
+
+	// The block form of the reduce: returns op(init, first[begin]), ... over [begin, end)
+	template <typename T, typename Op>
+	struct ReduceItems {
+		ReduceItems(const T* first, const Op &op) : first(first), op(op) {}
+		T operator()(int begin, int end, T init) const {
+			for (int i = begin; i < end; i++) {
+				init = op(init, first[i]);
+			}
+			return init;
+		}
+		const T* first;
+		const Op &op;
+	};
+
+	// The block form of the transform
+	template <typename In, typename Out, typename Func>
+	struct TransformItems {
+		TransformItems(const In* in, Out* out, const Func &func) : in(in), out(out), func(func) {}
+		void operator()(int begin, int end) const {
+			for (int i = begin; i < end; i++) {
+				out[i] = func(in[i]);
+			}
+		}
+		const In* in;
+		Out* out;
+		const Func &func;
+	};
+
+	// Reduce every block of the scan into sums[block]
+	template <typename T, typename Op>
+	struct ScanReduce {
+		ScanReduce(const T* in, T* sums, int count, int grain, const T &identity, const Op &op) :
+			in(in), sums(sums), grain(grain), count(count), identity(identity), op(op) {}
+		void operator()(int block) const {
+			const int begin = block * grain;
+			const int end = std::min(begin + grain, count);
+			T sum = identity;
+			for (int i = begin; i < end; i++) {
+				sum = op(sum, in[i]);
+			}
+			sums[block] = sum;
+		}
+		const T* in;
+		T* sums;
+		int grain;
+		int count;
+		const T &identity;
+		const Op &op;
+	};
+
+	// Scan every block starting from the sum of all blocks before it
+	template <typename T, typename Op>
+	struct ScanApply {
+		ScanApply(const T* in, T* out, const T* offsets, int count, int grain, bool inclusive, const Op &op) :
+			in(in), out(out), offsets(offsets), grain(grain), count(count), inclusive(inclusive), op(op) {}
+		void operator()(int block) const {
+			const int begin = block * grain;
+			const int end = std::min(begin + grain, count);
+			T sum = offsets[block];
+			if (inclusive) {
+				for (int i = begin; i < end; i++) {
+					sum = op(sum, in[i]);
+					out[i] = sum;
+				}
+				return;
+			}
+			for (int i = begin; i < end; i++) {
+				// Read first, out may be in
+				const T item = in[i];
+				out[i] = sum;
+				sum = op(sum, item);
+			}
+		}
+		const T* in;
+		T* out;
+		const T* offsets;
+		int grain;
+		int count;
+		bool inclusive;
+		const Op &op;
+	};
+
+	// Call func(index) for every index of [0, count), a block of indices at a time
+	template <typename Func>
+	struct EachIndex {
+		EachIndex(const Func &func) : func(func) {}
+		void operator()(int begin, int end) const {
+			for (int i = begin; i < end; i++) {
+				func(i);
+			}
+		}
+		const Func &func;
+	};
+
+	template <typename T, typename Op>
+	void scan(ThreadManager &threadman, const T* in, T* out, int count, const T &identity, const Op &op, bool inclusive, int grain) {
+		if (count <= 0) {
+			return;
+		}
+		// The block sums cost a second pass over the input, which a single thread can not make up for
+		grain = (getProcessorCount() == 1) ? count : getGrain(count, grain);
+		const int numBlocks = (count + grain - 1) / grain;
+		std::vector<T> sums(numBlocks, identity);
+
+		if (numBlocks > 1) {
+			ScanReduce<T, Op> reduce(in, &sums[0], count, grain, identity, op);
+			EachIndex<ScanReduce<T, Op> > reduceBlocks(reduce);
+			runBlocks(threadman, numBlocks, 1, reduceBlocks);
+		}
+
+		// Few blocks, the sums are scanned serially
+		T offset = identity;
+		for (int b = 0; b < numBlocks; b++) {
+			const T sum = sums[b];
+			sums[b] = offset;
+			offset = op(offset, sum);
+		}
+
+		ScanApply<T, Op> apply(in, out, &sums[0], count, grain, inclusive, op);
+		EachIndex<ScanApply<T, Op> > applyBlocks(apply);
+		runBlocks(threadman, numBlocks, 1, applyBlocks);
+	}
+
+	// Map integer keys to unsigned ones of the same order
+	template <typename T>
+	struct RadixKey {
+		typedef typename std::make_unsigned<T>::type Unsigned;
+		static Unsigned get(T key) {
+			const Unsigned signBit = std::is_signed<T>::value ? Unsigned(Unsigned(1) << (sizeof(T) * 8 - 1)) : Unsigned(0);
+			return Unsigned(key) ^ signBit;
+		}
+	};
+
+	// One pass of the radix sort: a histogram of the digit per block, then every block scatters its keys
+	template <typename T>
+	struct RadixPass {
+		static const int RADIX = 256;
+		void histogram(int block) const {
+			int* counts = histograms + size_t(block) * RADIX;
+			std::fill(counts, counts + RADIX, 0);
+			const int end = std::min(block * grain + grain, count);
+			for (int i = block * grain; i < end; i++) {
+				counts[(RadixKey<T>::get(src[i]) >> shift) & (RADIX - 1)]++;
+			}
+		}
+		// Keys are collected a cache line per digit before they are written out. Writing every key straight to one of
+		// RADIX places in memory touches a page per digit and misses the TLB most of the time
+		void scatter(int block) const {
+			static const int LINE = int(CACHE_LINE_SIZE / sizeof(T)) > 0 ? int(CACHE_LINE_SIZE / sizeof(T)) : 1;
+			int* offsets = histograms + size_t(block) * RADIX;
+			std::vector<T> buffer(RADIX * LINE);
+			int filled[RADIX] = { 0 };
+			const int end = std::min(block * grain + grain, count);
+			for (int i = block * grain; i < end; i++) {
+				const int digit = (RadixKey<T>::get(src[i]) >> shift) & (RADIX - 1);
+				T* line = &buffer[digit * LINE];
+				line[filled[digit]++] = src[i];
+				if (filled[digit] == LINE) {
+					std::copy(line, line + LINE, dst + offsets[digit]);
+					offsets[digit] += LINE;
+					filled[digit] = 0;
+				}
+			}
+			for (int digit = 0; digit < RADIX; digit++) {
+				std::copy(&buffer[digit * LINE], &buffer[digit * LINE] + filled[digit], dst + offsets[digit]);
+				offsets[digit] += filled[digit];
+			}
+		}
+		T* src;
+		T* dst;
+		int* histograms; // RADIX counts per block, turned into the output position of every digit of every block
+		int count;
+		int grain;
+		int shift;
+	};
+
+	template <typename T>
+	struct RadixHistogram {
+		RadixHistogram(const RadixPass<T> &pass) : pass(pass) {}
+		void operator()(int block) const { pass.histogram(block); }
+		const RadixPass<T> &pass;
+	};
+
+	template <typename T>
+	struct RadixScatter {
+		RadixScatter(const RadixPass<T> &pass) : pass(pass) {}
+		void operator()(int block) const { pass.scatter(block); }
+		const RadixPass<T> &pass;
+	};
+
+	template <typename T>
+	struct Copy {
+		Copy(const T* src, T* dst) : src(src), dst(dst) {}
+		void operator()(int begin, int end) const {
+			std::copy(src + begin, src + end, dst + begin);
+		}
+		const T* src;
+		T* dst;
+	};
+
+	// Merge every pair of neighbouring sorted runs of width items from src into dst
+	template <typename T, typename Compare>
+	struct MergeRound {
+		MergeRound(const T* src, T* dst, int count, int width, const Compare &compare) : src(src), dst(dst), count(count), width(width), compare(compare) {}
+		void operator()(int pair) const {
+			const int begin = std::min(pair * 2 * width, count);
+			const int mid = std::min(begin + width, count);
+			const int end = std::min(begin + 2 * width, count);
+			std::merge(src + begin, src + mid, src + mid, src + end, dst + begin, compare);
+		}
+		const T* src;
+		T* dst;
+		int count;
+		int width;
+		const Compare &compare;
+	};
+
+	// Sort every block of width items
+	template <typename T, typename Compare>
+	struct SortBlocks {
+		SortBlocks(T* first, int count, int width, const Compare &compare) : first(first), count(count), width(width), compare(compare) {}
+		void operator()(int block) const {
+			std::sort(first + block * width, first + std::min(block * width + width, count), compare);
+		}
+		T* first;
+		int count;
+		int width;
+		const Compare &compare;
+	};
+
+} //namespace parallel_detail
+
+// Call func(begin, end) for consecutive blocks of [begin, end), in parallel
+template <typename Func>
+void parallelFor(ThreadManager &threadman, int begin, int end, const Func &func, int grain = 0) {
+	struct Offset {
+		Offset(const Func &func, int base) : func(func), base(base) {}
+		void operator()(int b, int e) const { func(base + b, base + e); }
+		const Func &func;
+		int base;
+	};
+	const int count = end - begin;
+	parallel_detail::runBlocks(threadman, count, parallel_detail::getGrain(count, grain), Offset(func, begin));
+}
+
+// Combine the results of reduceRange(begin, end, identity) over blocks of [begin, end) with combine.
+// Blocks are combined in order, so the result only depends on the grain, not on the threads taking part.
+// identity must leave any value unchanged under combine, such as 0 for a sum
+template <typename T, typename RangeFunc, typename Combine>
+T parallelReduce(ThreadManager &threadman, int begin, int end, const T &identity, const RangeFunc &reduceRange, const Combine &combine, int grain = 0) {
+	const int count = end - begin;
+	if (count <= 0) {
+		return identity;
+	}
+	grain = parallel_detail::getGrain(count, grain);
+	const int numBlocks = (count + grain - 1) / grain;
+	std::vector<T> partial(numBlocks, identity);
+
+	struct Block {
+		Block(const RangeFunc &reduceRange, T* partial, const T &identity, int base, int grain) : reduceRange(reduceRange), partial(partial), identity(identity), base(base), grain(grain) {}
+		void operator()(int b, int e) const { partial[b / grain] = reduceRange(base + b, base + e, identity); }
+		const RangeFunc &reduceRange;
+		T* partial;
+		const T &identity;
+		int base;
+		int grain;
+	};
+	parallel_detail::runBlocks(threadman, count, grain, Block(reduceRange, &partial[0], identity, begin, grain));
+
+	T result = identity;
+	for (int b = 0; b < numBlocks; b++) {
+		result = combine(result, partial[b]);
+	}
+	return result;
+}
+
+// Combine count items with op, such as std::plus<T>()
+template <typename T, typename Op>
+T parallelReduce(ThreadManager &threadman, const T* first, int count, const T &identity, const Op &op, int grain = 0) {
+	return parallelReduce(threadman, 0, count, identity, parallel_detail::ReduceItems<T, Op>(first, op), op, grain);
+}
+
+template <typename T, typename Op>
+T parallelReduce(ThreadManager &threadman, const Table<T> &table, const T &identity, const Op &op, int grain = 0) {
+	return parallelReduce(threadman, table.begin(), table.count(), identity, op, grain);
+}
+
+// out[i] = in[0] op ... op in[i]. out may be in
+template <typename T, typename Op>
+void parallelInclusiveScan(ThreadManager &threadman, const T* in, T* out, int count, const T &identity, const Op &op, int grain = 0) {
+	parallel_detail::scan(threadman, in, out, count, identity, op, true, grain);
+}
+
+template <typename T, typename Op>
+void parallelInclusiveScan(ThreadManager &threadman, const Table<T> &in, Table<T> &out, const T &identity, const Op &op, int grain = 0) {
+	out.setCount(in.count());
+	parallelInclusiveScan(threadman, in.begin(), out.begin(), in.count(), identity, op, grain);
+}
+
+// out[i] = identity op in[0] op ... op in[i-1]. out may be in
+template <typename T, typename Op>
+void parallelExclusiveScan(ThreadManager &threadman, const T* in, T* out, int count, const T &identity, const Op &op, int grain = 0) {
+	parallel_detail::scan(threadman, in, out, count, identity, op, false, grain);
+}
+
+template <typename T, typename Op>
+void parallelExclusiveScan(ThreadManager &threadman, const Table<T> &in, Table<T> &out, const T &identity, const Op &op, int grain = 0) {
+	out.setCount(in.count());
+	parallelExclusiveScan(threadman, in.begin(), out.begin(), in.count(), identity, op, grain);
+}
+
+// out[i] = func(in[i]). out may be in
+template <typename In, typename Out, typename Func>
+void parallelTransform(ThreadManager &threadman, const In* in, Out* out, int count, const Func &func, int grain = 0) {
+	parallel_detail::runBlocks(threadman, count, parallel_detail::getGrain(count, grain), parallel_detail::TransformItems<In, Out, Func>(in, out, func));
+}
+
+template <typename In, typename Out, typename Func>
+void parallelTransform(ThreadManager &threadman, const Table<In> &in, Table<Out> &out, const Func &func, int grain = 0) {
+	out.setCount(in.count());
+	parallelTransform(threadman, in.begin(), out.begin(), in.count(), func, grain);
+}
+
+// Sort integer keys in ascending order with a least significant digit radix sort, a byte per pass.
+// Stable. Needs a scratch copy of the keys. Passes where all keys share the digit are skipped, so small keys in wide
+// types cost less
+template <typename T>
+void parallelSort(ThreadManager &threadman, T* first, int count) {
+	static_assert(std::is_integral<T>::value && !std::is_same<T, bool>::value, "radix sort needs integer keys");
+	typedef parallel_detail::RadixPass<T> Pass;
+	// Below this the histograms cost more than they save
+	if (count < (1 << 14)) {
+		std::sort(first, first + count);
+		return;
+	}
+	const int grain = parallel_detail::getGrain(count, 0);
+	const int numBlocks = (count + grain - 1) / grain;
+	std::vector<T> scratch(count);
+	std::vector<int> histograms(size_t(numBlocks) * Pass::RADIX);
+
+	Pass pass;
+	pass.src = first;
+	pass.dst = &scratch[0];
+	pass.histograms = &histograms[0];
+	pass.count = count;
+	pass.grain = grain;
+	for (pass.shift = 0; pass.shift < int(sizeof(T)) * 8; pass.shift += 8) {
+		parallel_detail::RadixHistogram<T> histogram(pass);
+		parallel_detail::runBlocks(threadman, numBlocks, 1, parallel_detail::EachIndex<parallel_detail::RadixHistogram<T> >(histogram));
+
+		// Every digit's keys go after all smaller digits, and after the same digit of earlier blocks to keep the order.
+		// A digit holding every key leaves the order as it is, the pass is skipped
+		int position = 0;
+		bool skip = false;
+		for (int digit = 0; digit < Pass::RADIX && !skip; digit++) {
+			const int digitStart = position;
+			for (int b = 0; b < numBlocks; b++) {
+				int &entry = histograms[size_t(b) * Pass::RADIX + digit];
+				const int blockCount = entry;
+				entry = position;
+				position += blockCount;
+			}
+			skip = (position - digitStart == count);
+		}
+		if (skip) {
+			continue;
+		}
+
+		parallel_detail::RadixScatter<T> scatter(pass);
+		parallel_detail::runBlocks(threadman, numBlocks, 1, parallel_detail::EachIndex<parallel_detail::RadixScatter<T> >(scatter));
+		std::swap(pass.src, pass.dst);
+	}
+	if (pass.src != first) {
+		parallel_detail::runBlocks(threadman, count, grain, parallel_detail::Copy<T>(pass.src, first));
+	}
+}
+
+template <typename T>
+void parallelSort(ThreadManager &threadman, Table<T> &table) {
+	parallelSort(threadman, table.begin(), table.count());
+}
+
+// Sort with a comparison, for keys that are not integers: blocks sorted with std::sort, then merged in rounds.
+// Not stable
+template <typename T, typename Compare>
+void parallelSort(ThreadManager &threadman, T* first, int count, const Compare &compare) {
+	const int numThreads = getProcessorCount();
+	if (count < (1 << 14) || numThreads < 2) {
+		std::sort(first, first + count, compare);
+		return;
+	}
+	int width = (count + numThreads - 1) / numThreads;
+	const int numBlocks = (count + width - 1) / width;
+	parallel_detail::SortBlocks<T, Compare> sortBlocks(first, count, width, compare);
+	parallel_detail::runBlocks(threadman, numBlocks, 1, parallel_detail::EachIndex<parallel_detail::SortBlocks<T, Compare> >(sortBlocks));
+
+	std::vector<T> scratch(count);
+	T* src = first;
+	T* dst = &scratch[0];
+	for (; width < count; width *= 2) {
+		const int numPairs = (count + 2 * width - 1) / (2 * width);
+		parallel_detail::MergeRound<T, Compare> round(src, dst, count, width, compare);
+		parallel_detail::runBlocks(threadman, numPairs, 1, parallel_detail::EachIndex<parallel_detail::MergeRound<T, Compare> >(round));
+		std::swap(src, dst);
+	}
+	if (src != first) {
+		parallel_detail::runBlocks(threadman, count, parallel_detail::getGrain(count, 0), parallel_detail::Copy<T>(src, first));
+	}
+}
+
+template <typename T, typename Compare>
+void parallelSort(ThreadManager &threadman, Table<T> &table, const Compare &compare) {
+	parallelSort(threadman, table.begin(), table.count(), compare);
+}
+
+} //namespace a7az0th
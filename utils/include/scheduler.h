@@ -0,0 +1,94 @@
+#pragma once
+
+#include "threadman.h"
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+namespace a7az0th {
+
+struct TaskScheduler;
+
+// A set of tasks whose completion can be waited for.
+// Tasks may spawn more tasks into any group, including their own, and create groups of their own: parallelism nests.
+struct TaskGroup {
+	TaskGroup(TaskScheduler &scheduler);
+	// Waits for all tasks of the group
+	~TaskGroup();
+
+	// Queue a task. Spawned from a worker of the scheduler, it goes onto that worker's deque where idle workers can steal it.
+	// Spawned from any other thread, it goes onto a shared queue
+	void spawn(std::function<void()> task);
+
+	// Return once all tasks of the group have finished. Runs queued tasks, of any group, while waiting
+	void sync();
+private:
+	friend struct TaskScheduler;
+	TaskScheduler &scheduler;
+	std::atomic<int> pending; // Tasks spawned but not finished yet
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+};
+
+// A work-stealing task scheduler, for work that forks unevenly or recursively, beside the fork-join ThreadManager.
+// Every worker owns a deque. It pushes and pops the tasks it spawns at the back, so it works depth first on hot data,
+// while idle workers steal from the front, taking the oldest and usually largest pieces of work.
+// Threads waiting in TaskGroup::sync run tasks too, so the caller and nested groups never leave a core idle.
+// Idle workers spin briefly and then park until a task is queued.
+struct TaskScheduler {
+	// @param numWorkers Number of worker threads. Negative for one less than the processor count, as the thread calling sync helps
+	TaskScheduler(int numWorkers = -1);
+	~TaskScheduler();
+
+	// Run a MultiThreaded job as numThreads tasks and wait for them.
+	// The tasks may run one after another, so the threads of the job must not wait for each other
+	void run(MultiThreaded *job, int numThreads);
+
+	int getWorkerCount() const { return int(workers.size()); }
+private:
+	friend struct TaskGroup;
+
+	// A unit of work and the group it counts towards
+	struct Task {
+		std::function<void()> work;
+		TaskGroup *group;
+	};
+
+	// A deque of tasks. The owner works at the back, thieves at the front.
+	// Created with newAligned, so the locks of different workers never share a cache line
+	struct alignas(CACHE_LINE_SIZE) WorkQueue {
+		Mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	// Queue a task on the calling worker's deque, or on the shared queue
+	void push(Task &task);
+
+	// Take a task: from the calling worker's own deque first, then from the shared queue, then from the other workers.
+	// @return False if no task was found
+	bool pop(Task &task);
+
+	// Run a task and count it as finished
+	void execute(Task &task);
+
+	// Return the index of the calling thread's deque. The shared queue is the last one
+	int getQueueIndex() const;
+
+	// Worker threads enter here
+	void workerProc(int index);
+
+	std::vector<WorkQueue*> queues;   // One per worker, then the shared queue
+	std::vector<std::thread> workers;
+	alignas(CACHE_LINE_SIZE) std::atomic<int> queued;   // Tasks queued and not taken yet. Written by every push and pop
+	alignas(CACHE_LINE_SIZE) std::atomic<int> sleepers; // Workers parked, waiting for a task
+	std::atomic<bool> stop;           // Set on destruction
+	std::mutex sleepMutex;
+	std::condition_variable wakeUp;   // Parked workers wait here
+
+	TaskScheduler(const TaskScheduler&) = delete;
+	TaskScheduler& operator=(const TaskScheduler&) = delete;
+};
+
+} //namespace a7az0th
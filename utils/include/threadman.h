@@ -1,15 +1,65 @@
 #pragma once
 
+#include "affinity.h"
+
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include <new>
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace a7az0th {
 
-	// How many CPUs we support
-	const int MAX_CPU_COUNT = 64;
+	// Size of a cache line. Data written by different threads is kept at least this far apart,
+	// so that a write by one thread does not evict the line another thread is working on (false sharing)
+	const size_t CACHE_LINE_SIZE = 64;
+
+	// Create an object aligned to a cache line. Before C++17 plain new ignores alignments beyond the fundamental ones
+	template <typename T>
+	T* newAligned(void) {
+		void* mem = nullptr;
+#ifdef _WIN32
+		mem = _aligned_malloc(sizeof(T), CACHE_LINE_SIZE);
+#else
+		if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(T))) {
+			mem = nullptr;
+		}
+#endif
+		assert(mem != nullptr);
+		return new (mem) T();
+	}
+
+	// Destroy an object created with newAligned
+	template <typename T>
+	void deleteAligned(T* object) {
+		if (!object) {
+			return;
+		}
+		object->~T();
+#ifdef _WIN32
+		_aligned_free(object);
+#else
+		free(object);
+#endif
+	}
 
 	// Return the number of processors available on the system
 	static int getProcessorCount(void) {
@@ -41,34 +91,399 @@ namespace a7az0th {
 		Mutex& mutex;
 	};
 
-	// A simple blocking event used in inter-thread communication
-	// Used to signal the waiting threads that a condition has been met
-	class Event {
-		std::condition_variable c;
+	// Number of times a waiter polls before it blocks. Waits are often over within microseconds, and a syscall costs more.
+	// With a single CPU the waker can not make progress while we spin, so block right away
+	inline int getSpinCount(void) {
+		static const int spinCount = (getProcessorCount() > 1) ? 4000 : 0;
+		return spinCount;
+	}
+
+	// A 32 bit word threads can block on until it changes: a futex on Linux, a condition variable elsewhere.
+	// wait() only blocks if the word still holds the expected value, checked atomically with going to sleep,
+	// so a change made just before the call is never missed
+	class Futex {
+		Futex(const Futex& rhs) = delete; // non-copyable class...
+		Futex& operator = (const Futex& rhs) = delete; // ... disallow evil constructors
+#ifndef __linux__
 		std::mutex m;
+		std::condition_variable c;
+#endif
+	public:
+		std::atomic<int> value;
+
+		Futex(int value = 0) : value(value) {}
+
+		// Block while value equals expected. May return early, callers check their condition again
+		void wait(int expected) {
+#ifdef __linux__
+			syscall(SYS_futex, reinterpret_cast<int*>(&value), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+			std::unique_lock<std::mutex> lk(m);
+			while (value == expected) {
+				c.wait(lk);
+			}
+#endif
+		}
+
+		// Wake up to count threads blocked in wait(). Call after changing value
+		void wake(int count) {
+#ifdef __linux__
+			syscall(SYS_futex, reinterpret_cast<int*>(&value), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+			std::unique_lock<std::mutex> lk(m);
+			if (count == 1) {
+				c.notify_one();
+			} else {
+				c.notify_all();
+			}
+#endif
+		}
+	};
+
+	// A counting semaphore. post() adds permits, wait() takes one, blocking while there are none.
+	// Permits posted before anyone waits are kept, so nothing is lost. Waiters spin briefly before they block,
+	// and posting only makes a syscall when a thread is actually blocked
+	class Semaphore {
+		Futex permits;
+		std::atomic<int> sleepers; // Threads blocked, or about to block, in wait()
+		Semaphore(const Semaphore& rhs) = delete; // non-copyable class...
+		Semaphore& operator = (const Semaphore& rhs) = delete; // ... disallow evil constructors
+	public:
+		Semaphore(int count = 0) : permits(count), sleepers(0) {}
+		~Semaphore(void) {}
+
+		// Take a permit if there is one
+		// @return False if there was none
+		bool tryWait(void) {
+			int count = permits.value.load(std::memory_order_relaxed);
+			while (count > 0) {
+				if (permits.value.compare_exchange_weak(count, count - 1)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Take a permit, waiting for one if needed
+		void wait(void) {
+			for (int spin = getSpinCount(); spin > 0; spin--) {
+				if (tryWait()) {
+					return;
+				}
+			}
+			// Counted before the last look at the permits. A post() that misses the count added its permit before it,
+			// and the look below finds that
+			sleepers++;
+			while (!tryWait()) {
+				permits.wait(0);
+			}
+			sleepers--;
+		}
+
+		// Add count permits, waking as many waiters
+		void post(int count = 1) {
+			permits.value += count;
+			if (sleepers > 0) {
+				permits.wake(count);
+			}
+		}
+	};
+
+	// An auto-reset event used in inter-thread communication.
+	// Used to signal the waiting threads that a condition has been met. A signal with nobody waiting is kept until the
+	// next wait(), which returns at once, so a signal landing just before wait() is never lost. Each wait() consumes
+	// the signal: several signals before a wait() count as one. Waiters spin briefly before they block,
+	// and signalling only makes a syscall when a thread is actually blocked
+	class Event {
+		// Bit 0 is set while the event is signalled. The bits above count signalAll() calls,
+		// which release every thread that started waiting before them
+		Futex state;
+		std::atomic<int> sleepers; // Threads blocked, or about to block, in wait()
 		Event(const Event& rhs) = delete; // non-copyable class...
 		Event& operator = (const Event& rhs) = delete; // ... disallow evil constructors
+
+		// @return True once the event was consumed or a signalAll() came after the generation the wait started in
+		bool tryConsume(int generation, int &current) {
+			current = state.value.load();
+			while (true) {
+				if ((current >> 1) != generation) {
+					return true;
+				}
+				if (!(current & 1)) {
+					return false;
+				}
+				if (state.value.compare_exchange_weak(current, current & ~1)) {
+					return true;
+				}
+			}
+		}
 	public:
-		Event(void) {}
+		Event(void) : sleepers(0) {}
 		~Event(void) {}
-		// Start waiting on the condition
+
+		// Wait until the event is set, and reset it
 		void wait(void) {
-			std::unique_lock<std::mutex> lk(m);
-			c.wait(lk);
+			const int generation = state.value.load() >> 1;
+			int current = 0;
+			for (int spin = getSpinCount(); spin > 0; spin--) {
+				if (tryConsume(generation, current)) {
+					return;
+				}
+			}
+			// Counted before the last look at the state. A signal that misses the count set the state before it,
+			// and the look below finds that
+			sleepers++;
+			while (!tryConsume(generation, current)) {
+				state.wait(current);
+			}
+			sleepers--;
 		}
-		// Release one waiting thread
-		void signal(void) {
-			std::unique_lock<std::mutex> lk(m);
-			c.notify_one();
+
+		// Set the event, releasing one waiting thread, or the next one to wait
+		// @return True if a thread was blocked on the event
+		bool signal(void) {
+			state.value |= 1;
+			if (sleepers > 0) {
+				state.wake(1);
+				return true;
+			}
+			return false;
 		}
-		// Release all waiting threads
+
+		// Release all threads waiting at the moment, without setting the event for later ones
 		void signalAll(void) {
-			std::unique_lock<std::mutex> lk(m);
-			c.notify_all();
+			state.value += 2;
+			if (sleepers > 0) {
+				state.wake(INT_MAX);
+			}
+		}
+	};
+
+	// Round up to a power of two, at least 2
+	inline size_t roundUpToPowerOfTwo(size_t n) {
+		size_t p = 2;
+		while (p < n) {
+			p <<= 1;
+		}
+		return p;
+	}
+
+	// A bounded lock-free ring buffer for exactly one producer thread and one consumer thread, such as a pipeline stage
+	// feeding a device worker. Never blocks: push fails when the queue is full, pop when it is empty.
+	// The producer and the consumer each own an index on a cache line of their own, and keep a cached copy of the other
+	// one, so they only touch each other's line when the cached copy says the queue is full or empty.
+	// The batch calls move many items for the price of one index update.
+	template <typename T>
+	class SpscQueue {
+		SpscQueue(const SpscQueue& rhs) = delete; // non-copyable class...
+		SpscQueue& operator = (const SpscQueue& rhs) = delete; // ... disallow evil constructors
+	public:
+		// @param capacity Rounded up to a power of two
+		SpscQueue(size_t capacity) : mask(roundUpToPowerOfTwo(capacity) - 1), tail(0), cachedHead(0), head(0), cachedTail(0) {
+			items = new T[mask + 1];
+		}
+		~SpscQueue() {
+			delete [] items;
+		}
+
+		size_t getCapacity(void) const { return mask + 1; }
+
+		// Producer only
+		// @return False if the queue is full
+		bool push(const T& item) {
+			return pushBatch(&item, 1) == 1;
+		}
+
+		// Producer only. Push as many of the items as fit
+		// @return The number of items pushed
+		int pushBatch(const T* batch, int count) {
+			const size_t t = tail.load(std::memory_order_relaxed);
+			if (t - cachedHead + count > mask + 1) {
+				cachedHead = head.load(std::memory_order_acquire);
+			}
+			const size_t space = mask + 1 - (t - cachedHead);
+			const int n = (size_t(count) < space) ? count : int(space);
+			for (int i = 0; i < n; i++) {
+				items[(t + i) & mask] = batch[i];
+			}
+			tail.store(t + n, std::memory_order_release);
+			return n;
+		}
+
+		// Consumer only
+		// @return False if the queue is empty
+		bool pop(T& item) {
+			return popBatch(&item, 1) == 1;
+		}
+
+		// Consumer only. Pop up to maxCount items
+		// @return The number of items popped
+		int popBatch(T* batch, int maxCount) {
+			const size_t h = head.load(std::memory_order_relaxed);
+			if (cachedTail - h < size_t(maxCount)) {
+				cachedTail = tail.load(std::memory_order_acquire);
+			}
+			const size_t available = cachedTail - h;
+			const int n = (size_t(maxCount) < available) ? maxCount : int(available);
+			for (int i = 0; i < n; i++) {
+				batch[i] = std::move(items[(h + i) & mask]);
+			}
+			head.store(h + n, std::memory_order_release);
+			return n;
+		}
+	private:
+		T* items;
+		const size_t mask;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail; // Written by the producer: the next slot to fill
+		size_t cachedHead;                                 // The producer's last look at head
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> head; // Written by the consumer: the next slot to read
+		size_t cachedTail;                                 // The consumer's last look at tail
+		char padding[CACHE_LINE_SIZE];                     // Keeps whatever follows in memory off the consumer's line
+	};
+
+	// A bounded queue for any number of producer and consumer threads, after Dmitry Vyukov's design: every slot carries a
+	// sequence number telling whether it is free or full for the current lap, so a push or a pop is one compare-and-swap
+	// on a shared position plus writes to its own slot. No locks, and producers and consumers only meet on the rare
+	// full or empty queue. Never blocks: push fails when the queue is full, pop when it is empty.
+	// Batches claim a run of slots with a single compare-and-swap.
+	template <typename T>
+	class MpmcQueue {
+		MpmcQueue(const MpmcQueue& rhs) = delete; // non-copyable class...
+		MpmcQueue& operator = (const MpmcQueue& rhs) = delete; // ... disallow evil constructors
+
+		struct Slot {
+			std::atomic<size_t> sequence; // Equal to the position when free for it, position + 1 when full
+			T item;
+		};
+	public:
+		// @param capacity Rounded up to a power of two
+		MpmcQueue(size_t capacity) : mask(roundUpToPowerOfTwo(capacity) - 1), pushPosition(0), popPosition(0) {
+			slots = new Slot[mask + 1];
+			for (size_t i = 0; i <= mask; i++) {
+				slots[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+		~MpmcQueue() {
+			delete [] slots;
+		}
+
+		size_t getCapacity(void) const { return mask + 1; }
+
+		// @return False if the queue is full
+		bool push(const T& item) {
+			size_t position = pushPosition.load(std::memory_order_relaxed);
+			for (;;) {
+				Slot& slot = slots[position & mask];
+				const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+				const intptr_t diff = intptr_t(sequence) - intptr_t(position);
+				if (diff == 0) {
+					if (pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+						slot.item = item;
+						slot.sequence.store(position + 1, std::memory_order_release);
+						return true;
+					}
+				} else if (diff < 0) {
+					// Still full from the previous lap
+					return false;
+				} else {
+					position = pushPosition.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// @return False if the queue is empty
+		bool pop(T& item) {
+			size_t position = popPosition.load(std::memory_order_relaxed);
+			for (;;) {
+				Slot& slot = slots[position & mask];
+				const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+				const intptr_t diff = intptr_t(sequence) - intptr_t(position + 1);
+				if (diff == 0) {
+					if (popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+						item = std::move(slot.item);
+						slot.sequence.store(position + mask + 1, std::memory_order_release);
+						return true;
+					}
+				} else if (diff < 0) {
+					return false;
+				} else {
+					position = popPosition.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// Push as many of the items as fit. The slots are claimed together, so the batch stays in order in the queue.
+		// A slot claimed while its previous item is still being popped is waited for, which takes a few instructions
+		// @return The number of items pushed
+		int pushBatch(const T* batch, int count) {
+			size_t position = pushPosition.load(std::memory_order_relaxed);
+			int n = 0;
+			for (;;) {
+				const size_t popped = popPosition.load(std::memory_order_acquire);
+				// Consumers may have moved past a stale position
+				if (popped > position) {
+					position = pushPosition.load(std::memory_order_relaxed);
+					continue;
+				}
+				const size_t used = position - popped;
+				const size_t space = (used < mask + 1) ? mask + 1 - used : 0;
+				n = (size_t(count) < space) ? count : int(space);
+				if (n == 0) {
+					return 0;
+				}
+				if (pushPosition.compare_exchange_weak(position, position + n, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+
+			for (int i = 0; i < n; i++) {
+				Slot& slot = slots[(position + i) & mask];
+				while (slot.sequence.load(std::memory_order_acquire) != position + i) {
+					std::this_thread::yield();
+				}
+				slot.item = batch[i];
+				slot.sequence.store(position + i + 1, std::memory_order_release);
+			}
+			return n;
+		}
+
+		// Pop up to maxCount items, in queue order. A slot claimed while its item is still being pushed is waited for
+		// @return The number of items popped
+		int popBatch(T* batch, int maxCount) {
+			size_t position = popPosition.load(std::memory_order_relaxed);
+			int n = 0;
+			for (;;) {
+				const size_t pushed = pushPosition.load(std::memory_order_acquire);
+				const size_t available = (pushed > position) ? pushed - position : 0;
+				n = (size_t(maxCount) < available) ? maxCount : int(available);
+				if (n == 0) {
+					return 0;
+				}
+				if (popPosition.compare_exchange_weak(position, position + n, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+
+			for (int i = 0; i < n; i++) {
+				Slot& slot = slots[(position + i) & mask];
+				while (slot.sequence.load(std::memory_order_acquire) != position + i + 1) {
+					std::this_thread::yield();
+				}
+				batch[i] = std::move(slot.item);
+				slot.sequence.store(position + i + mask + 1, std::memory_order_release);
+			}
+			return n;
 		}
+	private:
+		Slot* slots;
+		const size_t mask;
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> pushPosition; // The next slot producers claim
+		alignas(CACHE_LINE_SIZE) std::atomic<size_t> popPosition;  // The next slot consumers claim
+		char padding[CACHE_LINE_SIZE];                              // Keeps whatever follows in memory off the consumers' line
 	};
 
 	struct ThreadManager;
+	struct TaskScheduler;
 
 	struct MultiThreaded {
 		virtual ~MultiThreaded() {}
@@ -80,216 +495,449 @@ namespace a7az0th {
 
 		// Call this to run the code on the desired number of threads
 		void run(ThreadManager& threadman, int numThreads);
+		// Run the code as numThreads tasks of a work-stealing scheduler. See TaskScheduler::run
+		void run(TaskScheduler& scheduler, int numThreads);
 	};
 
 	struct MultiThreadedFor : MultiThreaded {
 	public:
-		virtual ~MultiThreadedFor() {}
+		// How iterations are handed out to the threads
+		enum class Schedule {
+			Dynamic, // One iteration at a time from a shared counter. Balances best, but the counter is contended when bodies are cheap
+			Static,  // Every thread takes one contiguous block of count/numThreads iterations. No contention, no balancing
+			Grain,   // Blocks of a fixed number of iterations from the shared counter
+			Guided,  // Blocks of a share of the iterations left, shrinking towards the grain size as the loop ends. Large blocks
+			         // while there is plenty of work, small ones to even out the end
+			NumaLocal, // One contiguous range of iterations per NUMA node, sized by the node's CPU count. Threads take grain
+			           // blocks from the range of the node they run on, then help the other nodes. Memory first touched
+			           // in one loop stays local to the threads of the next loop of the same count, as long as the
+			           // threads keep to their nodes, see ThreadManager::setAffinity. Grain on single node machines
+		};
+
+		MultiThreadedFor() : schedule(Schedule::Dynamic), grain(1) {}
+		virtual ~MultiThreadedFor() {
+			for (int i = 0; i < int(ranges.size()); i++) {
+				deleteAligned(ranges[i]);
+			}
+		}
+
+		// Choose how iterations are handed out. Applies to the following runs
+		// @param grain The block size of Grain and the smallest block of Guided
+		void setSchedule(Schedule schedule, int grain = 1) {
+			this->schedule = schedule;
+			this->grain = (grain > 0) ? grain : 1;
+		}
 
 		void run(ThreadManager& threadman, int numIterations, int numThreads) {
-			idx = 0;
-			count = numIterations;
+			prepare(numIterations);
 			MultiThreaded::run(threadman, numThreads);
 		}
+		void run(TaskScheduler& scheduler, int numIterations, int numThreads) {
+			prepare(numIterations);
+			MultiThreaded::run(scheduler, numThreads);
+		}
 		// This does the actual work. It will be for every index in count
 		// @param index The index of the current worker thread, 0..numThreads-1;
 		// @param numThreads The total number of workers.
 		virtual void body(int index, int threadIdx, int numThreads) = 0;
 
 	private:
-		std::atomic<int> idx; // Atomic counter keeping track of the current index
-		int count;            // How many times the thread procedure should be called
+		// Every thread hammers the counter, so it gets a cache line to itself. The fields read on every claim stay clear of it
+		alignas(CACHE_LINE_SIZE) std::atomic<int> idx; // Atomic counter keeping track of the current index
+		alignas(CACHE_LINE_SIZE) int count;            // How many times the thread procedure should be called
+		Schedule schedule;                             // How iterations are handed out
+		int grain;                                     // Block size of Grain, smallest block of Guided and block size of NumaLocal
+
+		// The iterations of one NUMA node. Every node's counter has a cache line of its own
+		struct alignas(CACHE_LINE_SIZE) NodeRange {
+			std::atomic<int> next; // The first iteration not handed out yet
+			int end;
+		};
+		std::vector<NodeRange*> ranges; // One per node, used by NumaLocal. Created with newAligned
+
+		void prepare(int numIterations) {
+			idx = 0;
+			count = numIterations;
+			if (schedule != Schedule::NumaLocal) {
+				return;
+			}
+			const CpuTopology& topology = CpuTopology::get();
+			const int numNodes = topology.getNodeCount();
+			while (int(ranges.size()) < numNodes) {
+				ranges.push_back(newAligned<NodeRange>());
+			}
+			int cpusBefore = 0;
+			for (int n = 0; n < numNodes; n++) {
+				ranges[n]->next = int((long long)count * cpusBefore / topology.getCpuCount());
+				cpusBefore += topology.getNodeCpuCount(n);
+				ranges[n]->end = int((long long)count * cpusBefore / topology.getCpuCount());
+			}
+		}
 
 		void threadProc(int index, int numThreads) final {
-			int i = 0;
-			while ((i = idx++) < count) {
-				body(i, index, numThreads);
+			switch (schedule) {
+				case Schedule::Dynamic: {
+					int i = 0;
+					while ((i = idx++) < count) {
+						body(i, index, numThreads);
+					}
+					break;
+				}
+				case Schedule::Static: {
+					const int begin = int((long long)count * index / numThreads);
+					const int end = int((long long)count * (index + 1) / numThreads);
+					for (int i = begin; i < end; i++) {
+						body(i, index, numThreads);
+					}
+					break;
+				}
+				case Schedule::Grain: {
+					int begin = 0;
+					while ((begin = idx.fetch_add(grain)) < count) {
+						const int end = (count - begin > grain) ? begin + grain : count;
+						for (int i = begin; i < end; i++) {
+							body(i, index, numThreads);
+						}
+					}
+					break;
+				}
+				case Schedule::Guided: {
+					int begin = idx;
+					while (begin < count) {
+						int size = (count - begin) / (2 * numThreads);
+						size = (size > grain) ? size : grain;
+						const int end = (count - begin > size) ? begin + size : count;
+						// On failure begin is reloaded with the current position
+						if (!idx.compare_exchange_weak(begin, end)) {
+							continue;
+						}
+						for (int i = begin; i < end; i++) {
+							body(i, index, numThreads);
+						}
+						begin = idx;
+					}
+					break;
+				}
+				case Schedule::NumaLocal: {
+					const int numNodes = CpuTopology::get().getNodeCount();
+					const int home = getCurrentNode();
+					for (int k = 0; k < numNodes; k++) {
+						NodeRange &range = *ranges[(home + k) % numNodes];
+						int begin = 0;
+						while ((begin = range.next.fetch_add(grain)) < range.end) {
+							const int end = (range.end - begin > grain) ? begin + grain : range.end;
+							for (int i = begin; i < end; i++) {
+								body(i, index, numThreads);
+							}
+						}
+					}
+					break;
+				}
 			}
 		}
 	};
 
 	// A generic thread manager. Responsible for creating, managing, scheduling and deallocating threads.
+	// The calling thread takes part in every job as thread 0, so a job on numThreads threads uses numThreads-1 workers.
+	// Handing out a job and waiting for it are a handshake through atomics: idle workers and the waiting caller
+	// spin briefly and then block on an Event. Dispatching a job costs microseconds rather than a sleep.
+	// The pool grows to any size. Workers form a binary tree for dispatch: the caller wakes the first two and every
+	// worker wakes its own two children before starting on its share, so hundreds of workers start in a logarithmic
+	// number of steps rather than one after another.
+	// Workers run wherever the operating system puts them, unless an affinity policy pins them, see setAffinity.
+	// Besides fork-join jobs the pool runs independent tasks handed in with submit(), which returns at once with a future.
+	// Any thread may submit, and idle workers pick the tasks up between jobs.
 	struct ThreadManager {
 	private:
 		// The possible states a thread can be in
 		enum ThreadState {
 			THREAD_INIT = 100,
-			THREAD_IDLE,
 			THREAD_RUNNING,
 			THREAD_DONE,
 			THREAD_DEAD
 		};
 
-		// Internal struct for "boss"/"worker" synchronization:
-		struct ThreadInfoStruct {
-			int index;                  // Index of the current thread
-			int numThreads;             // Total number of threads
-			Event changedState;         // Signalled when the thread changes state
-			Event* releaseMainThread;   // Threadman event. Used by the last thread to signal and unlock the ThreadMan
-			std::thread handle;         // Handle to the actual thread object
-			volatile ThreadState state; // The state of the current thread.
-			MultiThreaded *algorithm;   // The algorithm the thread is going to execute
-			std::atomic<int>* counter;  // A pointer to the atomic active thread counter. The threadman gets signalled when this reaches zero
-			volatile bool* jobsDone;
-		} info[MAX_CPU_COUNT];
-
-		int threadsInPool;        // Number of threads currently inside the threadpool
-		bool workComplete;        // A flag indicating that all worker threads have finished
-		std::atomic<int> counter; // An atomic counter. Determines the number of currently working threads. Used to signal the main thread when all work is done
-		Event waitForThreads;     // A wait condifion. The threadmanager waits on this while the threads are working.
+		// Internal struct for "boss"/"worker" synchronization.
+		// Every worker's state starts on a cache line of its own, created with newAligned, so that dispatching to
+		// one worker does not disturb its neighbours. The job and the epoch announcing it share a line:
+		// the worker spinning on the epoch gets the job with the same cache miss
+		struct alignas(CACHE_LINE_SIZE) ThreadInfoStruct {
+			std::atomic<unsigned> epoch;    // Bumped by the thread manager to hand the thread a job, or tell it to exit
+			std::atomic<ThreadState> state; // The state of the current thread.
+			int index;                      // Index of the current thread
+			int numThreads;                 // Total number of threads
+			MultiThreaded *algorithm;       // The algorithm the thread is going to execute
+			ThreadManager *owner;           // The thread manager, signalled when the last worker is done
+			// Only touched when the thread blocks, or by the thread manager itself
+			alignas(CACHE_LINE_SIZE) Event wake; // Signalled when the epoch changes or a task is submitted
+			std::thread handle;             // Handle to the actual thread object
+		};
+
+		std::vector<ThreadInfoStruct*> info; // One per worker. The worker at position i has index i+1. Grown under poolLock
+		std::vector<ThreadInfoStruct*> tree; // The workers of the current job, a copy of info only run() writes. Workers dispatch through it
+		std::atomic<int> threadsInPool; // Number of threads currently inside the threadpool
+		std::vector<int> cpuOrder; // CPU of every thread index, from the affinity policy. Empty when threads are not pinned
+		Mutex poolLock;            // Taken to grow or walk the pool, as submit() may grow it from any thread
+		alignas(CACHE_LINE_SIZE) std::atomic<int> counter; // Number of workers still running the current job. Every worker writes it
+		alignas(CACHE_LINE_SIZE) Event jobDone;            // Signalled by the worker that drops counter to zero
+
+		Mutex taskLock;                         // Guards tasks
+		std::deque<std::function<void()> > tasks; // Submitted and not started yet
+		alignas(CACHE_LINE_SIZE) std::atomic<int> queuedTasks; // Size of tasks, read by idle workers without the lock
+		std::atomic<int> unfinishedTasks;       // Tasks submitted and not finished yet
+		std::atomic<unsigned> nextWake;         // The worker submit() tries to wake first, so that tasks spread over the pool
+		bool flatDispatch;                      // The caller of run() wakes every worker itself, see run()
+		bool stopping;                          // Set by killall() under poolLock. Tasks submitted meanwhile run inline
+
+		// Take a submitted task and run it
+		// @return False if there was none
+		bool runTask(void) {
+			std::function<void()> task;
+			{
+				MutexRAII guard(taskLock);
+				if (tasks.empty()) {
+					return false;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+				queuedTasks--;
+			}
+			task();
+			unfinishedTasks--;
+			return true;
+		}
+
+		// Queue a task and wake an idle worker for it
+		void enqueue(std::function<void()> task) {
+			bool runInline = false;
+			{
+				MutexRAII guard(poolLock);
+				runInline = stopping;
+				// A single CPU still gets a worker, so that submit() does not wait for the task
+				const int numWorkers = (getProcessorCount() > 1) ? getProcessorCount() - 1 : 1;
+				while (!stopping && threadsInPool < numWorkers) {
+					spawnNewThread();
+				}
+			}
+			// The pool is being torn down, and the submitter may be one of the workers killall() joins
+			if (runInline) {
+				task();
+				return;
+			}
+			{
+				MutexRAII guard(taskLock);
+				tasks.push_back(std::move(task));
+				unfinishedTasks++;
+				queuedTasks++;
+			}
+			// Workers look at the queue before they block, so only a blocked one needs waking. A busy worker
+			// looks again once it is done, the signal only makes it look once more
+			MutexRAII guard(poolLock);
+			const unsigned numWorkers = threadsInPool;
+			const unsigned first = nextWake++;
+			for (unsigned i = 0; i < numWorkers; i++) {
+				if (info[(first + i) % numWorkers]->wake.signal()) {
+					break;
+				}
+			}
+		}
 
 		// Spawned threads enter here.
-		// When a thread comes here it will enter idle state and wait for the thread manager to release it.
-		// When the thread manager spawns all threads, it initializes their contexts and releases them
-		// At this point all threads unpause and call the thread procedure given by the user.
-		// The main thread is released when all spawned threads exit this method.
+		// A thread waits for the thread manager to bump its epoch, runs the job it was given and waits again.
+		// The last worker to finish a job releases the thread manager.
 		// @param info - The context of the thread spawned
 		static void exec(ThreadInfoStruct *info) {
-			// Are we done?
-			bool done = false;
-			std::atomic<int>& cnt = *info->counter;
-			do {
-				// Set the current thread state to IDLE
-				// The thread manager needs to initialize rest of the thread data
-				// Before we can proceed with the execution
-				info->state = THREAD_IDLE;
-
-				// Wait for the thread to be woken from the thread manager
-				info->changedState.wait();
-
-				// The thread has been awoken!
-				// When the thread manager wakes a thread, it will set its state to RUNNING
-				switch (info->state) {
-					case THREAD_RUNNING: {
-						// If we have a job, do it
-						MultiThreaded *job = info->algorithm;
-
-						if (job) {
-							job->threadProc(info->index, info->numThreads);
-						}
+			ThreadManager *owner = info->owner;
+			unsigned seen = 0;
+			for (;;) {
+				// The event keeps signals sent before the wait, so none is missed. Stale ones only cost another look
+				while (info->epoch == seen && owner->queuedTasks == 0) {
+					info->wake.wait();
+				}
+				// Jobs first, the caller of run() is waiting for them
+				if (info->epoch == seen) {
+					owner->runTask();
+					continue;
+				}
+				seen = info->epoch;
 
-						// After the job is done, decrease the global counter
-						// keeping track of the threads that are currently running.
-						if (0 == --cnt) {
-							// If this is the last threads
-							// Signal the thread manager that the main thread can continue.
-							*info->jobsDone = true;
-							info->releaseMainThread->signal();
-						}
-						break;
-					}
+				// The job and the state were written before the epoch, so they are visible now
+				if (info->state == THREAD_DONE) {
+					break;
+				}
+				const int position = info->index - 1;
+				const int numWorkers = info->numThreads - 1;
+				// The caller of run() is the root and wakes positions 0 and 1. Position p wakes 2p+2 and 2p+3
+				for (int child = 2 * position + 2; child <= 2 * position + 3 && child < numWorkers && !owner->flatDispatch; child++) {
+					owner->release(child);
+				}
 
-					case THREAD_DONE: {
-						done = true;
-						break;
-					}
-					default:
-						break;
+				MultiThreaded *job = info->algorithm;
+				if (job) {
+					job->threadProc(info->index, info->numThreads);
+				}
+
+				if (0 == --owner->counter) {
+					owner->jobDone.signal();
 				}
-			} while (!done);
+			}
 			info->state = THREAD_DEAD;
 		}
 
-		// Used to add another thread to the threadpool
+		// Wake the worker at the given position of the current job. Its job must have been set up
+		void release(int position) {
+			ThreadInfoStruct& ti = *tree[position];
+			// A worker still on its way back from the previous job sees the new epoch before it blocks
+			ti.epoch++;
+			ti.wake.signal();
+		}
+
+		// Used to add another thread to the threadpool. Call with poolLock taken
 		void spawnNewThread(void) {
 			// Get a context for the the next thread;
-			ThreadInfoStruct& ti = info[threadsInPool];
+			info.push_back(newAligned<ThreadInfoStruct>());
+			ThreadInfoStruct& ti = *info.back();
 
 			// Initialize the context
-			ti.index = threadsInPool;               // Set the new thread's ID
+			ti.index = threadsInPool + 1;           // Set the new thread's ID. The caller of run() is thread 0
+			ti.numThreads = 0;
+			ti.epoch = 0;
 			ti.state = THREAD_INIT;                 // Set initial thread state
-			ti.releaseMainThread = &waitForThreads; // Give the workers a way to signal the main thread when they are done
 			ti.algorithm = NULL;                    // Set the job to NULL (initially)
-			ti.counter = &counter;
-			ti.jobsDone = &workComplete;
+			ti.owner = this;
 			// Run a thread with the context provided and get a pointer to it.
 			ti.handle = std::thread(&exec, &ti);
+			if (!cpuOrder.empty()) {
+				setThreadAffinity(ti.handle, getThreadCpu(ti.index));
+			}
 
 			// Increment the number of currently active threads
 			++threadsInPool;
-
-			// Update the number of currently active threads throughout all thread contexts
-			for (int i = 0; i < threadsInPool; i++) {
-				info[i].numThreads = threadsInPool;
-			}
-		}
-
-		static void wait(int ms) {
-			std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 		}
 
 		// Disallow evil constructors.
 		ThreadManager(const ThreadManager& rhs) = delete;
 		ThreadManager& operator = (const ThreadManager& rhs) = delete;
 	public:
-		ThreadManager() : threadsInPool(0), counter(0) {}
+		ThreadManager() : threadsInPool(0), counter(0), queuedTasks(0), unfinishedTasks(0), nextWake(0), flatDispatch(false), stopping(false) {}
 		~ThreadManager() { killall(); }
 
 		// Run requested number of threads and wait for them to finish.
+		// Only one thread at a time may call run(), and not from a submitted task. Workers busy with submitted tasks
+		// join the job once they are done with them. While tasks are in flight the workers are woken one by one rather
+		// than through the tree, so that a busy worker does not hold up the ones below it.
 		// @param job The algorithm to run
-		// @param numThreads How many threads to run the algorithm with.
+		// @param numThreads How many threads to run the algorithm with, including the calling thread.
 		void run(MultiThreaded* job, int numThreads) {
-			if (numThreads == 1) {
+			if (numThreads <= 1) {
 				job->threadProc(0, 1);
 				return;
 			}
+			const int numWorkers = numThreads - 1;
+
 			// Spawn all threads
-			while (threadsInPool < numThreads) {
-				spawnNewThread();
+			if (int(tree.size()) < numWorkers) {
+				MutexRAII guard(poolLock);
+				while (threadsInPool < numWorkers) {
+					spawnNewThread();
+				}
+				// No worker reads the tree between jobs
+				tree = info;
 			}
 
-			counter = numThreads;
-			workComplete = false;
+			counter = numWorkers;
 			// For each thread
-			for (int i = 0; i < numThreads; i++) {
-				info[i].index = i;               // Set its index
-				info[i].numThreads = numThreads; // Set total number of threads
-				info[i].algorithm = job;         // Init the function that is going to be executed
-
-				// Wait for the thread to enter its main loop before we let it run
-				while (info[i].state != THREAD_IDLE) {
-					wait(20);
-				}
+			for (int i = 0; i < numWorkers; i++) {
+				ThreadInfoStruct& ti = *tree[i];
+				ti.index = i + 1;              // Set its index
+				ti.numThreads = numThreads;    // Set total number of threads
+				ti.algorithm = job;            // Init the function that is going to be executed
+				ti.state = THREAD_RUNNING;
+			}
+			// Publish the job to the root of the tree. Everything written above happens before any worker's epoch changes
+			flatDispatch = (unfinishedTasks > 0);
+			const int roots = flatDispatch ? numWorkers : 2;
+			for (int i = 0; i < roots && i < numWorkers; i++) {
+				release(i);
+			}
+
+			// Do our share while the workers do theirs
+			job->threadProc(0, numThreads);
+
+			// The signal of a previous job may still be set, so check the counter after every wake up
+			while (counter != 0) {
+				jobDone.wait();
+			}
+		}
 
-				// The thread has entered its main loop, so signal it to begin
-				info[i].state = THREAD_RUNNING;
-				info[i].changedState.signal();
+		// Stops all threads and frees the resources allocated by them.
+		// Tasks submitted and not started yet run on the calling thread. Tasks submitted while it runs, also by
+		// the tasks themselves, run inline in submit()
+		void killall(void) {
+			while (runTask()) {}
+			// A task still running may submit, so the lock is not held while the workers are joined
+			std::vector<ThreadInfoStruct*> workers;
+			{
+				MutexRAII guard(poolLock);
+				stopping = true;
+				workers = info;
+			}
+			// Tell everyone first, so the threads exit in parallel
+			for (int i = 0; i < int(workers.size()); i++) {
+				workers[i]->state = THREAD_DONE;
+				workers[i]->epoch++;
+				workers[i]->wake.signal();
 			}
+			for (int i = 0; i < int(workers.size()); i++) {
+				workers[i]->handle.join();
+			}
+			// Tasks queued by the workers before they saw stopping
+			while (runTask()) {}
 
-			// Wait for the last thread to signal and exit the wait loop.
-			//The check is in a loop to guard against spurious wakes.
-			//We check on a flag different from the wait condition as the flag is persistent.
-			//If all worker threads complete the job and signal before the main thread reaches this line
-			//we will enter a deadlock as the main thread will sleep here forever. With the flag
-			//the signalling is not lost
-			while (!workComplete) {
-				waitForThreads.wait();
+			MutexRAII guard(poolLock);
+			for (int i = 0; i < int(workers.size()); i++) {
+				deleteAligned(workers[i]);
 			}
+			info.clear();
+			tree.clear();
+			threadsInPool = 0;
+			stopping = false;
+		}
 
-			// round robin all threads until they come to rest
-			while (1) {
-				bool good = true;
-				for (int i = 0; i < numThreads; i++) {
-					if (info[i].state != THREAD_IDLE) {
-						good = false;
-						break;
-					}
+		// Run func on a worker of the pool and return at once.
+		// Any number of threads may submit at the same time, and many tasks may be in flight at once.
+		// A task must not call run() of the same ThreadManager, nor wait for a task submitted after it.
+		// @return The future of the result. Exceptions thrown by func are rethrown by its get()
+		template <typename Func>
+		std::future<typename std::result_of<Func()>::type> submit(Func func) {
+			typedef typename std::result_of<Func()>::type Result;
+			// std::function needs a copyable target, the packaged task is not
+			std::shared_ptr<std::packaged_task<Result()> > task = std::make_shared<std::packaged_task<Result()> >(std::move(func));
+			std::future<Result> result = task->get_future();
+			enqueue([task] { (*task)(); });
+			return result;
+		}
+
+		// Return the number of worker threads in the pool
+		int getThreadCount(void) const { return threadsInPool; }
+
+		// Pin the workers, present and future, to CPUs. The caller of run() is thread 0 and is not pinned:
+		// pin it to getThreadCpu(0) with setCurrentThreadAffinity to complete the placement
+		void setAffinity(const AffinityPolicy& policy) {
+			MutexRAII guard(poolLock);
+			cpuOrder = policy.getCpuOrder();
+			for (int i = 0; i < threadsInPool; i++) {
+				if (cpuOrder.empty()) {
+					clearThreadAffinity(info[i]->handle);
+				} else {
+					setThreadAffinity(info[i]->handle, getThreadCpu(info[i]->index));
 				}
-				if (good) break;
-				wait(20);
 			}
 		}
 
-		// Stops all threads and frees the resources allocated by them
-		void killall(void) {
-			for (; threadsInPool > 0; threadsInPool--) {
-				ThreadInfoStruct& threadInfo = info[threadsInPool - 1];
-				while (threadInfo.state != THREAD_IDLE) wait(20);
-				threadInfo.state = THREAD_DONE;
-				threadInfo.changedState.signal();
-				while (threadInfo.state != THREAD_DEAD) wait(20);
-				threadInfo.handle.detach();
-			}
+		// Return the CPU thread index runs on under the affinity policy, -1 if threads are not pinned
+		int getThreadCpu(int index) const {
+			return cpuOrder.empty() ? -1 : cpuOrder[index % int(cpuOrder.size())];
 		}
 	};
 
@@ -0,0 +1,297 @@
+#include "affinity.h"
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <string>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define VC_EXTRALEAN
+#  include <windows.h>
+#elif defined(__linux__)
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+using namespace a7az0th;
+
+#ifdef __linux__
+// Read the first line of a sysfs file
+static bool readLine(const std::string &path, std::string &line) {
+	FILE* fp = fopen(path.c_str(), "r");
+	if (!fp) {
+		return false;
+	}
+	char buffer[4096] = { 0 };
+	const bool ok = (fgets(buffer, sizeof(buffer), fp) != nullptr);
+	fclose(fp);
+	line = buffer;
+	return ok;
+}
+
+static int readInt(const std::string &path, int fallback) {
+	std::string line;
+	int value = fallback;
+	if (!readLine(path, line) || sscanf(line.c_str(), "%d", &value) != 1) {
+		return fallback;
+	}
+	return value;
+}
+
+// Parse a sysfs CPU or node list, such as "0-3,8-11"
+static std::vector<int> readList(const std::string &path) {
+	std::vector<int> list;
+	std::string line;
+	if (!readLine(path, line)) {
+		return list;
+	}
+	const char* p = line.c_str();
+	while (*p) {
+		int first = 0, last = 0, consumed = 0;
+		if (sscanf(p, "%d%n", &first, &consumed) != 1) {
+			break;
+		}
+		p += consumed;
+		last = first;
+		if (*p == '-' && sscanf(p + 1, "%d%n", &last, &consumed) == 1) {
+			p += 1 + consumed;
+		}
+		for (int i = first; i <= last; i++) {
+			list.push_back(i);
+		}
+		if (*p != ',') {
+			break;
+		}
+		p++;
+	}
+	return list;
+}
+#endif
+
+const CpuTopology& CpuTopology::get(void) {
+	static const CpuTopology topology;
+	return topology;
+}
+
+CpuTopology::CpuTopology() : numNodes(1) {
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	const bool haveMask = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+
+	// Node of every CPU. Machines without NUMA have no node directory, everything is node 0 then
+	std::map<int, int> osNodeOfCpu;
+	const std::vector<int> nodes = readList("/sys/devices/system/node/online");
+	for (int i = 0; i < int(nodes.size()); i++) {
+		const std::vector<int> nodeCpus = readList("/sys/devices/system/node/node" + std::to_string(nodes[i]) + "/cpulist");
+		for (int j = 0; j < int(nodeCpus.size()); j++) {
+			osNodeOfCpu[nodeCpus[j]] = nodes[i];
+		}
+	}
+
+	// Cores are numbered within their package only
+	std::map<std::pair<int, int>, int> coreIds;
+	std::map<int, int> nodeIds;
+	const std::vector<int> online = readList("/sys/devices/system/cpu/online");
+	for (int i = 0; i < int(online.size()); i++) {
+		const int id = online[i];
+		if (haveMask && (id >= CPU_SETSIZE || !CPU_ISSET(id, &allowed))) {
+			continue;
+		}
+		const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+		const int package = readInt(dir + "physical_package_id", 0);
+		const int core = readInt(dir + "core_id", id);
+		const std::pair<int, int> coreKey(package, core);
+		if (coreIds.find(coreKey) == coreIds.end()) {
+			const int next = int(coreIds.size());
+			coreIds[coreKey] = next;
+		}
+		// Nodes are numbered densely over the ones holding CPUs of this process
+		const int osNode = osNodeOfCpu.count(id) ? osNodeOfCpu[id] : 0;
+		if (nodeIds.find(osNode) == nodeIds.end()) {
+			const int next = int(nodeIds.size());
+			nodeIds[osNode] = next;
+		}
+		Cpu cpu = { id, coreIds[coreKey], package, nodeIds[osNode] };
+		cpus.push_back(cpu);
+	}
+	numNodes = std::max(int(nodeIds.size()), 1);
+#endif
+
+	if (cpus.empty()) {
+		const int count = std::max(int(std::thread::hardware_concurrency()), 1);
+		for (int i = 0; i < count; i++) {
+			Cpu cpu = { i, i, 0, 0 };
+			cpus.push_back(cpu);
+		}
+	}
+
+	std::sort(cpus.begin(), cpus.end(), [](const Cpu &a, const Cpu &b) {
+		if (a.node != b.node) return a.node < b.node;
+		if (a.package != b.package) return a.package < b.package;
+		if (a.core != b.core) return a.core < b.core;
+		return a.id < b.id;
+	});
+	for (int i = 0; i < int(cpus.size()); i++) {
+		if (cpus[i].id >= int(nodeOfCpu.size())) {
+			nodeOfCpu.resize(cpus[i].id + 1, 0);
+		}
+		nodeOfCpu[cpus[i].id] = cpus[i].node;
+	}
+}
+
+int CpuTopology::getNodeCpuCount(int node) const {
+	int count = 0;
+	for (int i = 0; i < int(cpus.size()); i++) {
+		count += (cpus[i].node == node);
+	}
+	return count;
+}
+
+int CpuTopology::getNodeOfCpu(int cpuId) const {
+	return (cpuId >= 0 && cpuId < int(nodeOfCpu.size())) ? nodeOfCpu[cpuId] : 0;
+}
+
+std::vector<int> AffinityPolicy::getCpuOrder(void) const {
+	const CpuTopology &topology = CpuTopology::get();
+	const int numCpus = topology.getCpuCount();
+	std::vector<int> order;
+
+	switch (kind) {
+		case Kind::None:
+			break;
+		case Kind::Explicit:
+			order = cpus;
+			break;
+		case Kind::Compact:
+			for (int i = 0; i < numCpus; i++) {
+				order.push_back(topology.getCpu(i).id);
+			}
+			break;
+		case Kind::OnePerCore:
+			// CPUs are sorted by core, so the first of every run of equal cores
+			for (int i = 0; i < numCpus; i++) {
+				if (i == 0 || topology.getCpu(i).core != topology.getCpu(i - 1).core) {
+					order.push_back(topology.getCpu(i).id);
+				}
+			}
+			break;
+		case Kind::Scatter: {
+			// Every node's CPUs, the first hyper-thread of every core before any second one
+			std::vector<std::vector<int> > perNode(topology.getNodeCount());
+			for (int rank = 0; ; rank++) {
+				bool found = false;
+				int sibling = 0;
+				for (int i = 0; i < numCpus; i++) {
+					const CpuTopology::Cpu &cpu = topology.getCpu(i);
+					sibling = (i > 0 && cpu.core == topology.getCpu(i - 1).core) ? sibling + 1 : 0;
+					if (sibling == rank) {
+						perNode[cpu.node].push_back(cpu.id);
+						found = true;
+					}
+				}
+				if (!found) {
+					break;
+				}
+			}
+			// Then one from every node in turn
+			for (int k = 0; int(order.size()) < numCpus; k++) {
+				for (int n = 0; n < int(perNode.size()); n++) {
+					if (k < int(perNode[n].size())) {
+						order.push_back(perNode[n][k]);
+					}
+				}
+			}
+			break;
+		}
+	}
+	return order;
+}
+
+#ifdef _WIN32
+typedef HANDLE ThreadHandle;
+#elif defined(__linux__)
+typedef pthread_t ThreadHandle;
+#else
+typedef std::thread::native_handle_type ThreadHandle;
+#endif
+
+static int setAffinity(ThreadHandle thread, int cpuId) {
+#ifdef __linux__
+	if (cpuId < 0 || cpuId >= CPU_SETSIZE) {
+		return -1;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpuId, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+#elif defined(_WIN32)
+	if (cpuId < 0 || cpuId >= int(sizeof(DWORD_PTR) * 8)) {
+		return -1;
+	}
+	return SetThreadAffinityMask(thread, DWORD_PTR(1) << cpuId) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+static int clearAffinity(ThreadHandle thread) {
+#ifdef __linux__
+	const CpuTopology &topology = CpuTopology::get();
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < topology.getCpuCount(); i++) {
+		if (topology.getCpu(i).id < CPU_SETSIZE) {
+			CPU_SET(topology.getCpu(i).id, &set);
+		}
+	}
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+#elif defined(_WIN32)
+	DWORD_PTR processMask = 0, systemMask = 0;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+		return -1;
+	}
+	return SetThreadAffinityMask(thread, processMask) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+int a7az0th::setThreadAffinity(std::thread &thread, int cpuId) {
+	return setAffinity(thread.native_handle(), cpuId);
+}
+
+int a7az0th::clearThreadAffinity(std::thread &thread) {
+	return clearAffinity(thread.native_handle());
+}
+
+int a7az0th::setCurrentThreadAffinity(int cpuId) {
+#ifdef _WIN32
+	return setAffinity(GetCurrentThread(), cpuId);
+#elif defined(__linux__)
+	return setAffinity(pthread_self(), cpuId);
+#else
+	return -1;
+#endif
+}
+
+int a7az0th::clearCurrentThreadAffinity(void) {
+#ifdef _WIN32
+	return clearAffinity(GetCurrentThread());
+#elif defined(__linux__)
+	return clearAffinity(pthread_self());
+#else
+	return -1;
+#endif
+}
+
+int a7az0th::getCurrentCpu(void) {
+#ifdef __linux__
+	return sched_getcpu();
+#elif defined(_WIN32)
+	return int(GetCurrentProcessorNumber());
+#else
+	return -1;
+#endif
+}
@@ -0,0 +1,148 @@
+#include "scheduler.h"
+
+using namespace a7az0th;
+
+// The scheduler the calling thread is a worker of, and its index there
+static thread_local TaskScheduler *currentScheduler = nullptr;
+static thread_local int currentWorker = -1;
+
+// Finding no task this many times in a row sends a worker to sleep. With a single CPU spinning only delays the others
+static const int IDLE_SPINS = (getProcessorCount() > 1) ? 2000 : 0;
+
+TaskGroup::TaskGroup(TaskScheduler &scheduler) : scheduler(scheduler), pending(0) {}
+
+TaskGroup::~TaskGroup() {
+	sync();
+}
+
+void TaskGroup::spawn(std::function<void()> task) {
+	pending++;
+	TaskScheduler::Task t = { std::move(task), this };
+	scheduler.push(t);
+}
+
+void TaskGroup::sync() {
+	TaskScheduler::Task task;
+	while (pending) {
+		if (scheduler.pop(task)) {
+			scheduler.execute(task);
+		} else {
+			// The remaining tasks run elsewhere
+			std::this_thread::yield();
+		}
+	}
+}
+
+TaskScheduler::TaskScheduler(int numWorkers) : queued(0), sleepers(0), stop(false) {
+	if (numWorkers < 0) {
+		numWorkers = getProcessorCount() - 1;
+	}
+	for (int i = 0; i <= numWorkers; i++) {
+		queues.push_back(newAligned<WorkQueue>());
+	}
+	for (int i = 0; i < numWorkers; i++) {
+		workers.push_back(std::thread(&TaskScheduler::workerProc, this, i));
+	}
+}
+
+TaskScheduler::~TaskScheduler() {
+	{
+		std::unique_lock<std::mutex> lk(sleepMutex);
+		stop = true;
+	}
+	wakeUp.notify_all();
+	for (int i = 0; i < int(workers.size()); i++) {
+		workers[i].join();
+	}
+	for (int i = 0; i < int(queues.size()); i++) {
+		deleteAligned(queues[i]);
+	}
+}
+
+int TaskScheduler::getQueueIndex() const {
+	return (currentScheduler == this) ? currentWorker : int(queues.size()) - 1;
+}
+
+void TaskScheduler::push(Task &task) {
+	WorkQueue &queue = *queues[getQueueIndex()];
+	{
+		MutexRAII guard(queue.lock);
+		queue.tasks.push_back(std::move(task));
+	}
+	// Count the task before looking for sleepers. A worker about to park counts itself first and then looks at queued
+	queued++;
+	if (sleepers) {
+		std::unique_lock<std::mutex> lk(sleepMutex);
+		wakeUp.notify_one();
+	}
+}
+
+bool TaskScheduler::pop(Task &task) {
+	if (!queued) {
+		return false;
+	}
+	const int numQueues = int(queues.size());
+	const int own = getQueueIndex();
+
+	// Newest first from our own deque, oldest first from everyone else's
+	for (int k = 0; k < numQueues; k++) {
+		const int i = (own + k) % numQueues;
+		WorkQueue &queue = *queues[i];
+		MutexRAII guard(queue.lock);
+		if (queue.tasks.empty()) {
+			continue;
+		}
+		if (i == own) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		} else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		queued--;
+		return true;
+	}
+	return false;
+}
+
+void TaskScheduler::execute(Task &task) {
+	task.work();
+	task.work = nullptr;
+	task.group->pending--;
+}
+
+void TaskScheduler::workerProc(int index) {
+	currentScheduler = this;
+	currentWorker = index;
+
+	Task task;
+	int idle = 0;
+	while (!stop) {
+		if (pop(task)) {
+			execute(task);
+			idle = 0;
+			continue;
+		}
+		if (++idle < IDLE_SPINS) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lk(sleepMutex);
+		sleepers++;
+		wakeUp.wait(lk, [this] { return stop || queued > 0; });
+		sleepers--;
+		idle = 0;
+	}
+}
+
+void TaskScheduler::run(MultiThreaded *job, int numThreads) {
+	TaskGroup group(*this);
+	for (int i = 0; i < numThreads; i++) {
+		group.spawn([job, i, numThreads] { job->threadProc(i, numThreads); });
+	}
+	group.sync();
+}
+
+void MultiThreaded::run(TaskScheduler& scheduler, int numThreads) {
+	scheduler.run(this, numThreads);
+}